@@ -0,0 +1,215 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cpp_lib/util/time/time.h"
+
+namespace cpp_lib {
+
+namespace cache {
+
+enum TraceOp {
+  kTraceGet = 0,  // a read, hit or not
+  kTraceSet = 1,  // an insert or update
+};
+
+/**
+ * One sampled access. The key is the mixed hash of the cache key, the time
+ * is in milliseconds since the trace started.
+ */
+struct TraceRecord {
+  uint64_t key;
+  uint32_t time_ms;
+  uint8_t op;
+  uint8_t hit;
+  uint16_t reserved;
+};
+
+struct TraceOptions {
+  // Share of the keys traced, every access of a traced key is recorded
+  double sample_rate = 0.01;
+  // The trace stops by itself after this many records
+  size_t max_records = 1UL << 26;
+};
+
+/**
+ * Samples the accesses of a cache into a binary file for offline
+ * simulation, see cache/tools/cache_sim.cc and LRUCache::start_trace.
+ *
+ * Keys are sampled spatially: a key is traced with all its accesses if its
+ * mixed hash falls below sample_rate of the hash space, so that reuse
+ * distances are kept and a simulated cache of sample_rate times the size
+ * sees the same hit ratio. Accesses of other keys cost a hash and a compare,
+ * and nothing at all when the trace isn't running.
+ *
+ * The file is native endian:
+ *   TraceHeader | TraceRecord...
+ */
+class AccessTrace {
+ public:
+  struct TraceHeader {
+    char magic[8];
+    double sample_rate;
+    // Wall time the trace started in milliseconds
+    int64_t start_time_ms;
+  };
+
+  static constexpr char kMagic[8] = {'C', 'L', 'R', 'U', 'T', 'R', 'C', '1'};
+  // Records buffered between two writes
+  static constexpr size_t kBufferRecords = 4096;
+
+  AccessTrace() = default;
+
+  AccessTrace(const AccessTrace&) = delete;
+  AccessTrace& operator=(const AccessTrace&) = delete;
+
+  ~AccessTrace() { stop(); }
+
+  /**
+   * Start writing to path, replacing a running trace. Returns false if the
+   * file can't be written.
+   */
+  bool start(const std::string& path, const TraceOptions& options) {
+    stop();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_file = fopen(path.c_str(), "wb");
+    if (m_file == nullptr) {
+      return false;
+    }
+    TraceHeader header;
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.sample_rate = clamp_sample_rate(options.sample_rate);
+    header.start_time_ms = GetCoarseTimeMillis();
+    if (fwrite(&header, sizeof(header), 1, m_file) != 1) {
+      fclose(m_file);
+      m_file = nullptr;
+      return false;
+    }
+    m_start_time = header.start_time_ms;
+    m_max_records = options.max_records;
+    m_record_num = 0;
+    m_threshold.store(sample_threshold(options.sample_rate), std::memory_order_relaxed);
+    m_active.store(true, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Flush and close the file, returns false if a write failed
+   */
+  bool stop() {
+    m_active.store(false, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_file == nullptr) {
+      return true;
+    }
+    bool ok = flush() && !m_failed;
+    ok = fclose(m_file) == 0 && ok;
+    m_file = nullptr;
+    m_failed = false;
+    return ok;
+  }
+
+  bool active() const { return m_active.load(std::memory_order_acquire); }
+
+  /**
+   * Record an access of the key with hash if the key is sampled
+   */
+  void record(size_t hash, TraceOp op, bool hit) {
+    if (!active()) {
+      return;
+    }
+    uint64_t key = mix(hash);
+    if (key > m_threshold.load(std::memory_order_relaxed)) {
+      return;
+    }
+    TraceRecord record{key, 0, static_cast<uint8_t>(op), static_cast<uint8_t>(hit ? 1 : 0), 0};
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_file == nullptr) {
+      return;
+    }
+    record.time_ms = static_cast<uint32_t>(GetCoarseTimeMillis() - m_start_time);
+    m_buffer.push_back(record);
+    if (++m_record_num >= m_max_records) {
+      m_active.store(false, std::memory_order_relaxed);
+    }
+    if (m_buffer.size() >= kBufferRecords) {
+      m_failed = !flush() || m_failed;
+    }
+  }
+
+  /**
+   * Read a whole trace file, returns false if it isn't one
+   */
+  static bool load(const std::string& path, TraceHeader& header, std::vector<TraceRecord>& records) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+      return false;
+    }
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, kMagic, sizeof(kMagic)) == 0;
+    TraceRecord buffer[kBufferRecords];
+    size_t num = 0;
+    while (ok && (num = fread(buffer, sizeof(TraceRecord), kBufferRecords, file)) > 0) {
+      records.insert(records.end(), buffer, buffer + num);
+    }
+    fclose(file);
+    return ok;
+  }
+
+  /**
+   * The key hash of the trace, a 64 bit finalizer as cache hashes are often
+   * the identity of integers
+   */
+  static uint64_t mix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+  }
+
+  /**
+   * The sample rate within [0, 1], NaN is 0
+   */
+  static double clamp_sample_rate(double sample_rate) {
+    return sample_rate > 0 ? (sample_rate < 1 ? sample_rate : 1) : 0;
+  }
+
+  /**
+   * The largest mixed hash sampled at sample_rate. Rates of 1 and above
+   * sample everything, the cast is only done for rates in [0, 1) where it
+   * can't overflow.
+   */
+  static uint64_t sample_threshold(double sample_rate) {
+    sample_rate = clamp_sample_rate(sample_rate);
+    return sample_rate >= 1 ? UINT64_MAX : static_cast<uint64_t>(sample_rate * 0x1p64);
+  }
+
+ private:
+  bool flush() {
+    bool ok = m_buffer.empty() || fwrite(m_buffer.data(), sizeof(TraceRecord), m_buffer.size(), m_file) ==
+                                      m_buffer.size();
+    m_buffer.clear();
+    return ok;
+  }
+
+  std::atomic<bool> m_active{false};
+  std::atomic<uint64_t> m_threshold{0};
+  std::mutex m_mutex;
+  FILE* m_file = nullptr;
+  bool m_failed = false;
+  int64_t m_start_time = 0;
+  size_t m_max_records = 0;
+  size_t m_record_num = 0;
+  std::vector<TraceRecord> m_buffer;
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cpp_lib {
+
+namespace cache {
+
+/**
+ * A dedicated eviction thread shared by the shards of one cache. Shards call
+ * notify() when they need eviction; the thread wakes up, runs the evict
+ * function of every notified shard until it reports no remaining work, and
+ * goes back to sleep. It also wakes up every tick_ms to run all shards, so
+ * expired items are reclaimed while there are no inserts.
+ */
+class CacheEvictor {
+ public:
+  // Evict a bounded batch, return true if more work remains
+  using EvictFunc = std::function<bool()>;
+
+  explicit CacheEvictor(uint32_t tick_ms = 1000) : m_tick_ms(tick_ms) {}
+
+  CacheEvictor(const CacheEvictor&) = delete;
+  CacheEvictor& operator=(const CacheEvictor&) = delete;
+
+  ~CacheEvictor() { stop(); }
+
+  /**
+   * Register an evict function before start(), returns its index for notify()
+   */
+  size_t add(const EvictFunc& func) {
+    m_funcs.push_back(func);
+    m_pending.emplace_back(new std::atomic<bool>(false));
+    return m_funcs.size() - 1;
+  }
+
+  void start() {
+    m_thread = std::thread([this] { this->run(); });
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_stop.exchange(true, std::memory_order_acq_rel)) {
+        return;
+      }
+    }
+    m_cond.notify_all();
+    if (m_thread.joinable()) {
+      m_thread.join();
+    }
+  }
+
+  /**
+   * Ask for eviction of the given shard. Cheap when a request is already
+   * pending, so it can be called on every insert.
+   */
+  void notify(size_t index) {
+    if (m_pending[index]->exchange(true, std::memory_order_acq_rel)) {
+      return;
+    }
+    if (!m_signaled.exchange(true, std::memory_order_acq_rel)) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_cond.notify_one();
+    }
+  }
+
+ private:
+  void run() {
+    while (true) {
+      bool tick = false;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto ready = [this] {
+          return m_stop.load(std::memory_order_acquire) || m_signaled.load(std::memory_order_acquire);
+        };
+        if (!m_cond.wait_for(lock, std::chrono::milliseconds(m_tick_ms), ready)) {
+          tick = true;
+        }
+        if (m_stop.load(std::memory_order_acquire)) {
+          return;
+        }
+      }
+      m_signaled.store(false, std::memory_order_release);
+      bool more = true;
+      while (more && !m_stop.load(std::memory_order_acquire)) {
+        more = false;
+        for (size_t i = 0; i < m_funcs.size(); i++) {
+          if (!tick && !m_pending[i]->exchange(false, std::memory_order_acq_rel)) {
+            continue;
+          }
+          if (tick) {
+            m_pending[i]->store(false, std::memory_order_release);
+          }
+          if (m_funcs[i]()) {
+            m_pending[i]->store(true, std::memory_order_release);
+            more = true;
+          }
+        }
+        tick = false;
+      }
+    }
+  }
+
+  uint32_t m_tick_ms;
+  std::vector<EvictFunc> m_funcs;
+  std::vector<std::unique_ptr<std::atomic<bool>>> m_pending;
+  std::atomic<bool> m_signaled{false};
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  // Written under m_mutex for the wait, read without it between batches
+  std::atomic<bool> m_stop{false};
+  std::thread m_thread;
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
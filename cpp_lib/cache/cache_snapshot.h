@@ -0,0 +1,313 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "cpp_lib/coro/coro.h"
+
+namespace cpp_lib {
+
+namespace cache {
+
+/**
+ * Encodes keys and values into a snapshot. encode() appends the bytes of a
+ * value to out, decode() reads one from [pos, end), advances pos past it and
+ * returns false on truncated or corrupt input.
+ *
+ * Trivially copyable types, std::string and vectors of trivially copyable
+ * types such as embeddings are supported. Specialize it or pass another codec
+ * with the same static functions to CacheSnapshot for other types.
+ */
+template <class T, class Enable = void>
+struct SnapshotCodec {
+  static_assert(sizeof(T) == 0, "no SnapshotCodec for the type, specialize cache::SnapshotCodec");
+};
+
+template <class T>
+struct SnapshotCodec<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+  static void encode(const T& value, std::string& out) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  static bool decode(const char*& pos, const char* end, T& value) {
+    if (static_cast<size_t>(end - pos) < sizeof(T)) {
+      return false;
+    }
+    memcpy(&value, pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+  }
+};
+
+template <>
+struct SnapshotCodec<std::string> {
+  static void encode(const std::string& value, std::string& out) {
+    SnapshotCodec<uint32_t>::encode(static_cast<uint32_t>(value.size()), out);
+    out.append(value);
+  }
+
+  static bool decode(const char*& pos, const char* end, std::string& value) {
+    uint32_t size = 0;
+    if (!SnapshotCodec<uint32_t>::decode(pos, end, size) || static_cast<size_t>(end - pos) < size) {
+      return false;
+    }
+    value.assign(pos, size);
+    pos += size;
+    return true;
+  }
+};
+
+template <class T>
+struct SnapshotCodec<std::vector<T>, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+  static void encode(const std::vector<T>& value, std::string& out) {
+    SnapshotCodec<uint32_t>::encode(static_cast<uint32_t>(value.size()), out);
+    out.append(reinterpret_cast<const char*>(value.data()), value.size() * sizeof(T));
+  }
+
+  static bool decode(const char*& pos, const char* end, std::vector<T>& value) {
+    uint32_t size = 0;
+    if (!SnapshotCodec<uint32_t>::decode(pos, end, size) || static_cast<size_t>(end - pos) / sizeof(T) < size) {
+      return false;
+    }
+    value.resize(size);
+    memcpy(value.data(), pos, size * sizeof(T));
+    pos += size * sizeof(T);
+    return true;
+  }
+};
+
+/**
+ * Saves a ConcurrentScalableCache to a file and loads it back, to restart
+ * with a warm cache.
+ *
+ * save() streams the shards one at a time, see snapshot_items, so writers
+ * are only blocked while the keys of one shard are copied. Each item keeps
+ * its absolute expire time and the items of a shard are written from least
+ * to most recently used. The file is written next to path and renamed over
+ * it when complete.
+ *
+ * load() maps the file and restores the shards of the snapshot in parallel
+ * on the coro pool, the items of a saved shard in order so that the recency
+ * order is rebuilt. The loading cache may have another shard count or
+ * capacity; expired and stale items are dropped. Invalidated items are not
+ * saved, the others keep their tags.
+ *
+ * The format is native endian and is meant for restarting on the same kind
+ * of host:
+ *   magic | block... | footer
+ * A block holds the items of one saved shard as a BlockHeader and records of
+ *   expire_time (int64) | tag (uint64) | negative (uint8) | key | value unless negative
+ * and the footer is a BlockHeader with kFooterShard and the total item count
+ * in size.
+ */
+template <class TCache, class KeyCodec, class ValueCodec>
+class CacheSnapshot {
+ public:
+  typedef typename TCache::SnapshotItem SnapshotItem;
+  typedef typename TCache::ValueRef ValueRef;
+  typedef decltype(SnapshotItem::key) Key;
+  typedef typename std::remove_const<typename ValueRef::element_type>::type Value;
+
+  /**
+   * Write all items of cache to path, returns false on I/O errors
+   */
+  static bool save(TCache& cache, const std::string& path) {
+    std::string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (file == nullptr) {
+      return false;
+    }
+    bool ok = fwrite(kMagic, 1, sizeof(kMagic), file) == sizeof(kMagic);
+    uint64_t total = 0;
+    std::string buffer;
+    std::vector<SnapshotItem> items;
+    for (size_t shard = 0; ok && shard < cache.num_shards(); shard++) {
+      items.clear();
+      cache.snapshot_items(shard, items);
+      uint32_t item_num = 0;
+      for (size_t i = 0; ok && i < items.size(); i++) {
+        encode_item(items[i], buffer);
+        item_num++;
+        if (buffer.size() >= kBlockBytes || i + 1 == items.size()) {
+          ok = write_block(file, static_cast<uint32_t>(shard), item_num, buffer);
+          total += item_num;
+          item_num = 0;
+          buffer.clear();
+        }
+      }
+    }
+    if (ok) {
+      BlockHeader footer{kFooterShard, 0, total};
+      ok = fwrite(&footer, sizeof(footer), 1, file) == 1;
+    }
+    ok = fflush(file) == 0 && ok;
+    ok = fsync(fileno(file)) == 0 && ok;
+    ok = fclose(file) == 0 && ok;
+    if (ok) {
+      ok = rename(tmp_path.c_str(), path.c_str()) == 0;
+    }
+    if (!ok) {
+      unlink(tmp_path.c_str());
+    }
+    return ok;
+  }
+
+  /**
+   * Restore the items of the snapshot at path into cache. Returns false if
+   * the file can't be read or is corrupt; the blocks are checked before any
+   * item is restored, but a corrupt record stops its block only. item_num
+   * is set to the number of restored items if not null.
+   */
+  static bool load(TCache& cache, const std::string& path, size_t* item_num = nullptr) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(kMagic) + sizeof(BlockHeader)) {
+      close(fd);
+      return false;
+    }
+    size_t file_size = static_cast<size_t>(st.st_size);
+    void* addr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      return false;
+    }
+    madvise(addr, file_size, MADV_WILLNEED);
+    const char* data = static_cast<const char*>(addr);
+    std::vector<std::vector<Block>> shards;
+    bool ok = index_blocks(data, file_size, shards);
+    std::atomic<size_t> restored{0};
+    std::atomic<bool> corrupt{false};
+    if (ok) {
+      ParallelFor(0, shards.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          for (const Block& block : shards[i]) {
+            if (!restore_block(cache, block, restored)) {
+              corrupt.store(true, std::memory_order_relaxed);
+            }
+          }
+        }
+      });
+    }
+    munmap(addr, file_size);
+    if (item_num != nullptr) {
+      *item_num = restored.load();
+    }
+    return ok && !corrupt.load();
+  }
+
+ private:
+  static constexpr char kMagic[8] = {'C', 'L', 'R', 'U', 'S', 'N', 'P', '2'};
+  static constexpr uint32_t kFooterShard = UINT32_MAX;
+  // Shards are picked with 16 hash bits, a larger saved shard is corrupt
+  static constexpr uint32_t kMaxShards = 1u << 16;
+  // Blocks are flushed at this size, a saved shard may span several blocks
+  static constexpr size_t kBlockBytes = 1 << 20;
+
+  struct BlockHeader {
+    uint32_t shard;
+    uint32_t item_num;
+    uint64_t size;
+  };
+
+  struct Block {
+    const char* begin;
+    const char* end;
+    uint32_t item_num;
+  };
+
+  static void encode_item(const SnapshotItem& item, std::string& out) {
+    SnapshotCodec<int64_t>::encode(item.expire_time, out);
+    SnapshotCodec<uint64_t>::encode(item.tag, out);
+    SnapshotCodec<uint8_t>::encode(item.value ? 0 : 1, out);
+    KeyCodec::encode(item.key, out);
+    if (item.value) {
+      ValueCodec::encode(*item.value, out);
+    }
+  }
+
+  static bool write_block(FILE* file, uint32_t shard, uint32_t item_num, const std::string& payload) {
+    BlockHeader header{shard, item_num, payload.size()};
+    return fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(payload.data(), 1, payload.size(), file) == payload.size();
+  }
+
+  /**
+   * Check the magic, the block bounds and the footer, and group the blocks by
+   * their saved shard
+   */
+  static bool index_blocks(const char* data, size_t size, std::vector<std::vector<Block>>& shards) {
+    if (memcmp(data, kMagic, sizeof(kMagic)) != 0) {
+      return false;
+    }
+    const char* pos = data + sizeof(kMagic);
+    const char* end = data + size;
+    uint64_t total = 0;
+    while (static_cast<size_t>(end - pos) >= sizeof(BlockHeader)) {
+      BlockHeader header;
+      memcpy(&header, pos, sizeof(header));
+      pos += sizeof(header);
+      if (header.shard == kFooterShard) {
+        return pos == end && header.size == total;
+      }
+      if (static_cast<uint64_t>(end - pos) < header.size || header.shard >= kMaxShards) {
+        return false;
+      }
+      if (header.shard >= shards.size()) {
+        shards.resize(header.shard + 1);
+      }
+      shards[header.shard].push_back(Block{pos, pos + header.size, header.item_num});
+      total += header.item_num;
+      pos += header.size;
+    }
+    // Truncated before the footer
+    return false;
+  }
+
+  static bool restore_block(TCache& cache, const Block& block, std::atomic<size_t>& restored) {
+    const char* pos = block.begin;
+    size_t count = 0;
+    for (uint32_t i = 0; i < block.item_num; i++) {
+      int64_t expire_time = 0;
+      uint64_t tag = 0;
+      uint8_t negative = 0;
+      Key key;
+      if (!SnapshotCodec<int64_t>::decode(pos, block.end, expire_time) ||
+          !SnapshotCodec<uint64_t>::decode(pos, block.end, tag) ||
+          !SnapshotCodec<uint8_t>::decode(pos, block.end, negative) || !KeyCodec::decode(pos, block.end, key)) {
+        restored += count;
+        return false;
+      }
+      ValueRef value;
+      if (!negative) {
+        Value decoded;
+        if (!ValueCodec::decode(pos, block.end, decoded)) {
+          restored += count;
+          return false;
+        }
+        value = std::make_shared<const Value>(std::move(decoded));
+      }
+      if (cache.restore(key, std::move(value), expire_time, tag)) {
+        count++;
+      }
+    }
+    restored += count;
+    return pos == block.end;
+  }
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
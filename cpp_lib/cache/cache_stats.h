@@ -0,0 +1,277 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace cpp_lib {
+
+namespace cache {
+
+/**
+ * A counter striped over cache lines, bumped by many threads at once. add()
+ * only touches the stripe of the calling thread, load() sums the stripes.
+ */
+class StripedCounter {
+ public:
+  static constexpr size_t kStripeNum = 8;
+
+  void add(size_t n = 1) { m_stripes[stripe_index()].value.fetch_add(n, std::memory_order_relaxed); }
+
+  size_t load() const {
+    size_t sum = 0;
+    for (const Stripe& stripe : m_stripes) {
+      sum += stripe.value.load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+ private:
+  struct alignas(64) Stripe {
+    std::atomic<size_t> value{0};
+  };
+
+  static size_t stripe_index() {
+    static std::atomic<size_t> next_index{0};
+    thread_local size_t index = next_index.fetch_add(1, std::memory_order_relaxed) % kStripeNum;
+    return index;
+  }
+
+  Stripe m_stripes[kStripeNum];
+};
+
+/**
+ * A copy of a LatencyHistogram. Bucket 0 counts 0ns, bucket i > 0 counts
+ * [2^(i-1), 2^i) nanoseconds, the last one everything above.
+ */
+struct HistogramSnapshot {
+  static constexpr int kBucketNum = 40;
+
+  size_t count = 0;
+  uint64_t sum_ns = 0;
+  size_t buckets[kBucketNum] = {};
+
+  HistogramSnapshot& operator+=(const HistogramSnapshot& other) {
+    count += other.count;
+    sum_ns += other.sum_ns;
+    for (int i = 0; i < kBucketNum; i++) {
+      buckets[i] += other.buckets[i];
+    }
+    return *this;
+  }
+
+  double mean_ns() const { return count != 0 ? static_cast<double>(sum_ns) / count : 0; }
+
+  /**
+   * The upper bound of the bucket holding the q quantile, 0 <= q <= 1
+   */
+  uint64_t percentile_ns(double q) const {
+    size_t rank = static_cast<size_t>(q * count);
+    size_t seen = 0;
+    for (int i = 0; i < kBucketNum; i++) {
+      seen += buckets[i];
+      if (seen > rank || (seen == count && seen != 0)) {
+        return i == 0 ? 0 : uint64_t(1) << i;
+      }
+    }
+    return 0;
+  }
+};
+
+/**
+ * Latencies in log2 buckets of nanoseconds, see HistogramSnapshot. record()
+ * is two relaxed atomic adds.
+ */
+class LatencyHistogram {
+ public:
+  void record(uint64_t ns) {
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= HistogramSnapshot::kBucketNum) {
+      bucket = HistogramSnapshot::kBucketNum - 1;
+    }
+    m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_sum_ns.fetch_add(ns, std::memory_order_relaxed);
+  }
+
+  HistogramSnapshot snapshot() const {
+    HistogramSnapshot snapshot;
+    for (int i = 0; i < HistogramSnapshot::kBucketNum; i++) {
+      snapshot.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+      snapshot.count += snapshot.buckets[i];
+    }
+    snapshot.sum_ns = m_sum_ns.load(std::memory_order_relaxed);
+    return snapshot;
+  }
+
+  static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+ private:
+  std::atomic<size_t> m_buckets[HistogramSnapshot::kBucketNum] = {};
+  std::atomic<uint64_t> m_sum_ns{0};
+};
+
+/**
+ * Records the time from its construction to its destruction, nothing with a
+ * null histogram
+ */
+class LatencyTimer {
+ public:
+  explicit LatencyTimer(LatencyHistogram* histogram)
+      : m_histogram(histogram), m_start(histogram != nullptr ? LatencyHistogram::now_ns() : 0) {}
+
+  ~LatencyTimer() {
+    if (m_histogram != nullptr) {
+      m_histogram->record(LatencyHistogram::now_ns() - m_start);
+    }
+  }
+
+  LatencyTimer(const LatencyTimer&) = delete;
+  LatencyTimer& operator=(const LatencyTimer&) = delete;
+
+ private:
+  LatencyHistogram* m_histogram;
+  uint64_t m_start;
+};
+
+/**
+ * Counters of one cache shard, see ConcurrentLRUCache::stats. Added up they
+ * are the stats of a whole cache.
+ */
+struct ShardStats {
+  // Reads which found a live value or a negative item, and the others,
+  // see ConcurrentLRUCache::count_read
+  size_t hits = 0;
+  size_t misses = 0;
+  // Misses which found the item past its expire time
+  size_t expired_reads = 0;
+  // Misses which found a stale value, lookup serves it while it is reloaded
+  size_t stale_reads = 0;
+  // Inserts of new keys and of existing ones
+  size_t inserts = 0;
+  size_t updates = 0;
+  // Items removed for capacity, their total weight, and items removed expired
+  size_t evictions = 0;
+  size_t evicted_weight = 0;
+  size_t expirations = 0;
+  // Items removed after an invalidation, see GenerationTable
+  size_t invalidated = 0;
+  // Exclusive acquisitions of the list lock which had to wait, and the time
+  // they waited
+  size_t list_waits = 0;
+  uint64_t list_wait_ns = 0;
+  size_t size = 0;
+  size_t weighted_size = 0;
+  // The current limits, the maximum size_t when unbounded
+  size_t max_size = 0;
+  size_t max_weight = 0;
+  // Latencies of every key looked up, inserted or evicted, empty unless
+  // CacheOptions::record_latency is set
+  HistogramSnapshot find_latency;
+  HistogramSnapshot insert_latency;
+  HistogramSnapshot evict_latency;
+
+  ShardStats& operator+=(const ShardStats& other) {
+    hits += other.hits;
+    misses += other.misses;
+    expired_reads += other.expired_reads;
+    stale_reads += other.stale_reads;
+    inserts += other.inserts;
+    updates += other.updates;
+    evictions += other.evictions;
+    evicted_weight += other.evicted_weight;
+    expirations += other.expirations;
+    invalidated += other.invalidated;
+    list_waits += other.list_waits;
+    list_wait_ns += other.list_wait_ns;
+    size += other.size;
+    weighted_size += other.weighted_size;
+    // Saturate the unbounded limits
+    max_size = max_size + other.max_size < max_size ? SIZE_MAX : max_size + other.max_size;
+    max_weight = max_weight + other.max_weight < max_weight ? SIZE_MAX : max_weight + other.max_weight;
+    find_latency += other.find_latency;
+    insert_latency += other.insert_latency;
+    evict_latency += other.evict_latency;
+    return *this;
+  }
+
+  double hit_ratio() const { return hits + misses != 0 ? static_cast<double>(hits) / (hits + misses) : 0; }
+
+  /**
+   * One line of the counters and the latency percentiles, for logs
+   */
+  std::string to_string() const {
+    char buf[768];
+    snprintf(buf, sizeof(buf),
+             "size=%zu weighted_size=%zu hits=%zu misses=%zu hit_ratio=%.4f expired_reads=%zu stale_reads=%zu "
+             "inserts=%zu updates=%zu evictions=%zu expirations=%zu invalidated=%zu list_waits=%zu "
+             "list_wait_us=%llu find_p50_ns=%llu find_p99_ns=%llu insert_p50_ns=%llu insert_p99_ns=%llu "
+             "evict_p99_ns=%llu",
+             size, weighted_size, hits, misses, hit_ratio(), expired_reads, stale_reads, inserts, updates, evictions,
+             expirations, invalidated, list_waits, static_cast<unsigned long long>(list_wait_ns / 1000),
+             static_cast<unsigned long long>(find_latency.percentile_ns(0.5)),
+             static_cast<unsigned long long>(find_latency.percentile_ns(0.99)),
+             static_cast<unsigned long long>(insert_latency.percentile_ns(0.5)),
+             static_cast<unsigned long long>(insert_latency.percentile_ns(0.99)),
+             static_cast<unsigned long long>(evict_latency.percentile_ns(0.99)));
+    return buf;
+  }
+};
+
+/**
+ * A thread passing the stats of a cache to a sink every interval, see
+ * LRUCache::start_stats_dump
+ */
+class StatsDumper {
+ public:
+  using StatsFunc = std::function<ShardStats()>;
+  using SinkFunc = std::function<void(const ShardStats&)>;
+
+  StatsDumper(uint32_t interval_ms, const StatsFunc& stats_func, const SinkFunc& sink)
+      : m_interval_ms(interval_ms), m_stats_func(stats_func), m_sink(sink) {
+    m_thread = std::thread([this] { this->run(); });
+  }
+
+  StatsDumper(const StatsDumper&) = delete;
+  StatsDumper& operator=(const StatsDumper&) = delete;
+
+  ~StatsDumper() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+  }
+
+ private:
+  void run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_cond.wait_for(lock, std::chrono::milliseconds(m_interval_ms), [this] { return m_stop; })) {
+      lock.unlock();
+      m_sink(m_stats_func());
+      lock.lock();
+    }
+  }
+
+  uint32_t m_interval_ms;
+  StatsFunc m_stats_func;
+  SinkFunc m_sink;
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  bool m_stop = false;
+  std::thread m_thread;
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
@@ -3,7 +3,11 @@
 #include <tbb/concurrent_hash_map.h>
 #include <time.h>
 
+#include <algorithm>
 #include <atomic>
+#include <functional>
+#include <limits>
+#include <memory>
 #include <mutex>
 #include <new>
 #include <shared_mutex>
@@ -11,60 +15,246 @@
 #include <unordered_map>
 #include <vector>
 
+#include "cpp_lib/cache/cache_evictor.h"
+#include "cpp_lib/cache/cache_stats.h"
+#include "cpp_lib/cache/frequency_sketch.h"
+#include "cpp_lib/cache/generations.h"
+#include "cpp_lib/cache/map_backend.h"
+#include "cpp_lib/cache/raw_index.h"
+#include "cpp_lib/cache/slab_allocator.h"
+#include "cpp_lib/cache/timer_wheel.h"
 #include "cpp_lib/coro/coro.h"
+#include "cpp_lib/util/time/time.h"
 
 namespace cpp_lib {
 
 namespace cache {
 static constexpr int kMaxEvictBatch = 64;
+// The ttl_ms of an insert which uses the timeout of CacheOptions
+static constexpr int64_t kTtlDefault = -1;
 
 enum CacheEvictType {
   kEvictBatch = 0,  // evict batch items once which are expired or overload
   kEvictOne = 1,    // evict only one item once which is expired or overload
 };
+
+enum CacheEvictPolicy {
+  kEvictPolicyFifo = 0,   // fake LRU, order by insert/update time, find doesn't touch the list
+  kEvictPolicyLru = 1,    // find moves the item to the list head if the list lock is free
+  kEvictPolicyClock = 2,  // find only sets a reference bit, eviction gives referenced items a second chance
+};
+
+enum CacheAdmitPolicy {
+  kAdmitAll = 0,      // every inserted item enters the eviction list
+  kAdmitTinyLfu = 1,  // W-TinyLFU, items leaving the window must beat the main victim's frequency
+};
+
+enum CacheEvictMode {
+  kEvictModeCoro = 0,        // start a coro on insert to evict asynchronously, honors CacheEvictType
+  kEvictModeInline = 1,      // the inserting thread evicts at most kMaxEvictBatch items
+  kEvictModeBackground = 2,  // the CacheEvictor thread of ConcurrentScalableCache evicts, inline without one
+};
+
+// W-TinyLFU region sizes, relative to max_size and to the main region
+static constexpr double kTinyLfuWindowRatio = 0.01;
+static constexpr double kTinyLfuProtectedRatio = 0.8;
+// The share of its even split a shard keeps when ConcurrentScalableCache
+// rebalances capacity
+static constexpr double kRebalanceMinShare = 0.5;
+// Assumed average item weight to size the TinyLFU regions of a cache bounded
+// only by a weigher's weight
+static constexpr size_t kTinyLfuAvgWeight = 1024;
+
+struct CacheOptions {
+  // The maximum number of items in the container
+  size_t max_size = 0;
+  // Key expired time (with second), 0 means never expired
+  uint32_t timeout = 0;
+  // The number of shards of ConcurrentScalableCache, 0 means hardware concurrency
+  size_t num_shards = 0;
+  CacheEvictType evict_type = kEvictOne;
+  CacheEvictPolicy evict_policy = kEvictPolicyFifo;
+  // With kAdmitTinyLfu the evict policy is ignored, the regions use reference bits
+  CacheAdmitPolicy admit_policy = kAdmitAll;
+  // Who evicts after inserts, TEST_MODE always evicts inline
+  CacheEvictMode evict_mode = kEvictModeCoro;
+  // Batch finds with at least this many keys search the shards of
+  // ConcurrentScalableCache in parallel, 0 disables it
+  size_t parallel_find_size = 4096;
+  // Key expired time with millisecond, overrides timeout if not 0. Expiry is
+  // checked with the coarse clock, so it is accurate to a few milliseconds.
+  uint64_t timeout_ms = 0;
+  // The maximum total weight of the items, 0 means no limit. An item weighs 1
+  // unless the cache has a weigher. With max_weight set, a max_size of 0 means
+  // no limit on the number of items.
+  size_t max_weight = 0;
+  // Move capacity between the shards of ConcurrentScalableCache every this
+  // many milliseconds, toward the shards under eviction pressure. 0 keeps the
+  // even split.
+  uint32_t rebalance_interval_ms = 0;
+  // Round num_shards up to a power of two and pick shards with a mask
+  bool pow2_shards = false;
+  // Keep items this many milliseconds past their TTL, lookup returns them as
+  // kLookupStale meanwhile so callers can serve them while refreshing. 0 drops
+  // items at their TTL.
+  uint64_t stale_ms = 0;
+  // TTL of the negative items of insert_negative, 0 disables negative caching
+  uint64_t negative_ttl_ms = 0;
+  // Record the latency histograms of ShardStats, two clock reads per lookup,
+  // insert and eviction
+  bool record_latency = false;
+  // Also keep the items in a lock-free index for find_raw, which readers use
+  // under a cache::EpochGuard. Inserts and evictions allocate and retire one
+  // more entry per item.
+  bool epoch_reads = false;
+  // Share of the keys ConcurrentScalableCache samples to estimate its miss
+  // ratio curve online, see cache::MrcEstimator. 0 disables it.
+  double mrc_sample_rate = 0;
+  // The most sampled keys the estimator tracks, the curve covers sizes up to
+  // mrc_max_keys / mrc_sample_rate items
+  size_t mrc_max_keys = 1UL << 16;
+};
+
+/**
+ * The state of a key found by ConcurrentLRUCache::lookup
+ */
+enum LookupResult {
+  kLookupMiss = 0,      // not found, or past its TTL and stale window
+  kLookupHit = 1,       // found within its TTL
+  kLookupStale = 2,     // past its TTL but within stale_ms, the value is still there
+  kLookupNegative = 3,  // known not to exist, see insert_negative; there is no value
+};
+
 }  // namespace cache
 
-template <class TKey, class TValue, class TMutex = std::shared_mutex, class THash = tbb::tbb_hash_compare<TKey>>
+template <class TKey, class TValue, class TMutex = std::shared_mutex, class THash = tbb::tbb_hash_compare<TKey>,
+          class TBackend = cache::TbbMapBackend>
 struct ConcurrentLRUCache {
+ public:
+  /**
+   * A refcounted handle of a stored value. It stays valid after the bucket
+   * lock is released and after the item is evicted or updated, the value is
+   * destroyed with the last handle.
+   */
+  typedef std::shared_ptr<const TValue> ValueRef;
+
+  /**
+   * The weight of an item counted against max_weight, typically its memory
+   * footprint in bytes. Called once per insert without any lock held.
+   */
+  typedef std::function<size_t(const TKey&, const TValue&)> Weigher;
+
+  /**
+   * An item copied by snapshot_items
+   */
+  struct SnapshotItem {
+    TKey key;
+    // nullptr for a negative item
+    ValueRef value;
+    // Absolute expire time in milliseconds without the stale window, 0 means
+    // never expired
+    int64_t expire_time;
+    // See cache::GenerationTable
+    uint64_t tag;
+  };
+
+  /**
+   * Called with every item evicted for capacity, after it is removed and
+   * without any lock held. Negative, expired and invalidated items are not
+   * passed.
+   */
+  typedef std::function<void(const SnapshotItem&)> EvictionListener;
+
  private:
   /**
-   * The LRU list node.
+   * The LRU list node, embedded in the hash map value.
    *
-   * We make a copy of the key in the list node, allowing us to find the
-   * TBB::CHM element from the list node. TBB::CHM invalidates iterators
-   * on most operations, even find(), ruling out more efficient
-   * implementations.
+   * TBB::CHM invalidates iterators on most operations, even find(), so the
+   * node keeps a pointer to the key of its CHM element to find it again. The
+   * elements of both map backends never move, the pointer is valid until the
+   * element is erased.
+   *
+   * Items with a TTL are also linked in the shard's TimerWheel.
    */
-  struct ListNode {
+  struct ListNode : public cache::TimerNode {
     ListNode() : m_prev(kOutOfListMarker), m_next(nullptr) {}
 
-    explicit ListNode(const TKey& key) : m_key(key), m_prev(kOutOfListMarker), m_next(nullptr) { update_timestamp(); }
-
-    TKey m_key;
-    time_t m_timestamp;
+    const TKey* m_key = nullptr;
+    size_t m_hash = 0;
+    // Insert or update time in milliseconds, see GetCoarseTimeMillis
+    int64_t m_timestamp = 0;
     ListNode* m_prev;
     ListNode* m_next;
+    // CLOCK reference bit, set by find without holding the list lock
+    std::atomic<bool> m_referenced{false};
+    // The generation at the last insert and the tag, see cache::GenerationTable
+    uint64_t m_generation = 0;
+    uint64_t m_tag = cache::kNoTag;
+    // The list holding the node, see ListSegment
+    uint8_t m_segment = 0;
+    // The entry of the item in the raw index with epoch_reads, replaced under
+    // the list mutex
+    typename cache::RawIndex<TKey, TValue, THash>::Entry* m_raw_entry = nullptr;
 
     bool is_in_list() const { return m_prev != kOutOfListMarker; }
 
-    void update_timestamp() { time(&m_timestamp); }
+    bool is_expired(int64_t cur_time) const { return m_expire_time != 0 && cur_time > m_expire_time; }
+
+    void update_timestamp() { m_timestamp = GetCoarseTimeMillis(); }
   };
 
   static ListNode* const kOutOfListMarker;
 
   /**
-   * The value that we store in the hashtable. The list node is allocated from
-   * an internal object_pool. The ListNode* is owned by the list.
+   * The eviction lists. Without TinyLFU only kMainSegment is used. With
+   * TinyLFU new items enter kWindowSegment, kMainSegment is the probation
+   * region of the main SLRU and kProtectedSegment its protected region.
+   */
+  enum ListSegment {
+    kMainSegment = 0,
+    kWindowSegment = 1,
+    kProtectedSegment = 2,
+    kSegmentNum = 3,
+  };
+
+  /**
+   * The "head" is the most-recently used node, and the "tail" is the
+   * least-recently used node.
+   */
+  struct LinkedList {
+    LinkedList() {
+      head.m_prev = nullptr;
+      head.m_next = &tail;
+      tail.m_prev = &head;
+    }
+
+    bool empty() const { return head.m_next == &tail; }
+
+    ListNode head;
+    ListNode tail;
+    size_t size = 0;
+  };
+
+  /**
+   * The value that we store in the hashtable, together with its list node.
+   * The whole CHM element is allocated from the shard's SlabArena. The user's
+   * value is shared with the handles returned by ConstAccessor::get_value_ref,
+   * an update replaces it instead of writing to it.
    */
   struct HashMapValue {
-    HashMapValue() : m_list_node(nullptr) {}
-    HashMapValue(const TValue& value, ListNode* node) : m_value(value), m_list_node(node) {}
+    HashMapValue() {}
 
-    TValue m_value;
-    ListNode* m_list_node;
+    ValueRef m_value;
+    size_t m_weight = 0;
+    // Relinked by find under a const accessor, guarded by the list mutex
+    mutable ListNode m_list_node;
   };
 
-  typedef tbb::concurrent_hash_map<TKey, HashMapValue, THash> HashMap;
+  typedef cache::RawIndex<TKey, TValue, THash> RawIndex;
+  typedef typename RawIndex::Entry RawEntry;
+
+  typedef cache::SlabAllocator<std::pair<const TKey, HashMapValue>> HashMapAllocator;
+  typedef typename TBackend::template Map<TKey, HashMapValue, THash, HashMapAllocator> HashMap;
   typedef typename HashMap::const_accessor HashMapConstAccessor;
   typedef typename HashMap::accessor HashMapAccessor;
   typedef typename HashMap::value_type HashMapValuePair;
@@ -83,17 +273,34 @@ struct ConcurrentLRUCache {
     // ac->func == (*(ac.operator->())).func
     const TValue* operator->() const { return get_value_ptr(); }
 
-    const TValue* get_value_ptr() const { return &(m_hash_accessor->second.m_value); }
+    // nullptr for a negative item
+    const TValue* get_value_ptr() const { return m_hash_accessor->second.m_value.get(); }
+
+    const TValue& get_value() const { return *(m_hash_accessor->second.m_value); }
+
+    // A handle of the value which may outlive the accessor
+    ValueRef get_value_ref() const { return m_hash_accessor->second.m_value; }
 
-    const TValue& get_value() const { return m_hash_accessor->second.m_value; }
+    time_t get_timestamp() const { return static_cast<time_t>(get_timestamp_ms() / 1000); }
+
+    int64_t get_timestamp_ms() const { return m_hash_accessor->second.m_list_node.m_timestamp; }
+
+    // Expire time in milliseconds, 0 if the item never expires. The item is
+    // stale after it until the stale window ends.
+    int64_t get_expire_time_ms() const {
+      int64_t expire_time = m_hash_accessor->second.m_list_node.m_expire_time;
+      return expire_time != 0 ? expire_time - m_stale_ms : 0;
+    }
 
-    time_t get_timestamp() const { return (m_hash_accessor->second.m_list_node)->m_timestamp; }
+    // Whether the item was inserted by insert_negative
+    bool is_negative() const { return !m_hash_accessor->second.m_value; }
 
     bool empty() const { return m_hash_accessor.empty(); }
 
    private:
     friend struct ConcurrentLRUCache;
     HashMapConstAccessor m_hash_accessor;
+    int64_t m_stale_ms = 0;
   };
 
   /**
@@ -102,19 +309,70 @@ struct ConcurrentLRUCache {
   explicit ConcurrentLRUCache(size_t max_size, uint32_t timeout = 0,
                               cache::CacheEvictType evict_type = cache::kEvictOne);
 
+  /**
+   * Create a container with full options. Without a weigher every item
+   * weighs 1.
+   */
+  explicit ConcurrentLRUCache(const cache::CacheOptions& options, const Weigher& weigher = Weigher());
+
   ConcurrentLRUCache(const ConcurrentLRUCache& other) = delete;
   ConcurrentLRUCache& operator=(const ConcurrentLRUCache&) = delete;
 
-  ~ConcurrentLRUCache() { clear(); }
+  ~ConcurrentLRUCache() {
+    // The coros of kEvictModeCoro hold this, wait for the queued ones
+    m_stopping.store(true, std::memory_order_release);
+    while (m_coro_num.load(std::memory_order_acquire) != 0) {
+      CoroYield();
+    }
+    drop_all();
+  }
 
   /**
    * Find a value by key, and return it by filling the ConstAccessor, which
    * can be default-constructed. Returns true if the element was found, false
-   * otherwise. Updates the eviction list, making the element the
-   * most-recently used.
+   * otherwise. How the hit is recorded depends on the evict policy: nothing
+   * for kEvictPolicyFifo, a move to the list head for kEvictPolicyLru and a
+   * reference bit for kEvictPolicyClock, which takes no lock.
    */
   bool find(ConstAccessor& ac, const TKey& key);
 
+  /**
+   * find which also reports stale and negative items, see cache::LookupResult.
+   * The ConstAccessor is filled for every result but kLookupMiss, it has no
+   * value for kLookupNegative. Stale items are not refreshed, that is up to
+   * the caller. A stale item is still counted as a miss, see count_read.
+   */
+  cache::LookupResult lookup(ConstAccessor& ac, const TKey& key);
+
+  /**
+   * lookup which records nothing: no stats, no recency and no TinyLFU
+   * frequency. For checking again a key whose read was already counted, e.g.
+   * after waiting to load it.
+   */
+  cache::LookupResult peek(ConstAccessor& ac, const TKey& key) {
+    return lookup(ac, key, GetCoarseTimeMillis(), false);
+  }
+
+  /**
+   * find without any lock for a container with epoch_reads. Returns the
+   * value, or nullptr unless find would return true. The calling thread must
+   * hold a cache::EpochGuard and may use the value until the guard is
+   * destroyed, even if the item is updated or evicted meanwhile.
+   *
+   * The hit is recorded with a reference bit for kEvictPolicyClock and
+   * TinyLFU and not at all for kEvictPolicyLru, whose list can't be changed
+   * without the lock. Returns nullptr without epoch_reads.
+   */
+  const TValue* find_raw(const TKey& key);
+
+  /**
+   * Batch find of keys[indexes[i]] for every i < num, func(index, ac) is called
+   * with the filled ConstAccessor of every hit key. It reads the clock once
+   * and prefetches the keys ahead, see ConcurrentScalableCache::find_batch.
+   */
+  template <class Func>
+  void find_batch(const std::vector<TKey>& keys, const size_t* indexes, size_t num, const Func& func);
+
   /**
    * Insert a value into the container. Both the key and value will be copied.
    * The new element will put into the eviction list as the most-recently
@@ -122,22 +380,83 @@ struct ConcurrentLRUCache {
    *
    * If there was already an element in the container with the same key, it
    * will be updated.
+   *
+   * ttl_ms is the time to live of this item in milliseconds, 0 means never
+   * expired and cache::kTtlDefault the timeout of the options.
+   *
+   * An item heavier than the max_weight of the container is rejected and
+   * false is returned, an older value of the key is removed.
+   *
+   * invalidate_tag(tag) invalidates the item, see cache::GenerationTable.
    */
-  bool insert(const TKey& key, const TValue& value);
+  bool insert(const TKey& key, const TValue& value, int64_t ttl_ms = cache::kTtlDefault,
+              uint64_t tag = cache::kNoTag);
 
   /**
    * Batch insert
    */
-  void insert(const std::unordered_map<TKey, TValue>& data);
+  void insert(const std::unordered_map<TKey, TValue>& data, int64_t ttl_ms = cache::kTtlDefault,
+              uint64_t tag = cache::kNoTag);
 
-  void insert(const std::unordered_map<const TKey*, const TValue*>& data);
+  void insert(const std::unordered_map<const TKey*, const TValue*>& data, int64_t ttl_ms = cache::kTtlDefault,
+              uint64_t tag = cache::kNoTag);
 
   /**
-   * Clear the container. NOT THREAD SAFE -- do not use while other threads
-   * are accessing the container.
+   * Remember that key doesn't exist, lookup returns kLookupNegative for it
+   * until ttl_ms passes, cache::kTtlDefault is negative_ttl_ms. An existing
+   * value of the key is replaced. Returns false if negative caching is
+   * disabled.
+   */
+  bool insert_negative(const TKey& key, int64_t ttl_ms = cache::kTtlDefault, uint64_t tag = cache::kNoTag);
+
+  /**
+   * Clear the container. The items are invalidated at once and then removed
+   * by the calling thread, inserts made meanwhile are kept. Items of other
+   * containers sharing the generations are invalidated too, see
+   * set_generations.
    */
   void clear();
 
+  /**
+   * Invalidate the items inserted with tag in O(1), lookups miss them from
+   * now on and purge_invalidated removes them in the background, see
+   * schedule_purge.
+   */
+  void invalidate_tag(uint64_t tag) {
+    m_generations->invalidate_tag(tag);
+    schedule_purge();
+  }
+
+  /**
+   * Remove at most max_batch invalidated items. The first call after an
+   * invalidation collects their keys under a shared list lock. Returns the
+   * number of keys handled, 0 when none is left.
+   */
+  size_t purge_invalidated(size_t max_batch);
+
+  /**
+   * Whether there are invalidated items to purge
+   */
+  bool need_purge() const {
+    return m_purge_pending.load(std::memory_order_relaxed) != 0 ||
+           m_purged_generation.load(std::memory_order_relaxed) < m_generations->current();
+  }
+
+  /**
+   * Purge after an invalidation according to the evict mode: by the evictor
+   * thread, by a coro, or by the next inserts in kEvictModeInline.
+   */
+  void schedule_purge();
+
+  /**
+   * Share the generations of other containers, ConcurrentScalableCache
+   * shares one table between its shards. NOT THREAD SAFE -- set it before
+   * the container is used.
+   */
+  void set_generations(const std::shared_ptr<cache::GenerationTable>& generations) {
+    m_generations = generations;
+  }
+
   /**
    * Get a snapshot of the keys in the container by copying them into the
    * supplied vector. This will block inserts and prevent LRU updates while it
@@ -146,12 +465,84 @@ struct ConcurrentLRUCache {
    */
   void snapshot_keys(std::vector<TKey>& keys);
 
+  /**
+   * Copy the items in order from least-recently used to most-recently used,
+   * so that restoring them in order rebuilds the recency order. Only the keys
+   * and expire times are copied under the list lock, the values are shared
+   * handles taken from the buckets afterwards, so inserts are blocked about as
+   * long as by snapshot_keys. Stale items and items removed meanwhile are
+   * skipped.
+   */
+  void snapshot_items(std::vector<SnapshotItem>& items);
+
+  /**
+   * Insert an item of a snapshot with its absolute expire time, see
+   * SnapshotItem. An existing item of key is newer and kept. Returns false
+   * if the key exists, or the item is stale or expired, too heavy, or
+   * negative while negative caching is disabled.
+   */
+  bool restore(const TKey& key, ValueRef value, int64_t expire_time, uint64_t tag = cache::kNoTag);
+
   /**
    * Get the approximate size of the container. May be slightly too low when
    * insertion is in progress.
    */
   size_t size() const { return m_size.load(); }
 
+  /**
+   * Get the approximate total weight of the items, see Weigher
+   */
+  size_t weighted_size() const { return m_weight.load(); }
+
+  /**
+   * Allocation counters of the shard's slab arena
+   */
+  cache::AllocStats alloc_stats() const { return m_arena->stats(); }
+
+  /**
+   * Lookup and eviction counters since construction, and the current size
+   */
+  cache::ShardStats stats() const;
+
+  /**
+   * Change the limits, used by ConcurrentScalableCache to rebalance its
+   * shards. A shrunk container evicts down to the new limit after the next
+   * insert. 0 means the same as in CacheOptions: no limit on the weight, and
+   * no limit on the size of a container bounded by weight.
+   */
+  void set_max_size(size_t max_size);
+
+  void set_max_weight(size_t max_weight);
+
+  /**
+   * Set the listener of evictions, see EvictionListener. NOT THREAD SAFE --
+   * set it before the container is used.
+   */
+  void set_eviction_listener(const EvictionListener& listener) { m_eviction_listener = listener; }
+
+  /**
+   * Evict at most max_batch overload or expired items in the calling thread.
+   * Returns true if there may be more to evict, false if nothing is left or
+   * another thread is evicting.
+   */
+  bool evict_batch(size_t max_batch);
+
+  /**
+   * Whether the container is overloaded, its timer wheel has items due or
+   * it has invalidated items
+   */
+  bool need_evict();
+
+  /**
+   * Let the evictor thread evict for this container in kEvictModeBackground,
+   * index is the one returned by CacheEvictor::add. Must be called before
+   * the first insert.
+   */
+  void set_evictor(cache::CacheEvictor* evictor, size_t index) {
+    m_evictor = evictor;
+    m_evictor_index = index;
+  }
+
  private:
   /**
    * Unlink a node from the list. The caller must lock the list mutex while
@@ -163,7 +554,25 @@ struct ConcurrentLRUCache {
    * Add a new node to the list in the most-recently used position. The caller
    * must lock the list mutex while this is called.
    */
-  void push_front(ListNode* node);
+  void push_front(ListNode* node, ListSegment segment = kMainSegment);
+
+  /**
+   * Choose the node to evict for capacity. The caller must lock the list
+   * mutex while this is called.
+   */
+  ListNode* select_victim();
+
+  /**
+   * W-TinyLFU version of select_victim: the window's LRU item competes with
+   * the probation LRU item, the less frequent one is evicted.
+   */
+  ListNode* select_tinylfu_victim();
+
+  /**
+   * The LRU node of the probation region, promoting referenced probation
+   * nodes to the protected region on the way.
+   */
+  ListNode* probation_victim();
 
   /**
    * Evict the least-recently used item from the container. This function does
@@ -171,25 +580,175 @@ struct ConcurrentLRUCache {
    */
   void evict();
 
+  /**
+   * Evict after inserts according to the evict mode
+   */
+  void schedule_evict();
+
+  /**
+   * Run func on a coro unless the cache is being destroyed, counted in
+   * m_coro_num until it returned
+   */
+  void start_coro(const std::function<void()>& func);
+
+  /**
+   * lookup with the current time in milliseconds given by the caller. Without
+   * record it is peek.
+   */
+  cache::LookupResult lookup(ConstAccessor& ac, const TKey& key, int64_t cur_time, bool record = true);
+
+  /**
+   * Remove at most max_batch overload or expired items, returns the number
+   * removed. The caller should hold the evict flag unless it must not wait.
+   */
+  size_t evict_nodes(size_t max_batch);
+
   /**
    * Insert one node to CHM, if existed, update it
    */
-  bool set_entry(const TKey& key, const TValue& value);
+  bool set_entry(const TKey& key, const TValue& value, int64_t ttl_ms, uint64_t tag);
+
+  /**
+   * set_entry of a weighed value, a null value_ref is a negative item. With
+   * only_new an existing valid item is kept and false is returned.
+   */
+  bool set_ref(const TKey& key, ValueRef value_ref, size_t weight, int64_t ttl_ms, uint64_t tag,
+               bool only_new = false);
+
+  /**
+   * Remove the item of a locked bucket. Returns false if it is being evicted.
+   */
+  bool erase_item(HashMapAccessor& hash_accessor);
+
+  /**
+   * Remove key if its item is invalidated
+   */
+  bool erase_invalidated(const TKey& key);
+
+  /**
+   * Free every item at once, for the destructor. NOT THREAD SAFE.
+   */
+  void drop_all();
+
+  bool is_valid(const ListNode* node) const { return m_generations->is_valid(node->m_generation, node->m_tag); }
+
+  /**
+   * Count a read with its result in the stats, the one place which defines a
+   * hit: a live value or a negative item. Stale values are misses whether or
+   * not lookup serves them, the caller reloads them.
+   */
+  void count_read(cache::LookupResult result) {
+    if (result == cache::kLookupHit || result == cache::kLookupNegative) {
+      m_hits.add();
+      return;
+    }
+    m_misses.add();
+    if (result == cache::kLookupStale) {
+      m_stale_reads.add();
+    }
+  }
+
+  /**
+   * Remove the node picked by select_victim (select_tinylfu_victim with
+   * TinyLFU) in CHM, or an expired node of the timer wheel when timeout_check
+   * is set. Returns false if there was no node to remove.
+   */
+  bool remove_node(bool timeout_check = false);
+
+  /**
+   * Whether the item was accessed since its reference bit was cleared, by
+   * find or by find_raw. The caller must lock the list mutex.
+   */
+  bool is_referenced(const ListNode* node) const {
+    return node->m_referenced.load(std::memory_order_relaxed) ||
+           (node->m_raw_entry != nullptr && node->m_raw_entry->referenced.load(std::memory_order_relaxed));
+  }
+
+  void clear_referenced(ListNode* node) {
+    node->m_referenced.store(false, std::memory_order_relaxed);
+    if (node->m_raw_entry != nullptr) {
+      node->m_raw_entry->referenced.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * Unlink the raw entry of a node, the caller must lock the list mutex and
+   * retire the returned entry after unlocking it
+   */
+  RawEntry* unpublish(ListNode* node) {
+    RawEntry* entry = node->m_raw_entry;
+    if (entry != nullptr) {
+      m_raw_index->remove(entry);
+      node->m_raw_entry = nullptr;
+    }
+    return entry;
+  }
+
+  /**
+   * Whether the timer wheel may have expired nodes, it is advanced by
+   * remove_node(true). Lock free, called on every insert.
+   */
+  bool has_expired() const {
+    return GetCoarseTimeMillis() >= m_wheel_check_time.load(std::memory_order_relaxed);
+  }
 
   /**
-   * Remove last node in CHM
+   * Publish the next check time of the wheel after changing it, under the
+   * list lock
    */
-  void remove_node(bool timeout_check = false);
+  void sync_wheel_check() { m_wheel_check_time.store(m_wheel.next_check_time(), std::memory_order_relaxed); }
 
   /**
-   * Check last node is expired or not
+   * The stored limits of a max_size and max_weight of CacheOptions, the
+   * maximum size_t is unbounded
    */
-  bool is_last_node_timeout();
+  static size_t size_limit(size_t max_size, bool weight_bounded) {
+    return max_size == 0 && weight_bounded ? std::numeric_limits<size_t>::max() : max_size;
+  }
+
+  static size_t weight_limit(size_t max_weight) {
+    return max_weight != 0 ? max_weight : std::numeric_limits<size_t>::max();
+  }
+
+  /**
+   * Whether the item count or the total weight is over its limit
+   */
+  bool is_overloaded() const { return m_size.load() > m_max_size.load() || m_weight.load() > m_max_weight.load(); }
+
+  /**
+   * Whether the container is so far over its limits that the inserting
+   * threads should help the evictor thread
+   */
+  bool is_far_overloaded() const {
+    size_t size = m_size.load();
+    size_t max_size = m_max_size.load();
+    size_t weight = m_weight.load();
+    size_t max_weight = m_max_weight.load();
+    // Compare the excess, a limit may be the maximum size_t
+    return (size > max_size && size - max_size > max_size / 8 + cache::kMaxEvictBatch) ||
+           (weight > max_weight && weight - max_weight > max_weight / 8);
+  }
+
+  /**
+   * The item count the TinyLFU regions and sketch are sized for
+   */
+  size_t region_capacity() const;
+
+  /**
+   * Size the TinyLFU regions for the current limits. The caller must lock the
+   * list mutex unless it is the constructor.
+   */
+  void resize_regions();
+
+  size_t hash_key(const TKey& key) const {
+    THash hash_obj;
+    return hash_obj.hash(key);
+  }
 
   /**
    * The maximum number of elements in the container.
    */
-  size_t m_max_size;
+  std::atomic<size_t> m_max_size;
 
   /**
    * This atomic variable is used to signal to all threads whether or not
@@ -199,282 +758,1057 @@ struct ConcurrentLRUCache {
   std::atomic<size_t> m_size;
 
   /**
-   * The underlying TBB hash map.
+   * The maximum and the approximate total weight of the elements, and the
+   * weigher, empty when every element weighs 1
+   */
+  std::atomic<size_t> m_max_weight;
+  std::atomic<size_t> m_weight;
+  Weigher m_weigher;
+
+  EvictionListener m_eviction_listener;
+
+  /**
+   * Counters of stats(). The ones every find or insert updates are striped,
+   * the others are only updated by the evicting thread or under contention.
+   */
+  cache::StripedCounter m_hits;
+  cache::StripedCounter m_misses;
+  cache::StripedCounter m_expired_reads;
+  cache::StripedCounter m_stale_reads;
+  cache::StripedCounter m_inserts;
+  cache::StripedCounter m_updates;
+  alignas(64) std::atomic<size_t> m_evictions;
+  std::atomic<size_t> m_evicted_weight;
+  std::atomic<size_t> m_expirations;
+  std::atomic<size_t> m_list_waits;
+  std::atomic<uint64_t> m_list_wait_ns;
+  std::atomic<size_t> m_invalidated;
+
+  /**
+   * Latency histograms, null unless record_latency is set
+   */
+  std::unique_ptr<cache::LatencyHistogram> m_find_latency;
+  std::unique_ptr<cache::LatencyHistogram> m_insert_latency;
+  std::unique_ptr<cache::LatencyHistogram> m_evict_latency;
+
+  /**
+   * The arena of the hash map elements, it must outlive m_map.
+   */
+  std::unique_ptr<cache::SlabArena> m_arena;
+
+  /**
+   * The underlying hash map, tbb::concurrent_hash_map or FlatHashMap as
+   * chosen by TBackend.
    */
   HashMap m_map;
 
   /**
-   * Cache timeout, key grained
+   * The lock-free copy of the map for find_raw, null unless epoch_reads is
+   * set. Written under the list mutex.
    */
-  uint32_t m_timeout;
+  std::unique_ptr<RawIndex> m_raw_index;
+
+  /**
+   * Default time to live in milliseconds, key grained
+   */
+  int64_t m_timeout;
+
+  /**
+   * TimerWheel::next_check_time of m_wheel, updated under the list lock
+   * whenever the wheel changes so has_expired can skip the lock
+   */
+  std::atomic<int64_t> m_wheel_check_time;
+
+  /**
+   * How long items are kept stale past their TTL, and the default TTL of
+   * negative items, in milliseconds
+   */
+  int64_t m_stale_ms;
+  int64_t m_negative_ttl;
+
+  /**
+   * The generations of the items, and the purge state: the keys of the
+   * invalidated items left to remove, and the generation they were collected
+   * at
+   */
+  std::shared_ptr<cache::GenerationTable> m_generations;
+  std::mutex m_purge_mutex;
+  std::vector<TKey> m_purge_keys;
+  std::atomic<size_t> m_purge_pending;
+  std::atomic<uint64_t> m_purged_generation;
 
   /**
    * Cache evict type, batch or one node(s) once
    */
   cache::CacheEvictType m_evict_type;
 
+  /**
+   * How find updates the recency of the element
+   */
+  cache::CacheEvictPolicy m_evict_policy;
+
+  /**
+   * Admission policy, and the TinyLFU state when enabled
+   */
+  cache::CacheAdmitPolicy m_admit_policy;
+  size_t m_window_max_size;
+  size_t m_protected_max_size;
+  std::unique_ptr<cache::FrequencySketch> m_sketch;
+
   /**
    * In evict process flag
    */
   std::atomic<bool> m_evict_flag;
 
   /**
-   * The linked list. The "head" is the most-recently used node, and the
-   * "tail" is the least-recently used node. The list mutex must be held
-   * during both read and write.
+   * Coros started by start_coro and not finished yet, and set once the
+   * destructor waits for them
+   */
+  std::atomic<size_t> m_coro_num;
+  std::atomic<bool> m_stopping;
+
+  /**
+   * Who evicts after inserts, and the evictor thread in kEvictModeBackground
+   */
+  cache::CacheEvictMode m_evict_mode;
+  cache::CacheEvictor* m_evictor;
+  size_t m_evictor_index;
+
+  /**
+   * The linked lists. The list mutex must be held during both read and write.
    */
-  ListNode m_head;
-  ListNode m_tail;
+  LinkedList m_lists[kSegmentNum];
   typedef TMutex ListMutex;
   ListMutex m_list_mutex;
+
+  /**
+   * Holds the list mutex exclusively, counting how long it waited when the
+   * mutex was contended
+   */
+  class ListLockGuard {
+   public:
+    explicit ListLockGuard(ConcurrentLRUCache& owner) : m_mutex(owner.m_list_mutex) {
+      if (!m_mutex.try_lock()) {
+        uint64_t start = cache::LatencyHistogram::now_ns();
+        m_mutex.lock();
+        owner.m_list_waits.fetch_add(1, std::memory_order_relaxed);
+        owner.m_list_wait_ns.fetch_add(cache::LatencyHistogram::now_ns() - start, std::memory_order_relaxed);
+      }
+    }
+
+    ~ListLockGuard() { m_mutex.unlock(); }
+
+    ListLockGuard(const ListLockGuard&) = delete;
+    ListLockGuard& operator=(const ListLockGuard&) = delete;
+
+   private:
+    ListMutex& m_mutex;
+  };
+
+  /**
+   * The items with a TTL by expire time, guarded by the list mutex
+   */
+  cache::TimerWheel m_wheel;
 };
 
-template <class TKey, class TValue, class TMutex, class THash>
-typename ConcurrentLRUCache<TKey, TValue, TMutex, THash>::ListNode* const
-    ConcurrentLRUCache<TKey, TValue, TMutex, THash>::kOutOfListMarker = reinterpret_cast<ListNode*>(-1);
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+typename ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::ListNode* const
+    ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::kOutOfListMarker = reinterpret_cast<ListNode*>(-1);
 
-template <class TKey, class TValue, class TMutex, class THash>
-ConcurrentLRUCache<TKey, TValue, TMutex, THash>::ConcurrentLRUCache(size_t max_size, uint32_t timeout,
-                                                                    cache::CacheEvictType evict_type)
-    : m_max_size(max_size),
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::ConcurrentLRUCache(size_t max_size, uint32_t timeout,
+                                                                              cache::CacheEvictType evict_type)
+    : ConcurrentLRUCache(cache::CacheOptions{max_size, timeout, 0, evict_type}) {}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::ConcurrentLRUCache(const cache::CacheOptions& options,
+                                                                              const Weigher& weigher)
+    : m_max_size(size_limit(options.max_size, options.max_weight != 0)),
       m_size(0),
-      m_timeout(timeout),
-      m_evict_type(evict_type),
+      m_max_weight(weight_limit(options.max_weight)),
+      m_weight(0),
+      m_weigher(weigher),
+      m_evictions(0),
+      m_evicted_weight(0),
+      m_expirations(0),
+      m_list_waits(0),
+      m_list_wait_ns(0),
+      m_invalidated(0),
+      m_arena(new cache::SlabArena()),
+      m_map(std::thread::hardware_concurrency() * 4, HashMapAllocator(m_arena.get())),
+      m_timeout(static_cast<int64_t>(options.timeout_ms != 0 ? options.timeout_ms : options.timeout * 1000ULL)),
+      m_wheel_check_time(std::numeric_limits<int64_t>::max()),
+      m_stale_ms(static_cast<int64_t>(options.stale_ms)),
+      m_negative_ttl(static_cast<int64_t>(options.negative_ttl_ms)),
+      m_generations(std::make_shared<cache::GenerationTable>()),
+      m_purge_pending(0),
+      m_purged_generation(m_generations->current()),
+      m_evict_type(options.evict_type),
+      m_evict_policy(options.evict_policy),
+      m_admit_policy(options.admit_policy),
+      m_window_max_size(0),
+      m_protected_max_size(0),
       m_evict_flag(false),
-      m_map(std::thread::hardware_concurrency() * 4) {
-  m_head.m_prev = nullptr;
-  m_head.m_next = &m_tail;
-  m_tail.m_prev = &m_head;
+      m_coro_num(0),
+      m_stopping(false),
+      m_evict_mode(options.evict_mode),
+      m_evictor(nullptr),
+      m_evictor_index(0),
+      m_wheel(GetCoarseTimeMillis()) {
+  if (m_admit_policy == cache::kAdmitTinyLfu) {
+    resize_regions();
+    // The sketch keeps its initial size when the limits change
+    m_sketch.reset(new cache::FrequencySketch(region_capacity()));
+  }
+  if (options.record_latency) {
+    m_find_latency.reset(new cache::LatencyHistogram());
+    m_insert_latency.reset(new cache::LatencyHistogram());
+    m_evict_latency.reset(new cache::LatencyHistogram());
+  }
+  if (options.epoch_reads) {
+    m_raw_index.reset(new RawIndex(region_capacity()));
+  }
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-bool ConcurrentLRUCache<TKey, TValue, TMutex, THash>::find(ConstAccessor& ac, const TKey& key) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+size_t ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::region_capacity() const {
+  // The regions are sized by count, estimate it when only the weight is bounded
+  size_t capacity = m_max_size.load();
+  if (capacity == std::numeric_limits<size_t>::max()) {
+    size_t max_weight = m_max_weight.load();
+    capacity = m_weigher ? std::max<size_t>(1, max_weight / cache::kTinyLfuAvgWeight) : max_weight;
+  }
+  return capacity;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::resize_regions() {
+  size_t capacity = region_capacity();
+  m_window_max_size = std::max<size_t>(1, static_cast<size_t>(capacity * cache::kTinyLfuWindowRatio));
+  size_t main_size = capacity > m_window_max_size ? capacity - m_window_max_size : 0;
+  m_protected_max_size = static_cast<size_t>(main_size * cache::kTinyLfuProtectedRatio);
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+cache::ShardStats ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::stats() const {
+  cache::ShardStats stats;
+  stats.hits = m_hits.load();
+  stats.misses = m_misses.load();
+  stats.expired_reads = m_expired_reads.load();
+  stats.stale_reads = m_stale_reads.load();
+  stats.inserts = m_inserts.load();
+  stats.updates = m_updates.load();
+  stats.evictions = m_evictions.load(std::memory_order_relaxed);
+  stats.evicted_weight = m_evicted_weight.load(std::memory_order_relaxed);
+  stats.expirations = m_expirations.load(std::memory_order_relaxed);
+  stats.list_waits = m_list_waits.load(std::memory_order_relaxed);
+  stats.list_wait_ns = m_list_wait_ns.load(std::memory_order_relaxed);
+  stats.invalidated = m_invalidated.load(std::memory_order_relaxed);
+  stats.size = m_size.load();
+  stats.weighted_size = m_weight.load();
+  stats.max_size = m_max_size.load();
+  stats.max_weight = m_max_weight.load();
+  if (m_find_latency != nullptr) {
+    stats.find_latency = m_find_latency->snapshot();
+    stats.insert_latency = m_insert_latency->snapshot();
+    stats.evict_latency = m_evict_latency->snapshot();
+  }
+  return stats;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::set_max_size(size_t max_size) {
+  m_max_size.store(size_limit(max_size, m_max_weight.load() != std::numeric_limits<size_t>::max()));
+  if (m_admit_policy == cache::kAdmitTinyLfu) {
+    std::lock_guard<ListMutex> lock(m_list_mutex);
+    resize_regions();
+  }
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::set_max_weight(size_t max_weight) {
+  m_max_weight.store(weight_limit(max_weight));
+  if (m_admit_policy == cache::kAdmitTinyLfu) {
+    std::lock_guard<ListMutex> lock(m_list_mutex);
+    resize_regions();
+  }
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::find(ConstAccessor& ac, const TKey& key) {
+  return lookup(ac, key, GetCoarseTimeMillis()) == cache::kLookupHit;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+cache::LookupResult ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::lookup(ConstAccessor& ac,
+                                                                                      const TKey& key) {
+  return lookup(ac, key, GetCoarseTimeMillis());
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+const TValue* ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::find_raw(const TKey& key) {
+  if (m_raw_index == nullptr) {
+    return nullptr;
+  }
+  cache::LatencyTimer timer(m_find_latency.get());
+  const RawEntry* entry = m_raw_index->find(key, hash_key(key));
+  if (entry == nullptr) {
+    count_read(cache::kLookupMiss);
+    return nullptr;
+  }
+  // Counted as lookup would
+  int64_t cur_time = GetCoarseTimeMillis();
+  if (entry->expire_time != 0 && cur_time > entry->expire_time) {
+    count_read(cache::kLookupMiss);
+    m_expired_reads.add();
+    return nullptr;
+  }
+  if (!m_generations->is_valid(entry->generation, entry->tag)) {
+    count_read(cache::kLookupMiss);
+    return nullptr;
+  }
+  bool stale = m_stale_ms != 0 && entry->expire_time != 0 && cur_time > entry->expire_time - m_stale_ms;
+  if (stale && !entry->value) {
+    count_read(cache::kLookupMiss);
+    return nullptr;
+  }
+  count_read(stale ? cache::kLookupStale : entry->value ? cache::kLookupHit : cache::kLookupNegative);
+  if (m_admit_policy == cache::kAdmitTinyLfu) {
+    m_sketch->increment(entry->hash);
+  }
+  if ((m_admit_policy == cache::kAdmitTinyLfu || m_evict_policy == cache::kEvictPolicyClock) &&
+      !entry->referenced.load(std::memory_order_relaxed)) {
+    // The writers read it only under the list lock
+    const_cast<RawEntry*>(entry)->referenced.store(true, std::memory_order_relaxed);
+  }
+  return stale ? nullptr : entry->value.get();
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+template <class Func>
+void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::find_batch(const std::vector<TKey>& keys,
+                                                                           const size_t* indexes, size_t num,
+                                                                           const Func& func) {
+  static constexpr size_t kPrefetchDistance = 4;
+  int64_t cur_time = GetCoarseTimeMillis();
+  for (size_t i = 0; i < num; i++) {
+    if (i + kPrefetchDistance < num) {
+      TBackend::prefetch(m_map, keys[indexes[i + kPrefetchDistance]]);
+    }
+    ConstAccessor ac;
+    if (lookup(ac, keys[indexes[i]], cur_time) == cache::kLookupHit) {
+      func(indexes[i], static_cast<const ConstAccessor&>(ac));
+    }
+  }
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+cache::LookupResult ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::lookup(ConstAccessor& ac,
+                                                                                      const TKey& key,
+                                                                                      int64_t cur_time,
+                                                                                      bool record) {
+  cache::LatencyTimer timer(record ? m_find_latency.get() : nullptr);
   HashMapConstAccessor& hash_accessor = ac.m_hash_accessor;
+  ac.m_stale_ms = m_stale_ms;
   if (!m_map.find(hash_accessor, key)) {
-    return false;
+    if (record) {
+      count_read(cache::kLookupMiss);
+    }
+    return cache::kLookupMiss;
   }
-  time_t cur_time;
-  time(&cur_time);
-  if (m_timeout != 0 && cur_time - ac.get_timestamp() > m_timeout) {
-    // key is expired
-    return false;
+  ListNode* node = &hash_accessor->second.m_list_node;
+  if (node->is_expired(cur_time)) {
+    // key is expired, the timer wheel reclaims it
+    if (record) {
+      count_read(cache::kLookupMiss);
+      m_expired_reads.add();
+    }
+    return cache::kLookupMiss;
   }
-  return true;
+  if (!is_valid(node)) {
+    // Invalidated, purge_invalidated reclaims it
+    if (record) {
+      count_read(cache::kLookupMiss);
+    }
+    return cache::kLookupMiss;
+  }
+  cache::LookupResult result = cache::kLookupHit;
+  if (m_stale_ms != 0 && node->m_expire_time != 0 && cur_time > node->m_expire_time - m_stale_ms) {
+    if (ac.is_negative()) {
+      // Negative items are not served stale
+      if (record) {
+        count_read(cache::kLookupMiss);
+      }
+      return cache::kLookupMiss;
+    }
+    result = cache::kLookupStale;
+  } else if (ac.is_negative()) {
+    result = cache::kLookupNegative;
+  }
+  if (!record) {
+    return result;
+  }
+  count_read(result);
 
-  // Fake LRU, don't adjust list node address when doing get operation
+  if (m_admit_policy == cache::kAdmitTinyLfu) {
+    m_sketch->increment(node->m_hash);
+    if (!node->m_referenced.load(std::memory_order_relaxed)) {
+      node->m_referenced.store(true, std::memory_order_relaxed);
+    }
+  } else if (m_evict_policy == cache::kEvictPolicyClock) {
+    // Avoid dirtying the cache line when the bit is already set
+    if (!node->m_referenced.load(std::memory_order_relaxed)) {
+      node->m_referenced.store(true, std::memory_order_relaxed);
+    }
+  } else if (m_evict_policy == cache::kEvictPolicyLru) {
+    // Acquire the lock, but don't block if it is already held
+    std::unique_lock<ListMutex> lock(m_list_mutex, std::try_to_lock);
+    // The list node may be out of the list if it is in the process of being
+    // inserted or evicted. Doing this check allows us to lock the list for
+    // shorter periods of time.
+    if (lock.owns_lock() && node->is_in_list()) {
+      delink(node);
+      push_front(node);
+    }
+  }
+  // kEvictPolicyFifo: fake LRU, don't adjust list node address when doing get operation
+  return result;
+}
 
-  // Acquire the lock, but don't block if it is already held
-  // std::lock_guard<ListMutex> lock(m_list_mutex);
-  //   ListNode* node = hash_accessor->second.m_list_node;
-  //   // The list node may be out of the list if it is in the process of being
-  //   // inserted or evicted. Doing this check allows us to lock the list for
-  //   // shorter periods of time.
-  //   if (node && node->is_in_list()) {
-  //     delink(node);
-  //     push_front(node);
-  //   }
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::set_entry(const TKey& key, const TValue& value,
+                                                                          int64_t ttl_ms, uint64_t tag) {
+  size_t weight = m_weigher ? m_weigher(key, value) : 1;
+  if (weight > m_max_weight.load()) {
+    // It would evict everything else, drop the key instead
+    HashMapAccessor hash_accessor;
+    if (m_map.find(hash_accessor, key)) {
+      erase_item(hash_accessor);
+    }
+    return false;
+  }
+  // Copy the value before locking the bucket
+  return set_ref(key, std::make_shared<const TValue>(value), weight, ttl_ms, tag);
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-bool ConcurrentLRUCache<TKey, TValue, TMutex, THash>::set_entry(const TKey& key, const TValue& value) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::erase_item(HashMapAccessor& hash_accessor) {
+  RawEntry* raw_entry = nullptr;
+  {
+    ListLockGuard lock(*this);
+    ListNode* node = &hash_accessor->second.m_list_node;
+    if (!node->is_in_list()) {
+      // Being evicted
+      return false;
+    }
+    delink(node);
+    m_wheel.deschedule(node);
+    sync_wheel_check();
+    raw_entry = unpublish(node);
+  }
+  RawIndex::retire(raw_entry);
+  m_weight -= hash_accessor->second.m_weight;
+  m_map.erase(hash_accessor);
+  m_size--;
+  return true;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::set_ref(const TKey& key, ValueRef value_ref,
+                                                                        size_t weight, int64_t ttl_ms, uint64_t tag,
+                                                                        bool only_new) {
+  cache::LatencyTimer timer(m_insert_latency.get());
+  if (ttl_ms < 0) {
+    ttl_ms = m_timeout;
+  }
+  // Keep the item through its stale window
+  int64_t keep_ms = ttl_ms != 0 ? ttl_ms + m_stale_ms : 0;
   // Insert into the CHM
   HashMapAccessor hash_accessor;
   bool new_flag = m_map.insert(hash_accessor, key);
+  if (!new_flag && only_new && is_valid(&hash_accessor->second.m_list_node)) {
+    return false;
+  }
+  // Items inserted from now on outlive the invalidations so far
+  uint64_t generation = m_generations->current();
+  (new_flag ? m_inserts : m_updates).add();
+  // The entry is filled in before the list lock and published under it
+  std::unique_ptr<RawEntry> raw_entry;
+  if (m_raw_index != nullptr) {
+    raw_entry.reset(new RawEntry(key, hash_key(key), value_ref, 0));
+    raw_entry->generation = generation;
+    raw_entry->tag = tag;
+  }
   if (!new_flag) {
-    // Key already exist, update value and timestamp and adjust node address
-    hash_accessor->second.m_value = value;
+    // Key already exist, update value and timestamp and adjust node address.
+    // Handles of the old value keep it alive.
+    hash_accessor->second.m_value = std::move(value_ref);
+    RawEntry* old_raw_entry = nullptr;
+    m_weight += weight;
+    m_weight -= hash_accessor->second.m_weight;
+    hash_accessor->second.m_weight = weight;
     {
-      std::lock_guard<ListMutex> lock(m_list_mutex);
-      ListNode* node = hash_accessor->second.m_list_node;
-      if (node && node->is_in_list()) {
+      ListLockGuard lock(*this);
+      ListNode* node = &hash_accessor->second.m_list_node;
+      // Read by purge_invalidated under the list lock
+      node->m_generation = generation;
+      node->m_tag = tag;
+      if (node->is_in_list()) {
         node->update_timestamp();
+        ListSegment segment = static_cast<ListSegment>(node->m_segment);
         delink(node);
-        push_front(node);
+        push_front(node, segment);
+        m_wheel.deschedule(node);
+        node->m_expire_time = keep_ms != 0 ? node->m_timestamp + keep_ms : 0;
+        if (node->m_expire_time != 0) {
+          m_wheel.schedule(node);
+        }
+        sync_wheel_check();
+        if (raw_entry != nullptr) {
+          // The update keeps the reference bit, like the node does
+          raw_entry->expire_time = node->m_expire_time;
+          raw_entry->referenced.store(is_referenced(node), std::memory_order_relaxed);
+          old_raw_entry = m_raw_index->publish(raw_entry.get());
+          node->m_raw_entry = raw_entry.release();
+        }
       }
     }
+    RawIndex::retire(old_raw_entry);
+    if (m_admit_policy == cache::kAdmitTinyLfu) {
+      m_sketch->increment(hash_accessor->second.m_list_node.m_hash);
+    }
   } else {
     // Insert new node
-    ListNode* node = new ListNode(key);
-    hash_accessor->second.m_value = value;
-    hash_accessor->second.m_list_node = node;
+    ListNode* node = &hash_accessor->second.m_list_node;
+    node->m_key = &hash_accessor->first;
+    node->m_hash = hash_key(key);
+    node->update_timestamp();
+    node->m_expire_time = keep_ms != 0 ? node->m_timestamp + keep_ms : 0;
+    node->m_generation = generation;
+    node->m_tag = tag;
+    hash_accessor->second.m_value = std::move(value_ref);
+    hash_accessor->second.m_weight = weight;
 
     // Note that we have to update the LRU list before we increment m_size, so
     // that other threads don't attempt to evict list items before they even
     // exist.
+    // Count the weight before the node can be evicted
+    m_weight += weight;
+    if (m_admit_policy == cache::kAdmitTinyLfu) {
+      m_sketch->increment(node->m_hash);
+    }
     {
-      std::lock_guard<ListMutex> lock(m_list_mutex);
-      push_front(node);
+      ListLockGuard lock(*this);
+      push_front(node, m_admit_policy == cache::kAdmitTinyLfu ? kWindowSegment : kMainSegment);
+      if (node->m_expire_time != 0) {
+        m_wheel.schedule(node);
+        sync_wheel_check();
+      }
+      if (raw_entry != nullptr) {
+        raw_entry->expire_time = node->m_expire_time;
+        m_raw_index->publish(raw_entry.get());
+        node->m_raw_entry = raw_entry.release();
+      }
     }
     m_size++;
   }
   return true;
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-bool ConcurrentLRUCache<TKey, TValue, TMutex, THash>::insert(const TKey& key, const TValue& value) {
-  bool flag = set_entry(key, value);
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::insert(const TKey& key, const TValue& value,
+                                                                       int64_t ttl_ms, uint64_t tag) {
+  bool flag = set_entry(key, value, ttl_ms, tag);
   if (flag) {
-#ifdef TEST_MODE
-    evict();
-#else
-    auto evict_func = [this]() { this->evict(); };
-    StartCoroFunc(evict_func);  // async evict node
-#endif
+    schedule_evict();
   }
   return flag;
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-void ConcurrentLRUCache<TKey, TValue, TMutex, THash>::insert(const std::unordered_map<TKey, TValue>& data) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::insert(const std::unordered_map<TKey, TValue>& data,
+                                                                       int64_t ttl_ms, uint64_t tag) {
   for (const auto& pair : data) {
-    set_entry(pair.first, pair.second);
+    set_entry(pair.first, pair.second, ttl_ms, tag);
   }
-#ifdef TEST_MODE
-  evict();
-#else
-  auto evict_func = [this]() { this->evict(); };
-  StartCoroFunc(evict_func);  // async evict node
-#endif
+  schedule_evict();
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-void ConcurrentLRUCache<TKey, TValue, TMutex, THash>::insert(
-    const std::unordered_map<const TKey*, const TValue*>& data) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::insert(
+    const std::unordered_map<const TKey*, const TValue*>& data, int64_t ttl_ms, uint64_t tag) {
   for (const auto& pair : data) {
-    set_entry(*(pair.first), *(pair.second));
+    set_entry(*(pair.first), *(pair.second), ttl_ms, tag);
+  }
+  schedule_evict();
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::insert_negative(const TKey& key, int64_t ttl_ms,
+                                                                                uint64_t tag) {
+  if (ttl_ms < 0) {
+    if (m_negative_ttl == 0) {
+      return false;
+    }
+    ttl_ms = m_negative_ttl;
+  }
+  // Negative items weigh 1 as there is no value to weigh
+  bool flag = set_ref(key, nullptr, 1, ttl_ms, tag);
+  if (flag) {
+    schedule_evict();
+  }
+  return flag;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::clear() {
+  m_generations->invalidate_all();
+  while (purge_invalidated(cache::kMaxEvictBatch) != 0) {
+  }
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+size_t ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::purge_invalidated(size_t max_batch) {
+  std::lock_guard<std::mutex> purge_lock(m_purge_mutex);
+  if (m_purge_keys.empty()) {
+    uint64_t generation = m_generations->current();
+    if (m_purged_generation.load(std::memory_order_relaxed) >= generation) {
+      return 0;
+    }
+    {
+      std::shared_lock<ListMutex> lock(m_list_mutex);
+      for (const LinkedList& list : m_lists) {
+        for (ListNode* node = list.head.m_next; node != &list.tail; node = node->m_next) {
+          if (!is_valid(node)) {
+            m_purge_keys.push_back(*node->m_key);
+          }
+        }
+      }
+    }
+    // Later invalidations need another pass
+    m_purged_generation.store(generation, std::memory_order_relaxed);
+  }
+  size_t cnt = 0;
+  while (cnt < max_batch && !m_purge_keys.empty()) {
+    erase_invalidated(m_purge_keys.back());
+    m_purge_keys.pop_back();
+    cnt++;
   }
+  m_purge_pending.store(m_purge_keys.size(), std::memory_order_relaxed);
+  return cnt;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::erase_invalidated(const TKey& key) {
+  HashMapAccessor hash_accessor;
+  if (!m_map.find(hash_accessor, key) || is_valid(&hash_accessor->second.m_list_node)) {
+    // Removed or inserted again meanwhile
+    return false;
+  }
+  if (!erase_item(hash_accessor)) {
+    return false;
+  }
+  m_invalidated.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::schedule_purge() {
 #ifdef TEST_MODE
-  evict();
+  while (purge_invalidated(cache::kMaxEvictBatch) != 0) {
+  }
 #else
-  auto evict_func = [this]() { this->evict(); };
-  StartCoroFunc(evict_func);  // async evict node
+  if (m_evict_mode == cache::kEvictModeBackground && m_evictor != nullptr) {
+    m_evictor->notify(m_evictor_index);
+  } else if (m_evict_mode == cache::kEvictModeCoro) {
+    start_coro([this]() {
+      while (this->purge_invalidated(cache::kMaxEvictBatch) != 0) {
+      }
+    });
+  }
+  // kEvictModeInline: the next inserts purge
 #endif
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-void ConcurrentLRUCache<TKey, TValue, TMutex, THash>::clear() {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::drop_all() {
+  // The list nodes are owned by the map elements
+  for (LinkedList& list : m_lists) {
+    list.head.m_next = &list.tail;
+    list.tail.m_prev = &list.head;
+    list.size = 0;
+  }
+  m_wheel.clear();
+  sync_wheel_check();
+  if (m_raw_index != nullptr) {
+    m_raw_index->clear();
+  }
   m_map.clear();
-  ListNode* node = m_head.m_next;
-  ListNode* next;
-  while (node != &m_tail) {
-    next = node->m_next;
-    delete node;
-    node = next;
-  }
-  m_head.m_next = &m_tail;
-  m_tail.m_prev = &m_head;
   m_size = 0;
+  m_weight = 0;
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-void ConcurrentLRUCache<TKey, TValue, TMutex, THash>::snapshot_keys(std::vector<TKey>& keys) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::snapshot_keys(std::vector<TKey>& keys) {
   keys.reserve(keys.size() + m_size.load());
   {
     std::shared_lock<ListMutex> lock(m_list_mutex);
-    for (ListNode* node = m_head.m_next; node != &m_tail; node = node->m_next) {
-      keys.push_back(node->m_key);
+    for (int segment : {kWindowSegment, kProtectedSegment, kMainSegment}) {
+      const LinkedList& list = m_lists[segment];
+      for (ListNode* node = list.head.m_next; node != &list.tail; node = node->m_next) {
+        keys.push_back(*node->m_key);
+      }
+    }
+  }
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::snapshot_items(std::vector<SnapshotItem>& items) {
+  // The values are filled in afterwards
+  std::vector<SnapshotItem> keys;
+  keys.reserve(m_size.load());
+  {
+    std::shared_lock<ListMutex> lock(m_list_mutex);
+    // Items leave the window for the main region, and the probation items
+    // are the oldest of it
+    for (int segment : {kMainSegment, kProtectedSegment, kWindowSegment}) {
+      const LinkedList& list = m_lists[segment];
+      for (ListNode* node = list.tail.m_prev; node != &list.head; node = node->m_prev) {
+        if (is_valid(node)) {
+          keys.push_back(SnapshotItem{*node->m_key, nullptr, node->m_expire_time, node->m_tag});
+        }
+      }
+    }
+  }
+  items.reserve(items.size() + keys.size());
+  int64_t cur_time = GetCoarseTimeMillis();
+  for (SnapshotItem& item : keys) {
+    // Stale items wouldn't be restored
+    item.expire_time = item.expire_time != 0 ? item.expire_time - m_stale_ms : 0;
+    if (item.expire_time != 0 && item.expire_time <= cur_time) {
+      continue;
+    }
+    HashMapConstAccessor hash_accessor;
+    if (!m_map.find(hash_accessor, item.key)) {
+      continue;
+    }
+    item.value = hash_accessor->second.m_value;
+    items.push_back(std::move(item));
+  }
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::restore(const TKey& key, ValueRef value,
+                                                                        int64_t expire_time, uint64_t tag) {
+  int64_t ttl_ms = 0;
+  if (expire_time != 0) {
+    // Stale items are dropped, set_ref would give them a new stale window
+    ttl_ms = expire_time - GetCoarseTimeMillis();
+    if (ttl_ms <= 0) {
+      return false;
+    }
+  }
+  size_t weight = 1;
+  if (value) {
+    weight = m_weigher ? m_weigher(key, *value) : 1;
+    if (weight > m_max_weight.load()) {
+      return false;
     }
+  } else if (m_negative_ttl == 0) {
+    return false;
   }
+  bool flag = set_ref(key, std::move(value), weight, ttl_ms, tag, true);
+  if (flag) {
+    schedule_evict();
+  }
+  return flag;
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-inline void ConcurrentLRUCache<TKey, TValue, TMutex, THash>::delink(ListNode* node) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+inline void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::delink(ListNode* node) {
   ListNode* prev = node->m_prev;
   ListNode* next = node->m_next;
   prev->m_next = next;
   next->m_prev = prev;
   node->m_prev = kOutOfListMarker;
+  m_lists[node->m_segment].size--;
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-inline void ConcurrentLRUCache<TKey, TValue, TMutex, THash>::push_front(ListNode* node) {
-  ListNode* old_real_head = m_head.m_next;
-  node->m_prev = &m_head;
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+inline void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::push_front(ListNode* node, ListSegment segment) {
+  LinkedList& list = m_lists[segment];
+  ListNode* old_real_head = list.head.m_next;
+  node->m_prev = &list.head;
   node->m_next = old_real_head;
   old_real_head->m_prev = node;
-  m_head.m_next = node;
+  list.head.m_next = node;
+  node->m_segment = static_cast<uint8_t>(segment);
+  list.size++;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+typename ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::ListNode*
+ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::select_victim() {
+  LinkedList& list = m_lists[kMainSegment];
+  if (list.empty()) {
+    // List is empty, can't evict
+    return nullptr;
+  }
+  ListNode* moribund = list.tail.m_prev;
+  if (m_evict_policy == cache::kEvictPolicyClock) {
+    // Second chance: rotate referenced nodes to the head. Every rotation
+    // clears a bit, so this ends within one pass over the list.
+    int64_t cur_time = GetCoarseTimeMillis();
+    while (is_referenced(moribund) && !moribund->is_expired(cur_time)) {
+      clear_referenced(moribund);
+      delink(moribund);
+      push_front(moribund);
+      moribund = list.tail.m_prev;
+    }
+  }
+  return moribund;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+typename ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::ListNode*
+ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::probation_victim() {
+  LinkedList& probation = m_lists[kMainSegment];
+  LinkedList& protect = m_lists[kProtectedSegment];
+  while (!probation.empty()) {
+    ListNode* node = probation.tail.m_prev;
+    if (!is_referenced(node)) {
+      return node;
+    }
+    // Accessed while on probation, promote it
+    clear_referenced(node);
+    delink(node);
+    push_front(node, kProtectedSegment);
+    while (protect.size > m_protected_max_size) {
+      ListNode* demoted = protect.tail.m_prev;
+      delink(demoted);
+      if (is_referenced(demoted)) {
+        clear_referenced(demoted);
+        push_front(demoted, kProtectedSegment);
+      } else {
+        push_front(demoted, kMainSegment);
+      }
+    }
+  }
+  return nullptr;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+typename ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::ListNode*
+ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::select_tinylfu_victim() {
+  LinkedList& window = m_lists[kWindowSegment];
+  // Move the window overflow to the probation region, the last one moved is
+  // the candidate. More than one item only moves while the cache fills up.
+  ListNode* candidate = nullptr;
+  while (window.size > m_window_max_size) {
+    // The window is an LRU approximated with reference bits
+    candidate = window.tail.m_prev;
+    for (size_t i = 0; i < window.size && is_referenced(candidate); i++) {
+      clear_referenced(candidate);
+      delink(candidate);
+      push_front(candidate, kWindowSegment);
+      candidate = window.tail.m_prev;
+    }
+    delink(candidate);
+    push_front(candidate, kMainSegment);
+  }
+
+  ListNode* victim = probation_victim();
+  if (candidate == nullptr) {
+    if (victim != nullptr) {
+      return victim;
+    }
+    if (!m_lists[kProtectedSegment].empty()) {
+      return m_lists[kProtectedSegment].tail.m_prev;
+    }
+    return window.empty() ? nullptr : window.tail.m_prev;
+  }
+  if (candidate->m_segment != kMainSegment || victim == nullptr) {
+    // The candidate was promoted while looking for the victim
+    return victim != nullptr ? victim : candidate;
+  }
+  if (victim == candidate) {
+    return candidate;
+  }
+  // Admit the candidate only if it is more popular than the victim
+  if (m_sketch->frequency(candidate->m_hash) > m_sketch->frequency(victim->m_hash)) {
+    return victim;
+  }
+  return candidate;
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-void ConcurrentLRUCache<TKey, TValue, TMutex, THash>::remove_node(bool timeout_check) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::remove_node(bool timeout_check) {
+  cache::LatencyTimer timer(m_evict_latency.get());
   ListNode* moribund = nullptr;
+  RawEntry* raw_entry = nullptr;
   {
-    std::lock_guard<ListMutex> lock(m_list_mutex);
-    moribund = m_tail.m_prev;
-    if (moribund == &m_head) {
-      // List is empty, can't evict
-      return;
+    ListLockGuard lock(*this);
+    if (timeout_check) {
+      m_wheel.advance(GetCoarseTimeMillis());
+      moribund = static_cast<ListNode*>(m_wheel.pop_expired());
+    } else if (m_admit_policy == cache::kAdmitTinyLfu) {
+      moribund = select_tinylfu_victim();
+    } else {
+      moribund = select_victim();
     }
     if (timeout_check) {
-      time_t cur_time;
-      time(&cur_time);
-      if (cur_time - moribund->m_timestamp <= m_timeout) {
-        // Last node is not timeout
-        return;
-      }
+      sync_wheel_check();
+    }
+    if (moribund == nullptr) {
+      // List is empty or no node is expired
+      return false;
     }
     delink(moribund);
+    m_wheel.deschedule(moribund);
+    sync_wheel_check();
+    raw_entry = unpublish(moribund);
   }
+  RawIndex::retire(raw_entry);
 
   HashMapAccessor hash_accessor;
-  if (!m_map.find(hash_accessor, moribund->m_key)) {
+  if (!m_map.find(hash_accessor, *moribund->m_key)) {
     // Presumably unreachable
-    return;
+    return false;
+  }
+  // Keep what the listener needs past the erase
+  std::unique_ptr<SnapshotItem> evicted;
+  if (!timeout_check && m_eviction_listener && hash_accessor->second.m_value && is_valid(moribund)) {
+    int64_t expire_time = moribund->m_expire_time != 0 ? moribund->m_expire_time - m_stale_ms : 0;
+    evicted.reset(
+        new SnapshotItem{hash_accessor->first, hash_accessor->second.m_value, expire_time, moribund->m_tag});
   }
+  // Frees the element together with its list node
+  size_t weight = hash_accessor->second.m_weight;
+  m_weight -= weight;
   m_map.erase(hash_accessor);
-  delete moribund;
-  moribund = nullptr;
   m_size--;
-}
-
-template <class TKey, class TValue, class TMutex, class THash>
-bool ConcurrentLRUCache<TKey, TValue, TMutex, THash>::is_last_node_timeout() {
-  if (m_timeout == 0) {
-    return false;
+  if (timeout_check) {
+    m_expirations.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    m_evictions.fetch_add(1, std::memory_order_relaxed);
+    m_evicted_weight.fetch_add(weight, std::memory_order_relaxed);
   }
-  {
-    std::shared_lock<ListMutex> lock(m_list_mutex);
-    ListNode* moribund = m_tail.m_prev;
-    if (moribund == &m_head) {
-      // List is empty
-      return false;
-    }
-    time_t cur_time;
-    time(&cur_time);
-    if (cur_time - moribund->m_timestamp > m_timeout) {
-      return true;
-    }
+  if (evicted) {
+    m_eviction_listener(*evicted);
   }
-  return false;
+  return true;
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-void ConcurrentLRUCache<TKey, TValue, TMutex, THash>::evict() {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::evict() {
   bool expect_val = false;
   if (!m_evict_flag.compare_exchange_strong(expect_val, true)) {
     // In evict process
     return;
   }
   if (m_evict_type == cache::kEvictOne) {
-    if (m_size.load() > m_max_size) {
+    if (is_overloaded()) {
       // Overload
       remove_node();
     }
-    if (is_last_node_timeout()) {
+    // One heavy item may displace several light ones
+    int cnt = 1;
+    while (cnt < cache::kMaxEvictBatch && m_weight.load() > m_max_weight.load() && remove_node()) {
+      cnt++;
+    }
+    if (has_expired()) {
       remove_node(true);
     }
+    if (need_purge()) {
+      purge_invalidated(cache::kMaxEvictBatch);
+    }
   } else if (m_evict_type == cache::kEvictBatch) {
     int cnt = 0;
-    while (cnt < cache::kMaxEvictBatch && m_size.load() > m_max_size) {
+    while (cnt < cache::kMaxEvictBatch && is_overloaded()) {
       remove_node();
       cnt++;
     }
-    while (cnt < cache::kMaxEvictBatch && is_last_node_timeout()) {
+    while (cnt < cache::kMaxEvictBatch && has_expired()) {
       remove_node(true);
       cnt++;
     }
+    if (cnt < cache::kMaxEvictBatch && need_purge()) {
+      purge_invalidated(cache::kMaxEvictBatch - cnt);
+    }
+  }
+  m_evict_flag.store(false);
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::evict_batch(size_t max_batch) {
+  bool expect_val = false;
+  if (!m_evict_flag.compare_exchange_strong(expect_val, true)) {
+    // In evict process
+    return false;
   }
+  size_t cnt = evict_nodes(max_batch);
   m_evict_flag.store(false);
+  return cnt == max_batch && need_evict();
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+size_t ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::evict_nodes(size_t max_batch) {
+  size_t cnt = 0;
+  while (cnt < max_batch && is_overloaded() && remove_node()) {
+    cnt++;
+  }
+  while (cnt < max_batch && has_expired() && remove_node(true)) {
+    cnt++;
+  }
+  if (cnt < max_batch && need_purge()) {
+    cnt += purge_invalidated(max_batch - cnt);
+  }
+  return cnt;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::need_evict() {
+  return is_overloaded() || has_expired() || need_purge();
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::schedule_evict() {
+#ifdef TEST_MODE
+  evict();
+#else
+  if (m_evict_mode == cache::kEvictModeBackground && m_evictor != nullptr) {
+    if (is_far_overloaded()) {
+      // The evictor can't keep up with the inserts, help it without waiting
+      // for the evict flag
+      evict_nodes(cache::kMaxEvictBatch);
+    }
+    if (need_evict()) {
+      m_evictor->notify(m_evictor_index);
+    }
+    return;
+  }
+  if (m_evict_flag.load(std::memory_order_relaxed) || !need_evict()) {
+    // Someone is evicting or there is nothing to do, don't start anything
+    return;
+  }
+  if (m_evict_mode == cache::kEvictModeCoro) {
+    start_coro([this]() { this->evict(); });  // async evict node
+  } else {
+    evict_batch(cache::kMaxEvictBatch);
+  }
+#endif
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>::start_coro(const std::function<void()>& func) {
+  m_coro_num.fetch_add(1, std::memory_order_relaxed);
+  StartCoroFunc([this, func]() {
+    if (!m_stopping.load(std::memory_order_acquire)) {
+      func();
+    }
+    // Nothing of this is touched after the count dropped
+    m_coro_num.fetch_sub(1, std::memory_order_release);
+  });
 }
 
 }  // namespace cpp_lib
\ No newline at end of file
@@ -1,10 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <shared_mutex>
 
 #include "cpp_lib/cache/concurrent_lru_cache.h"
+#include "cpp_lib/cache/lru_cache_key.h"
+#include "cpp_lib/cache/mrc_estimator.h"
 
 namespace cpp_lib {
 /**
@@ -13,17 +18,34 @@ namespace cpp_lib {
 * used item.
 *
 * The find() operation fills a ConstAccessor object, which is a smart pointer
-* similar to TBB's const_accessor. After eviction, destruction of the value is
-* deferred until all ConstAccessor objects are destroyed.
+* similar to TBB's const_accessor. ConstAccessor::get_value_ref() returns a
+* ValueRef handle which holds the value without holding the bucket lock. After
+* eviction, destruction of the value is deferred until all ConstAccessor
+* objects and ValueRef handles are destroyed.
 *
 * Since the hash value of each key is requested multiple times, you should use
 * a key with a memoized hash function. LRUCacheKey is provided for
-* this purpose.
+* this purpose, see lru_cache_key.h.
+*
+* TBackend picks the hash map of the shards, cache::TbbMapBackend or
+* cache::FlatMapBackend, see map_backend.h.
+*
+* With cache::kEvictModeBackground one CacheEvictor thread evicts for all the
+* shards, inserts only notify it.
+*
+* The capacity is split evenly across the shards. With skewed keys, set
+* rebalance_interval_ms to let inserts periodically move capacity toward the
+* shards which evict, see rebalance().
 */
-template <class TKey, class TValue, class TMutex = std::shared_mutex, class THash = tbb::tbb_hash_compare<TKey>>
+template <class TKey, class TValue, class TMutex = std::shared_mutex, class THash = tbb::tbb_hash_compare<TKey>,
+          class TBackend = cache::TbbMapBackend>
 struct ConcurrentScalableCache {
-  using Shard = ConcurrentLRUCache<TKey, TValue, TMutex, THash>;
+  using Shard = ConcurrentLRUCache<TKey, TValue, TMutex, THash, TBackend>;
   typedef typename Shard::ConstAccessor ConstAccessor;
+  typedef typename Shard::ValueRef ValueRef;
+  typedef typename Shard::Weigher Weigher;
+  typedef typename Shard::SnapshotItem SnapshotItem;
+  typedef typename Shard::EvictionListener EvictionListener;
 
   /**
    * Constructor
@@ -37,18 +59,57 @@ struct ConcurrentScalableCache {
   explicit ConcurrentScalableCache(size_t max_size, uint32_t timeout = 0, size_t num_shards = 0,
                                    cache::CacheEvictType evict_type = cache::kEvictOne);
 
+  /**
+   * Constructor with full options, see cache::CacheOptions. max_size and
+   * num_shards have the same meaning as above. Like max_size, max_weight is
+   * split evenly across the shards, and the weigher is shared by them.
+   */
+  explicit ConcurrentScalableCache(const cache::CacheOptions& options, const Weigher& weigher = Weigher());
+
   ConcurrentScalableCache(const ConcurrentScalableCache&) = delete;
   ConcurrentScalableCache& operator=(const ConcurrentScalableCache&) = delete;
 
   /**
    * Find a value by key, and return it by filling the ConstAccessor, which
    * can be default-constructed. Returns true if the element was found, false
-   * otherwise. Updates the eviction list, making the element the
-   * most-recently used. In degenerated version, eviction list not be updated
-   * when doing find operation
+   * otherwise. Updates the eviction list according to the evict policy, with
+   * kEvictPolicyFifo (the degenerated version) the eviction list is not
+   * updated when doing find operation
    */
   bool find(ConstAccessor& ac, const TKey& key);
 
+  /**
+   * find which also reports stale and negative items, see
+   * ConcurrentLRUCache::lookup
+   */
+  cache::LookupResult lookup(ConstAccessor& ac, const TKey& key);
+
+  /**
+   * lookup which records nothing, see ConcurrentLRUCache::peek
+   */
+  cache::LookupResult peek(ConstAccessor& ac, const TKey& key) { return get_shard(key).peek(ac, key); }
+
+  /**
+   * Lock-free find under a cache::EpochGuard, needs CacheOptions::epoch_reads.
+   * See ConcurrentLRUCache::find_raw
+   */
+  const TValue* find_raw(const TKey& key) {
+    if (m_epoch_reads) {
+      sample(key, true);
+    }
+    return get_shard(key).find_raw(key);
+  }
+
+  /**
+   * Batch find. func(i, ac) is called with the filled ConstAccessor of every
+   * hit keys[i]; the accessor is released when func returns. The keys are
+   * grouped by shard so every shard is visited once. Batches of at least
+   * parallel_find_size keys search the shards in parallel on the coro pool,
+   * func is then called concurrently for keys of different shards.
+   */
+  template <class Func>
+  void find_batch(const std::vector<TKey>& keys, const Func& func);
+
   /**
    * Insert a value into the container. Both the key and value will be copied.
    * The new element will put into the eviction list as the most-recently
@@ -60,20 +121,38 @@ struct ConcurrentScalableCache {
    *
    * If a new element is inserted successfully, true will be returned. Otherwise,
    * false will be returned.
+   *
+   * ttl_ms overrides the timeout of the options for this element, see
+   * ConcurrentLRUCache::insert. invalidate_tag(tag) invalidates it.
    */
-  bool insert(const TKey& key, const TValue& value);
+  bool insert(const TKey& key, const TValue& value, int64_t ttl_ms = cache::kTtlDefault,
+              uint64_t tag = cache::kNoTag);
 
   /**
-   * Batch insert
+   * Batch insert, all elements get the same ttl_ms and tag
    */
-  void insert(const std::unordered_map<TKey, TValue>& data);
+  void insert(const std::unordered_map<TKey, TValue>& data, int64_t ttl_ms = cache::kTtlDefault,
+              uint64_t tag = cache::kNoTag);
 
   /**
-   * Clear the container. NOT THREAD SAFE -- do not use while other threads
-   * are accessing the container.
+   * Remember that key doesn't exist, see ConcurrentLRUCache::insert_negative
+   */
+  bool insert_negative(const TKey& key, int64_t ttl_ms = cache::kTtlDefault, uint64_t tag = cache::kNoTag);
+
+  /**
+   * Clear the container. Every item is invalidated at once, lookups miss
+   * them from then on, and the calling thread removes them shard by shard.
+   * Thread safe, inserts made meanwhile are kept.
    */
   void clear();
 
+  /**
+   * Invalidate the items inserted with tag in O(1), e.g. the items of a
+   * tenant or of a data version. They are missed from then on and removed in
+   * the background, see ConcurrentLRUCache::schedule_purge.
+   */
+  void invalidate_tag(uint64_t tag);
+
   /**
    * Get a snapshot of the keys in the container by copying them into the
    * supplied vector. This will block inserts and prevent LRU updates while it
@@ -81,12 +160,76 @@ struct ConcurrentScalableCache {
    */
   void snapshot_keys(std::vector<TKey>& keys);
 
+  /**
+   * Copy the items of one shard in recency order, see
+   * ConcurrentLRUCache::snapshot_items. Shards are copied one at a time so
+   * that only one of them blocks inserts.
+   */
+  void snapshot_items(size_t shard_ind, std::vector<SnapshotItem>& items);
+
+  /**
+   * Insert an item of a snapshot, see ConcurrentLRUCache::restore
+   */
+  bool restore(const TKey& key, ValueRef value, int64_t expire_time, uint64_t tag = cache::kNoTag);
+
+  size_t num_shards() const { return m_num_shards; }
+
+  /**
+   * Set the eviction listener of every shard, see
+   * ConcurrentLRUCache::EvictionListener. NOT THREAD SAFE -- set it before
+   * the container is used.
+   */
+  void set_eviction_listener(const EvictionListener& listener);
+
   /**
    * Get the approximate size of the container. May be slightly too low when
    * insertion is in progress.
    */
   size_t size() const;
 
+  /**
+   * Get the approximate total weight of the items, the number of items
+   * without a weigher
+   */
+  size_t weighted_size() const;
+
+  /**
+   * Allocation counters summed over the shards
+   */
+  cache::AllocStats alloc_stats() const;
+
+  /**
+   * Counters and limits of every shard, to spot hot shards
+   */
+  std::vector<cache::ShardStats> shard_stats() const;
+
+  /**
+   * The counters and latency histograms of the shards added up
+   */
+  cache::ShardStats stats() const;
+
+  /**
+   * Move capacity toward the shards which evicted since the last call. A
+   * shard's demand is its size plus its evictions; the limits move halfway
+   * from their current values to a split proportional to the demands, and no
+   * shard drops below kRebalanceMinShare of the even split. Does nothing when
+   * no shard evicted. Called by inserts every rebalance_interval_ms if set.
+   */
+  void rebalance();
+
+  /**
+   * Estimated hit ratio of the gets if the container held size items, read
+   * from the miss ratio curve sampled since the start or reset_mrc(). It is
+   * the curve of LRU, the other policies come close; replay a trace with
+   * cache_sim to compare them. Returns false if mrc_sample_rate is 0.
+   */
+  bool estimate_hit_ratio(size_t size, double& hit_ratio) const;
+
+  /**
+   * Restart the miss ratio curve, e.g. after the workload changed
+   */
+  void reset_mrc();
+
  private:
   /**
    * Get the child container for a given key
@@ -96,9 +239,46 @@ struct ConcurrentScalableCache {
   size_t get_shard_ind(const TKey& key);
 
   /**
-   * The maximum number of elements in the container.
+   * Feed an access of key to the miss ratio curve if enabled. Called once
+   * per read the shards count, peek is neither, so that the curve and its
+   * SHARDS_adj correction see every logical get once.
+   */
+  void sample(const TKey& key, bool is_get) {
+    if (m_mrc != nullptr) {
+      m_mrc->access(THash().hash(key), is_get);
+    }
+  }
+
+  /**
+   * Run rebalance() if rebalance_interval_ms has passed since the last run
+   */
+  void maybe_rebalance();
+
+  /**
+   * The initial limit of shard i out of total, 0 if total is. The remainder
+   * is spread over the first shards, and every shard gets at least 1 since 0
+   * means unbounded to a shard.
+   */
+  size_t shard_limit(size_t total, size_t i) const {
+    if (total == 0) {
+      return 0;
+    }
+    return std::max<size_t>(1, total / m_num_shards + (i < total % m_num_shards ? 1 : 0));
+  }
+
+  /**
+   * Split total into limits proportional to demand, see rebalance(). Every
+   * limit is at least 1 like in shard_limit.
+   */
+  static std::vector<size_t> split_capacity(size_t total, const std::vector<size_t>& demand,
+                                            const std::vector<size_t>& current);
+
+  /**
+   * The maximum number of elements and total weight of the container, 0 is
+   * unbounded
    */
   size_t m_max_size;
+  size_t m_max_weight;
 
   /**
    * The child containers
@@ -106,85 +286,397 @@ struct ConcurrentScalableCache {
   size_t m_num_shards;
   typedef std::shared_ptr<Shard> ShardPtr;
   std::vector<ShardPtr> m_shards;
+
+  /**
+   * num_shards - 1 when it is a power of two and pow2_shards is set, 0
+   * otherwise
+   */
+  size_t m_shard_mask;
+
+  /**
+   * Rebalance state, the eviction counters of the shards at the last run
+   */
+  uint32_t m_rebalance_interval_ms;
+  std::atomic<int64_t> m_next_rebalance;
+  std::mutex m_rebalance_mutex;
+  std::vector<size_t> m_last_evictions;
+  std::vector<size_t> m_last_evicted_weight;
+
+  /**
+   * Minimum batch size of a parallel find_batch, 0 means never
+   */
+  size_t m_parallel_find_size;
+
+  /**
+   * The eviction thread in kEvictModeBackground. Declared after the shards so
+   * it is stopped before they are destroyed.
+   */
+  std::unique_ptr<cache::CacheEvictor> m_evictor;
+
+  /**
+   * The generations shared by the shards, one invalidation covers all of
+   * them
+   */
+  std::shared_ptr<cache::GenerationTable> m_generations;
+
+  /**
+   * The online miss ratio curve, nullptr if disabled, and the number of gets
+   * of the shards at its last reset
+   */
+  std::unique_ptr<cache::MrcEstimator> m_mrc;
+  std::atomic<size_t> m_mrc_base_gets{0};
+
+  /**
+   * find_raw reads nothing and counts nothing without epoch_reads
+   */
+  bool m_epoch_reads;
 };
 
-template <class TKey, class TValue, class TMutex, class THash>
-ConcurrentScalableCache<TKey, TValue, TMutex, THash>::ConcurrentScalableCache(size_t max_size, uint32_t timeout,
-                                                                              size_t num_shards,
-                                                                              cache::CacheEvictType evict_type)
-    : m_max_size(max_size), m_num_shards(num_shards) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::ConcurrentScalableCache(
+    size_t max_size, uint32_t timeout, size_t num_shards, cache::CacheEvictType evict_type)
+    : ConcurrentScalableCache(cache::CacheOptions{max_size, timeout, num_shards, evict_type}) {}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::ConcurrentScalableCache(
+    const cache::CacheOptions& options, const Weigher& weigher)
+    : m_max_size(options.max_size),
+      m_max_weight(options.max_weight),
+      m_num_shards(options.num_shards),
+      m_shard_mask(0),
+      m_rebalance_interval_ms(options.rebalance_interval_ms),
+      m_next_rebalance(GetCoarseTimeMillis() + options.rebalance_interval_ms),
+      m_parallel_find_size(options.parallel_find_size),
+      m_epoch_reads(options.epoch_reads) {
   if (m_num_shards == 0) {
     m_num_shards = std::thread::hardware_concurrency();
   }
+  if (options.pow2_shards) {
+    size_t num_shards = 1;
+    while (num_shards < m_num_shards) {
+      num_shards <<= 1;
+    }
+    m_num_shards = num_shards;
+    m_shard_mask = num_shards - 1;
+  }
+  m_last_evictions.resize(m_num_shards, 0);
+  m_last_evicted_weight.resize(m_num_shards, 0);
   for (size_t i = 0; i < m_num_shards; i++) {
-    size_t s = max_size / m_num_shards;
-    if (i == 0) {
-      s += max_size % m_num_shards;
+    cache::CacheOptions shard_options = options;
+    shard_options.max_size = shard_limit(m_max_size, i);
+    shard_options.max_weight = shard_limit(m_max_weight, i);
+    m_shards.emplace_back(std::make_shared<Shard>(shard_options, weigher));
+  }
+  m_generations = std::make_shared<cache::GenerationTable>();
+  for (auto& shard : m_shards) {
+    shard->set_generations(m_generations);
+  }
+  if (options.mrc_sample_rate > 0) {
+    m_mrc.reset(new cache::MrcEstimator(options.mrc_sample_rate, options.mrc_max_keys));
+  }
+  if (options.evict_mode == cache::kEvictModeBackground) {
+    m_evictor.reset(new cache::CacheEvictor());
+    for (auto& shard : m_shards) {
+      Shard* shard_ptr = shard.get();
+      size_t index = m_evictor->add([shard_ptr]() { return shard_ptr->evict_batch(cache::kMaxEvictBatch); });
+      shard->set_evictor(m_evictor.get(), index);
     }
-    m_shards.emplace_back(std::make_shared<Shard>(s, timeout, evict_type));
+    m_evictor->start();
   }
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-size_t ConcurrentScalableCache<TKey, TValue, TMutex, THash>::get_shard_ind(const TKey& key) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+size_t ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::get_shard_ind(const TKey& key) {
   THash hash_obj;
   constexpr int shift = std::numeric_limits<size_t>::digits - 16;
-  size_t h = (hash_obj.hash(key) >> shift) % m_num_shards;
-  return h;
+  // The shard's hash map takes the low bits of the same hash for its buckets.
+  // Multiplying by the golden ratio moves all the bits into the high ones, so
+  // identity hashes of integer keys don't all land in shard 0.
+  size_t h = (hash_obj.hash(key) * static_cast<size_t>(0x9e3779b97f4a7c15ULL)) >> shift;
+  return m_shard_mask != 0 ? h & m_shard_mask : h % m_num_shards;
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-typename ConcurrentScalableCache<TKey, TValue, TMutex, THash>::Shard&
-ConcurrentScalableCache<TKey, TValue, TMutex, THash>::get_shard(const TKey& key) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+typename ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::Shard&
+ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::get_shard(const TKey& key) {
   size_t h = get_shard_ind(key);
   return *(m_shards.at(h));
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-bool ConcurrentScalableCache<TKey, TValue, TMutex, THash>::find(ConstAccessor& ac, const TKey& key) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::find(ConstAccessor& ac, const TKey& key) {
+  sample(key, true);
   return get_shard(key).find(ac, key);
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-bool ConcurrentScalableCache<TKey, TValue, TMutex, THash>::insert(const TKey& key, const TValue& value) {
-  return get_shard(key).insert(key, value);
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+cache::LookupResult ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::lookup(ConstAccessor& ac,
+                                                                                           const TKey& key) {
+  sample(key, true);
+  return get_shard(key).lookup(ac, key);
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+template <class Func>
+void ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::find_batch(const std::vector<TKey>& keys,
+                                                                                const Func& func) {
+  // Counting sort of the key indexes by shard, the indexes of shard i are
+  // indexes[offsets[i], offsets[i + 1])
+  std::vector<uint32_t> shard_inds(keys.size());
+  std::vector<size_t> offsets(m_num_shards + 1, 0);
+  for (size_t i = 0; i < keys.size(); i++) {
+    shard_inds[i] = static_cast<uint32_t>(get_shard_ind(keys[i]));
+    offsets[shard_inds[i] + 1]++;
+    sample(keys[i], true);
+  }
+  for (size_t i = 0; i < m_num_shards; i++) {
+    offsets[i + 1] += offsets[i];
+  }
+  std::vector<size_t> indexes(keys.size());
+  std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+  for (size_t i = 0; i < keys.size(); i++) {
+    indexes[next[shard_inds[i]]++] = i;
+  }
+  auto find_func = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      if (offsets[i + 1] > offsets[i]) {
+        m_shards[i]->find_batch(keys, &indexes[offsets[i]], offsets[i + 1] - offsets[i], func);
+      }
+    }
+  };
+  if (m_parallel_find_size != 0 && keys.size() >= m_parallel_find_size && m_num_shards > 1) {
+    ParallelFor(0, m_num_shards, 1, find_func);
+  } else {
+    find_func(0, m_num_shards);
+  }
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::insert(const TKey& key, const TValue& value,
+                                                                            int64_t ttl_ms, uint64_t tag) {
+  maybe_rebalance();
+  sample(key, false);
+  return get_shard(key).insert(key, value, ttl_ms, tag);
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-void ConcurrentScalableCache<TKey, TValue, TMutex, THash>::insert(const std::unordered_map<TKey, TValue>& data) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::insert_negative(const TKey& key,
+                                                                                     int64_t ttl_ms, uint64_t tag) {
+  maybe_rebalance();
+  sample(key, false);
+  return get_shard(key).insert_negative(key, ttl_ms, tag);
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::insert(
+    const std::unordered_map<TKey, TValue>& data, int64_t ttl_ms, uint64_t tag) {
+  maybe_rebalance();
   std::vector<std::unordered_map<const TKey*, const TValue*>> data_vec;
   data_vec.resize(m_num_shards);
   for (const auto& pair : data) {
     size_t ind = get_shard_ind(pair.first);
     data_vec[ind].insert(std::make_pair(&(pair.first), &(pair.second)));
+    sample(pair.first, false);
   }
   for (size_t i = 0; i < m_num_shards; i++) {
     if (data_vec[i].size() > 0) {
-      m_shards[i]->insert(data_vec[i]);
+      m_shards[i]->insert(data_vec[i], ttl_ms, tag);
     }
   }
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-void ConcurrentScalableCache<TKey, TValue, TMutex, THash>::clear() {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::clear() {
+  m_generations->invalidate_all();
   for (size_t i = 0; i < m_num_shards; i++) {
-    m_shards[i]->clear();
+    while (m_shards[i]->purge_invalidated(cache::kMaxEvictBatch) != 0) {
+    }
   }
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-void ConcurrentScalableCache<TKey, TValue, TMutex, THash>::snapshot_keys(std::vector<TKey>& keys) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::invalidate_tag(uint64_t tag) {
+  m_generations->invalidate_tag(tag);
+  for (size_t i = 0; i < m_num_shards; i++) {
+    m_shards[i]->schedule_purge();
+  }
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::snapshot_keys(std::vector<TKey>& keys) {
   for (size_t i = 0; i < m_num_shards; i++) {
     m_shards[i]->snapshot_keys(keys);
   }
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-size_t ConcurrentScalableCache<TKey, TValue, TMutex, THash>::size() const {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::snapshot_items(
+    size_t shard_ind, std::vector<SnapshotItem>& items) {
+  m_shards[shard_ind]->snapshot_items(items);
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::restore(const TKey& key, ValueRef value,
+                                                                             int64_t expire_time, uint64_t tag) {
+  return get_shard(key).restore(key, std::move(value), expire_time, tag);
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::set_eviction_listener(
+    const EvictionListener& listener) {
+  for (size_t i = 0; i < m_num_shards; i++) {
+    m_shards[i]->set_eviction_listener(listener);
+  }
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+size_t ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::size() const {
   size_t size = 0;
   for (size_t i = 0; i < m_num_shards; i++) {
     size += m_shards[i]->size();
   }
   return size;
 }
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+size_t ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::weighted_size() const {
+  size_t weight = 0;
+  for (size_t i = 0; i < m_num_shards; i++) {
+    weight += m_shards[i]->weighted_size();
+  }
+  return weight;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+cache::AllocStats ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::alloc_stats() const {
+  cache::AllocStats stats;
+  for (size_t i = 0; i < m_num_shards; i++) {
+    stats += m_shards[i]->alloc_stats();
+  }
+  return stats;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+std::vector<cache::ShardStats> ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::shard_stats() const {
+  std::vector<cache::ShardStats> stats;
+  stats.reserve(m_num_shards);
+  for (size_t i = 0; i < m_num_shards; i++) {
+    stats.push_back(m_shards[i]->stats());
+  }
+  return stats;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+cache::ShardStats ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::stats() const {
+  cache::ShardStats stats;
+  for (size_t i = 0; i < m_num_shards; i++) {
+    stats += m_shards[i]->stats();
+  }
+  return stats;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::estimate_hit_ratio(size_t size,
+                                                                                        double& hit_ratio) const {
+  if (m_mrc == nullptr) {
+    return false;
+  }
+  // The shards count every get, sampled or not
+  cache::ShardStats total = stats();
+  hit_ratio = m_mrc->hit_ratio(size, total.hits + total.misses - m_mrc_base_gets.load(std::memory_order_relaxed));
+  return true;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::reset_mrc() {
+  if (m_mrc != nullptr) {
+    cache::ShardStats total = stats();
+    m_mrc_base_gets.store(total.hits + total.misses, std::memory_order_relaxed);
+    m_mrc->reset();
+  }
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::maybe_rebalance() {
+  if (m_rebalance_interval_ms == 0) {
+    return;
+  }
+  int64_t now = GetCoarseTimeMillis();
+  int64_t next = m_next_rebalance.load(std::memory_order_relaxed);
+  // Only the thread which moves the deadline runs it
+  if (now < next || !m_next_rebalance.compare_exchange_strong(next, now + m_rebalance_interval_ms)) {
+    return;
+  }
+  rebalance();
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::rebalance() {
+  if (m_num_shards < 2) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(m_rebalance_mutex);
+  std::vector<cache::ShardStats> stats = shard_stats();
+  std::vector<size_t> size_demand(m_num_shards), weight_demand(m_num_shards);
+  std::vector<size_t> max_sizes(m_num_shards), max_weights(m_num_shards);
+  size_t evictions = 0;
+  for (size_t i = 0; i < m_num_shards; i++) {
+    size_t evicted = stats[i].evictions - m_last_evictions[i];
+    size_t evicted_weight = stats[i].evicted_weight - m_last_evicted_weight[i];
+    m_last_evictions[i] = stats[i].evictions;
+    m_last_evicted_weight[i] = stats[i].evicted_weight;
+    evictions += evicted;
+    size_demand[i] = stats[i].size + evicted;
+    weight_demand[i] = stats[i].weighted_size + evicted_weight;
+    max_sizes[i] = stats[i].max_size;
+    max_weights[i] = stats[i].max_weight;
+  }
+  if (evictions == 0) {
+    // No shard is under pressure, keep the limits
+    return;
+  }
+  if (m_max_size != 0) {
+    std::vector<size_t> limits = split_capacity(m_max_size, size_demand, max_sizes);
+    for (size_t i = 0; i < m_num_shards; i++) {
+      m_shards[i]->set_max_size(limits[i]);
+    }
+  }
+  if (m_max_weight != 0) {
+    std::vector<size_t> limits = split_capacity(m_max_weight, weight_demand, max_weights);
+    for (size_t i = 0; i < m_num_shards; i++) {
+      m_shards[i]->set_max_weight(limits[i]);
+    }
+  }
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+std::vector<size_t> ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>::split_capacity(
+    size_t total, const std::vector<size_t>& demand, const std::vector<size_t>& current) {
+  size_t num = demand.size();
+  size_t min_limit = std::max<size_t>(1, static_cast<size_t>(total / num * cache::kRebalanceMinShare));
+  size_t spare = total > min_limit * num ? total - min_limit * num : 0;
+  double demand_sum = 0;
+  for (size_t value : demand) {
+    demand_sum += static_cast<double>(value);
+  }
+  std::vector<size_t> limits(num);
+  size_t assigned = 0;
+  size_t hottest = 0;
+  for (size_t i = 0; i < num; i++) {
+    double share = demand_sum > 0 ? demand[i] / demand_sum : 1.0 / num;
+    double target = min_limit + spare * share;
+    // An unbounded or oversized limit would push the sum past total
+    double limit = (static_cast<double>(std::min(current[i], total)) + target) / 2;
+    limits[i] = std::max(min_limit, static_cast<size_t>(limit));
+    assigned += limits[i];
+    if (demand[i] > demand[hottest]) {
+      hottest = i;
+    }
+  }
+  // The limits were rounded down, give the rest to the hottest shard
+  if (assigned < total) {
+    limits[hottest] += total - assigned;
+  }
+  return limits;
+}
 }  // namespace cpp_lib
\ No newline at end of file
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cpp_lib {
+
+namespace cache {
+
+/**
+ * Epoch-based reclamation. Readers enter an epoch with an EpochGuard and may
+ * use the objects they reach without locks until the guard is destroyed.
+ * Writers unlink an object first and then retire() it; it is freed once
+ * every thread which was inside an epoch at that time has left it.
+ *
+ * The global epoch advances when every active reader has seen the current
+ * one, an object retired in epoch e is freed once the epoch reaches e + 2.
+ * Entering and leaving are a store and a fence on the thread's own cache
+ * line, readers never wait. A reader staying in its epoch holds back
+ * reclamation, not other threads.
+ *
+ * Threads take one of kMaxSlots slots on their first guard and release it on
+ * exit, objects they retired and didn't free are handed over to the others.
+ * A coroutine must not yield while it holds a guard, it could resume on
+ * another thread.
+ */
+class EpochManager {
+ public:
+  static constexpr size_t kMaxSlots = 1024;
+  // Retires between two attempts to advance the epoch and free objects
+  static constexpr size_t kReclaimInterval = 64;
+
+  typedef void (*Deleter)(void*);
+
+  static EpochManager& instance() {
+    static EpochManager manager;
+    return manager;
+  }
+
+  void enter() {
+    ThreadState& state = thread_state();
+    if (state.depth++ == 0) {
+      Slot& slot = m_slots[state.slot];
+      slot.epoch.store(m_epoch.load(std::memory_order_relaxed) | kActive, std::memory_order_relaxed);
+      // The slot must be visible before the reader loads any pointer
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+  }
+
+  void exit() {
+    ThreadState& state = thread_state();
+    if (--state.depth == 0) {
+      m_slots[state.slot].epoch.store(0, std::memory_order_release);
+    }
+  }
+
+  /**
+   * Free ptr with deleter once no reader can reach it. The caller has
+   * unlinked it already.
+   */
+  void retire(void* ptr, Deleter deleter) {
+    ThreadState& state = thread_state();
+    state.retired.push_back(Retired{ptr, deleter, retire_epoch()});
+    m_pending.fetch_add(1, std::memory_order_relaxed);
+    if (++state.retire_count % kReclaimInterval == 0) {
+      try_advance();
+      reclaim(state.retired);
+      reclaim_orphans();
+    }
+  }
+
+  /**
+   * The epoch of an object the caller just unlinked, for owners which keep
+   * their retired objects themselves instead of calling retire()
+   */
+  uint64_t retire_epoch() {
+    // Order the unlink before reading the epoch
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return m_epoch.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Whether no reader can reach an object unlinked in epoch, see
+   * retire_epoch. Tries to advance the epoch if not yet.
+   */
+  bool reclaimable(uint64_t epoch) {
+    if (!passed(epoch)) {
+      try_advance();
+    }
+    return passed(epoch);
+  }
+
+  /**
+   * Free everything retired by the calling thread that is safe to free,
+   * e.g. before it goes idle
+   */
+  void flush() {
+    try_advance();
+    reclaim(thread_state().retired);
+    reclaim_orphans();
+  }
+
+  /**
+   * Number of objects retired and not yet freed by any thread, for tests
+   * and stats
+   */
+  size_t pending() const { return m_pending.load(std::memory_order_relaxed); }
+
+ private:
+  static constexpr uint64_t kActive = 1;
+  // The epoch counts in steps of 2, the low bit of a slot marks it active
+  static constexpr uint64_t kEpochStep = 2;
+
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<bool> in_use{false};
+  };
+
+  struct Retired {
+    void* ptr;
+    Deleter deleter;
+    uint64_t epoch;
+  };
+
+  struct ThreadState {
+    size_t slot = 0;
+    size_t depth = 0;
+    size_t retire_count = 0;
+    std::vector<Retired> retired;
+
+    ~ThreadState() { EpochManager::instance().release(*this); }
+  };
+
+  EpochManager() = default;
+
+  ThreadState& thread_state() {
+    thread_local ThreadState state;
+    thread_local bool registered = false;
+    if (!registered) {
+      state.slot = acquire_slot();
+      registered = true;
+    }
+    return state;
+  }
+
+  size_t acquire_slot() {
+    for (;;) {
+      for (size_t i = 0; i < kMaxSlots; i++) {
+        bool expected = false;
+        if (!m_slots[i].in_use.load(std::memory_order_relaxed) &&
+            m_slots[i].in_use.compare_exchange_strong(expected, true)) {
+          return i;
+        }
+      }
+      // More live threads than slots, wait for one to exit
+      std::this_thread::yield();
+    }
+  }
+
+  void release(ThreadState& state) {
+    if (!state.retired.empty()) {
+      std::lock_guard<std::mutex> lock(m_orphan_mutex);
+      m_orphans.insert(m_orphans.end(), state.retired.begin(), state.retired.end());
+      state.retired.clear();
+    }
+    m_slots[state.slot].epoch.store(0, std::memory_order_release);
+    m_slots[state.slot].in_use.store(false, std::memory_order_release);
+  }
+
+  void try_advance() {
+    uint64_t epoch = m_epoch.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (size_t i = 0; i < kMaxSlots; i++) {
+      uint64_t slot_epoch = m_slots[i].epoch.load(std::memory_order_acquire);
+      if ((slot_epoch & kActive) != 0 && (slot_epoch & ~kActive) != epoch) {
+        // A reader is still in an older epoch
+        return;
+      }
+    }
+    m_epoch.compare_exchange_strong(epoch, epoch + kEpochStep);
+  }
+
+  bool passed(uint64_t epoch) const { return epoch + 2 * kEpochStep <= m_epoch.load(std::memory_order_acquire); }
+
+  void reclaim(std::vector<Retired>& retired) {
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); i++) {
+      if (passed(retired[i].epoch)) {
+        retired[i].deleter(retired[i].ptr);
+        m_pending.fetch_sub(1, std::memory_order_relaxed);
+      } else {
+        retired[kept++] = retired[i];
+      }
+    }
+    retired.resize(kept);
+  }
+
+  void reclaim_orphans() {
+    std::unique_lock<std::mutex> lock(m_orphan_mutex, std::try_to_lock);
+    if (lock.owns_lock() && !m_orphans.empty()) {
+      reclaim(m_orphans);
+    }
+  }
+
+  std::atomic<uint64_t> m_epoch{kEpochStep};
+  Slot m_slots[kMaxSlots];
+  std::mutex m_orphan_mutex;
+  std::vector<Retired> m_orphans;
+  std::atomic<size_t> m_pending{0};
+};
+
+/**
+ * Keeps the calling thread inside an epoch, see EpochManager
+ */
+class EpochGuard {
+ public:
+  EpochGuard() { EpochManager::instance().enter(); }
+  ~EpochGuard() { EpochManager::instance().exit(); }
+
+  EpochGuard(const EpochGuard&) = delete;
+  EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
@@ -0,0 +1,629 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "cpp_lib/cache/epoch.h"
+
+namespace cpp_lib {
+
+namespace cache {
+
+/**
+ * Reader-writer spin lock of a FlatHashMap node. Readers never wait on it
+ * while holding anything else, they give up and retry the lookup instead.
+ */
+class NodeRWLock {
+ public:
+  bool try_lock_shared() {
+    uint32_t state = m_state.load(std::memory_order_relaxed);
+    return (state & kWriter) == 0 &&
+           m_state.compare_exchange_strong(state, state + 1, std::memory_order_acquire, std::memory_order_relaxed);
+  }
+
+  void unlock_shared() { m_state.fetch_sub(1, std::memory_order_release); }
+
+  bool try_lock() {
+    uint32_t expect = 0;
+    return m_state.compare_exchange_strong(expect, kWriter, std::memory_order_acquire, std::memory_order_relaxed);
+  }
+
+  void lock() {
+    for (int spins = 0; !try_lock(); spins++) {
+      Backoff(spins);
+    }
+  }
+
+  void unlock() { m_state.store(0, std::memory_order_release); }
+
+  static void Backoff(int spins) {
+    if (spins >= 16) {
+      std::this_thread::yield();
+    }
+  }
+
+ private:
+  static constexpr uint32_t kWriter = 1u << 31;
+  std::atomic<uint32_t> m_state{0};
+};
+
+/**
+ * A concurrent hash map with open addressing, used as the FlatMapBackend of
+ * ConcurrentLRUCache. It has the subset of the tbb::concurrent_hash_map
+ * interface the cache uses: accessors holding a shared or exclusive lock of
+ * one element, find, insert, erase and clear.
+ *
+ * The map is split into segments by hash. A segment is an array of 64-byte
+ * groups, each with 7 tag bytes, an overflow count and 7 node pointers, so a
+ * probe usually touches one cache line. The tags of a group are matched 8 at
+ * a time in one 64-bit word (SWAR). A lookup stops at the first group whose
+ * overflow count, the number of keys which probed past it, is 0.
+ *
+ * Writers lock the segment mutex and bump its sequence number. Readers don't
+ * write the segment: they probe optimistically, lock the candidate node and
+ * validate the sequence number afterwards, retrying if a writer interfered.
+ * Probing nodes which are concurrently erased is safe because node memory is
+ * type-stable: nodes are recycled through a free list and only released with
+ * the map, and the node lock word is never reinitialized. Lookups run under
+ * an EpochGuard, and a table replaced by a grow is freed by the writers of
+ * its segment once no lookup can still see it.
+ *
+ * Elements never move, so pointers to them stay valid until they are erased.
+ */
+template <class TKey, class TValue, class THash,
+          class TAllocator = std::allocator<std::pair<const TKey, TValue>>>
+class FlatHashMap {
+ public:
+  typedef std::pair<const TKey, TValue> value_type;
+  typedef TAllocator allocator_type;
+
+ private:
+  struct Node {
+    // Valid for the whole life of the map, see NodePool
+    NodeRWLock lock;
+    std::atomic<size_t> hash{0};
+    Node* next_free = nullptr;
+    alignas(value_type) unsigned char storage[sizeof(value_type)];
+
+    value_type* value() { return reinterpret_cast<value_type*>(storage); }
+  };
+
+  typedef typename std::allocator_traits<TAllocator>::template rebind_alloc<Node> NodeAllocator;
+
+  /**
+   * Type-stable node storage: nodes are carved from chunks, recycled through
+   * a free list and only released with the pool.
+   */
+  class NodePool {
+   public:
+    explicit NodePool(const TAllocator& alloc) : m_alloc(alloc) {}
+
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    ~NodePool() {
+      for (Node* chunk : m_chunks) {
+        for (size_t i = 0; i < kChunkNodes; i++) {
+          chunk[i].~Node();
+        }
+        m_alloc.deallocate(chunk, kChunkNodes);
+      }
+    }
+
+    Node* allocate() {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_free != nullptr) {
+        Node* node = m_free;
+        m_free = node->next_free;
+        return node;
+      }
+      if (m_chunk_used == kChunkNodes) {
+        Node* chunk = m_alloc.allocate(kChunkNodes);
+        for (size_t i = 0; i < kChunkNodes; i++) {
+          new (&chunk[i]) Node();
+        }
+        m_chunks.push_back(chunk);
+        m_chunk_used = 0;
+      }
+      return &m_chunks.back()[m_chunk_used++];
+    }
+
+    void free(Node* node) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      node->next_free = m_free;
+      m_free = node;
+    }
+
+   private:
+    static constexpr size_t kChunkNodes = 64;
+
+    NodeAllocator m_alloc;
+    std::mutex m_mutex;
+    Node* m_free = nullptr;
+    std::vector<Node*> m_chunks;
+    size_t m_chunk_used = kChunkNodes;
+  };
+
+  static constexpr int kGroupSlots = 7;
+  static constexpr uint64_t kLowBits = 0x0101010101010101ULL;
+  static constexpr uint64_t kHighBits = 0x8080808080808080ULL;
+  static constexpr uint64_t kSlotBytes = 0x00ffffffffffffffULL;
+  static constexpr int kOverflowShift = 56;
+  static constexpr uint64_t kMaxOverflow = 0xff;
+
+  struct alignas(64) Group {
+    Group() {
+      ctrl.store(0, std::memory_order_relaxed);
+      for (auto& node : nodes) {
+        node.store(nullptr, std::memory_order_relaxed);
+      }
+    }
+
+    // Bytes 0-6 are the slot tags, 0 for an empty slot, byte 7 counts the
+    // keys that probed past this group
+    std::atomic<uint64_t> ctrl;
+    std::atomic<Node*> nodes[kGroupSlots];
+  };
+
+  struct Table {
+    explicit Table(size_t group_num) : mask(group_num - 1), groups(new Group[group_num]) {}
+
+    size_t capacity() const { return (mask + 1) * kGroupSlots; }
+
+    size_t mask;
+    std::unique_ptr<Group[]> groups;
+  };
+
+  struct RetiredTable {
+    // See EpochManager::retire_epoch
+    uint64_t epoch;
+    std::unique_ptr<Table> table;
+  };
+
+  struct alignas(64) Segment {
+    // Odd while a writer modifies the segment
+    std::atomic<uint64_t> seq{0};
+    std::atomic<Table*> table{nullptr};
+    // Whether retired is not empty, read by lookups to help free it
+    std::atomic<bool> has_retired{false};
+    std::mutex mutex;
+    // The fields below are guarded by the mutex
+    size_t size = 0;
+    std::unique_ptr<Table> current;
+    std::vector<RetiredTable> retired;
+  };
+
+  static constexpr size_t kSegmentNum = 16;
+
+ public:
+  /**
+   * Holds a shared lock of the element until released or destroyed
+   */
+  class const_accessor {
+   public:
+    const_accessor() : m_node(nullptr), m_exclusive(false) {}
+
+    const_accessor(const const_accessor&) = delete;
+    const_accessor& operator=(const const_accessor&) = delete;
+
+    ~const_accessor() { release(); }
+
+    bool empty() const { return m_node == nullptr; }
+
+    void release() {
+      if (m_node != nullptr) {
+        if (m_exclusive) {
+          m_node->lock.unlock();
+        } else {
+          m_node->lock.unlock_shared();
+        }
+        m_node = nullptr;
+      }
+    }
+
+    const value_type& operator*() const { return *m_node->value(); }
+
+    const value_type* operator->() const { return m_node->value(); }
+
+   protected:
+    friend class FlatHashMap;
+    Node* m_node;
+    bool m_exclusive;
+  };
+
+  /**
+   * Holds an exclusive lock of the element until released or destroyed
+   */
+  class accessor : public const_accessor {
+   public:
+    value_type& operator*() const { return *this->m_node->value(); }
+
+    value_type* operator->() const { return this->m_node->value(); }
+  };
+
+  explicit FlatHashMap(size_t n = 0, const TAllocator& alloc = TAllocator()) : m_pool(alloc) {
+    size_t group_num = 1;
+    while (group_num * kGroupSlots * kSegmentNum < n) {
+      group_num <<= 1;
+    }
+    for (Segment& seg : m_segments) {
+      seg.current.reset(new Table(group_num));
+      seg.table.store(seg.current.get(), std::memory_order_release);
+    }
+  }
+
+  FlatHashMap(const FlatHashMap&) = delete;
+  FlatHashMap& operator=(const FlatHashMap&) = delete;
+
+  ~FlatHashMap() { clear(); }
+
+  bool find(const_accessor& result, const TKey& key) const {
+    result.release();
+    size_t h = hash_of(key);
+    result.m_node = lookup(key, h, false);
+    result.m_exclusive = false;
+    help_free_retired(segment(h));
+    return result.m_node != nullptr;
+  }
+
+  bool find(accessor& result, const TKey& key) {
+    result.release();
+    size_t h = hash_of(key);
+    result.m_node = lookup(key, h, true);
+    result.m_exclusive = true;
+    help_free_retired(segment(h));
+    return result.m_node != nullptr;
+  }
+
+  /**
+   * Lock the element of key exclusively, inserting a default-constructed
+   * value if it doesn't exist. Returns true if the element was inserted.
+   */
+  bool insert(accessor& result, const TKey& key) {
+    result.release();
+    result.m_exclusive = true;
+    size_t h = hash_of(key);
+    Segment& seg = segment(h);
+    while (true) {
+      result.m_node = lookup(key, h, true);
+      if (result.m_node != nullptr) {
+        return false;
+      }
+      Node* node = m_pool.allocate();
+      new (node->storage) value_type(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple());
+      node->hash.store(h, std::memory_order_relaxed);
+      // A reader may briefly hold a recycled node, see lookup
+      node->lock.lock();
+      {
+        std::lock_guard<std::mutex> lock(seg.mutex);
+        free_retired(seg);
+        if (locate(seg, key, h) == nullptr) {
+          if ((seg.size + 1) * 8 > seg.current->capacity() * 7) {
+            grow(seg);
+          }
+          begin_write(seg);
+          place(*seg.current, node, h);
+          end_write(seg);
+          seg.size++;
+          m_size.fetch_add(1, std::memory_order_relaxed);
+          result.m_node = node;
+          return true;
+        }
+      }
+      // Lost the race against an insert of the same key
+      node->lock.unlock();
+      free_node(node);
+    }
+  }
+
+  /**
+   * Erase the element held by the accessor, the accessor is released
+   */
+  bool erase(accessor& item) {
+    Node* node = item.m_node;
+    if (node == nullptr) {
+      return false;
+    }
+    size_t h = node->hash.load(std::memory_order_relaxed);
+    Segment& seg = segment(h);
+    {
+      std::lock_guard<std::mutex> lock(seg.mutex);
+      free_retired(seg);
+      begin_write(seg);
+      unplace(*seg.current, node, h);
+      end_write(seg);
+      seg.size--;
+    }
+    m_size.fetch_sub(1, std::memory_order_relaxed);
+    item.release();
+    free_node(node);
+    return true;
+  }
+
+  /**
+   * Remove all elements. NOT THREAD SAFE.
+   */
+  void clear() {
+    for (Segment& seg : m_segments) {
+      Table& table = *seg.current;
+      for (size_t g = 0; g <= table.mask; g++) {
+        Group& group = table.groups[g];
+        for (auto& slot : group.nodes) {
+          Node* node = slot.load(std::memory_order_relaxed);
+          if (node != nullptr) {
+            free_node(node);
+            slot.store(nullptr, std::memory_order_relaxed);
+          }
+        }
+        group.ctrl.store(0, std::memory_order_relaxed);
+      }
+      seg.retired.clear();
+      seg.has_retired.store(false, std::memory_order_relaxed);
+      seg.size = 0;
+    }
+    m_size.store(0, std::memory_order_relaxed);
+  }
+
+  size_t size() const { return m_size.load(std::memory_order_relaxed); }
+
+  bool empty() const { return size() == 0; }
+
+  /**
+   * Prefetch the home group of key, see FlatMapBackend
+   */
+  void prefetch(const TKey& key) const {
+    EpochGuard guard;
+    size_t h = hash_of(key);
+    const Table* table = segment(h).table.load(std::memory_order_acquire);
+    __builtin_prefetch(&table->groups[h & table->mask]);
+  }
+
+ private:
+  size_t hash_of(const TKey& key) const {
+    uint64_t h = static_cast<uint64_t>(m_hash_compare.hash(key)) * 0x9e3779b97f4a7c15ULL;
+    return static_cast<size_t>(h ^ (h >> 32));
+  }
+
+  static uint8_t tag_of(size_t h) { return static_cast<uint8_t>(0x80 | (static_cast<uint64_t>(h) >> 57)); }
+
+  Segment& segment(size_t h) const {
+    return const_cast<Segment&>(m_segments[(static_cast<uint64_t>(h) >> 52) & (kSegmentNum - 1)]);
+  }
+
+  /**
+   * Bytes of ctrl which may equal tag. There may be false positives above a
+   * true match, candidates are checked against the node.
+   */
+  static uint64_t match(uint64_t ctrl, uint8_t tag) {
+    uint64_t x = ctrl ^ (kLowBits * tag);
+    return (x - kLowBits) & ~x & kHighBits & kSlotBytes;
+  }
+
+  static uint8_t ctrl_byte(uint64_t ctrl, int slot) { return static_cast<uint8_t>(ctrl >> (slot * 8)); }
+
+  static void begin_write(Segment& seg) {
+    seg.seq.store(seg.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  static void end_write(Segment& seg) {
+    seg.seq.store(seg.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /**
+   * Find and lock the node of key, optimistically: the probe reads the
+   * segment without locking it, the candidate node is locked and then the
+   * sequence number tells whether the probe saw a consistent segment.
+   */
+  Node* lookup(const TKey& key, size_t h, bool exclusive) const {
+    // Keeps the tables replaced meanwhile alive, see free_retired
+    EpochGuard guard;
+    Segment& seg = segment(h);
+    uint8_t tag = tag_of(h);
+    for (int spins = 0;; spins++) {
+      uint64_t seq = seg.seq.load(std::memory_order_acquire);
+      if (seq & 1) {
+        NodeRWLock::Backoff(spins);
+        continue;
+      }
+      const Table* table = seg.table.load(std::memory_order_acquire);
+      bool retry = false;
+      size_t g = h & table->mask;
+      for (size_t probes = 0; probes <= table->mask && !retry; probes++) {
+        const Group& group = table->groups[g];
+        uint64_t ctrl = group.ctrl.load(std::memory_order_relaxed);
+        for (uint64_t bits = match(ctrl, tag); bits != 0; bits &= bits - 1) {
+          int slot = __builtin_ctzll(bits) / 8;
+          Node* node = group.nodes[slot].load(std::memory_order_relaxed);
+          if (node == nullptr || node->hash.load(std::memory_order_relaxed) != h) {
+            continue;
+          }
+          // The node may be concurrently erased or even recycled, its lock
+          // word is always valid
+          bool locked = exclusive ? node->lock.try_lock() : node->lock.try_lock_shared();
+          if (!locked) {
+            retry = true;
+            break;
+          }
+          std::atomic_thread_fence(std::memory_order_acquire);
+          if (seg.seq.load(std::memory_order_relaxed) != seq) {
+            unlock_node(node, exclusive);
+            retry = true;
+            break;
+          }
+          // Still in the segment and now locked, the key can be read
+          if (m_hash_compare.equal(node->value()->first, key)) {
+            return node;
+          }
+          unlock_node(node, exclusive);
+        }
+        if (retry || (ctrl >> kOverflowShift) == 0) {
+          break;
+        }
+        g = (g + 1) & table->mask;
+      }
+      if (!retry) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seg.seq.load(std::memory_order_relaxed) == seq) {
+          return nullptr;
+        }
+      }
+      NodeRWLock::Backoff(spins);
+    }
+  }
+
+  static void unlock_node(Node* node, bool exclusive) {
+    if (exclusive) {
+      node->lock.unlock();
+    } else {
+      node->lock.unlock_shared();
+    }
+  }
+
+  /**
+   * The node of key, the caller must lock the segment mutex
+   */
+  Node* locate(Segment& seg, const TKey& key, size_t h) const {
+    const Table& table = *seg.current;
+    uint8_t tag = tag_of(h);
+    size_t g = h & table.mask;
+    for (size_t probes = 0; probes <= table.mask; probes++) {
+      const Group& group = table.groups[g];
+      uint64_t ctrl = group.ctrl.load(std::memory_order_relaxed);
+      for (uint64_t bits = match(ctrl, tag); bits != 0; bits &= bits - 1) {
+        Node* node = group.nodes[__builtin_ctzll(bits) / 8].load(std::memory_order_relaxed);
+        if (node != nullptr && node->hash.load(std::memory_order_relaxed) == h &&
+            m_hash_compare.equal(node->value()->first, key)) {
+          return node;
+        }
+      }
+      if ((ctrl >> kOverflowShift) == 0) {
+        break;
+      }
+      g = (g + 1) & table.mask;
+    }
+    return nullptr;
+  }
+
+  /**
+   * Put node in the first free slot of its probe sequence
+   */
+  static void place(Table& table, Node* node, size_t h) {
+    size_t g = h & table.mask;
+    while (true) {
+      Group& group = table.groups[g];
+      uint64_t ctrl = group.ctrl.load(std::memory_order_relaxed);
+      for (int slot = 0; slot < kGroupSlots; slot++) {
+        if (ctrl_byte(ctrl, slot) == 0) {
+          group.nodes[slot].store(node, std::memory_order_relaxed);
+          group.ctrl.store(ctrl | (static_cast<uint64_t>(tag_of(h)) << (slot * 8)), std::memory_order_relaxed);
+          return;
+        }
+      }
+      if ((ctrl >> kOverflowShift) != kMaxOverflow) {
+        group.ctrl.store(ctrl + (static_cast<uint64_t>(1) << kOverflowShift), std::memory_order_relaxed);
+      }
+      g = (g + 1) & table.mask;
+    }
+  }
+
+  /**
+   * Remove node from its slot and the overflow counts of the groups before it
+   */
+  static void unplace(Table& table, Node* node, size_t h) {
+    size_t home = h & table.mask;
+    size_t g = home;
+    while (true) {
+      Group& group = table.groups[g];
+      for (int slot = 0; slot < kGroupSlots; slot++) {
+        if (group.nodes[slot].load(std::memory_order_relaxed) == node) {
+          group.nodes[slot].store(nullptr, std::memory_order_relaxed);
+          uint64_t ctrl = group.ctrl.load(std::memory_order_relaxed);
+          group.ctrl.store(ctrl & ~(static_cast<uint64_t>(0xff) << (slot * 8)), std::memory_order_relaxed);
+          for (size_t i = home; i != g; i = (i + 1) & table.mask) {
+            Group& passed = table.groups[i];
+            uint64_t passed_ctrl = passed.ctrl.load(std::memory_order_relaxed);
+            // A saturated count is never decremented
+            if ((passed_ctrl >> kOverflowShift) != kMaxOverflow) {
+              passed.ctrl.store(passed_ctrl - (static_cast<uint64_t>(1) << kOverflowShift),
+                                std::memory_order_relaxed);
+            }
+          }
+          return;
+        }
+      }
+      g = (g + 1) & table.mask;
+    }
+  }
+
+  /**
+   * Double the segment table, the caller must lock the segment mutex. The old
+   * table stays readable for concurrent lookups until free_retired.
+   */
+  void grow(Segment& seg) {
+    Table& old_table = *seg.current;
+    std::unique_ptr<Table> table(new Table((old_table.mask + 1) * 2));
+    for (size_t g = 0; g <= old_table.mask; g++) {
+      for (auto& slot : old_table.groups[g].nodes) {
+        Node* node = slot.load(std::memory_order_relaxed);
+        if (node != nullptr) {
+          place(*table, node, node->hash.load(std::memory_order_relaxed));
+        }
+      }
+    }
+    begin_write(seg);
+    seg.table.store(table.get(), std::memory_order_relaxed);
+    end_write(seg);
+    seg.retired.push_back(RetiredTable{EpochManager::instance().retire_epoch(), std::move(seg.current)});
+    seg.has_retired.store(true, std::memory_order_relaxed);
+    seg.current = std::move(table);
+  }
+
+  /**
+   * Free the replaced tables of the segment no lookup can see anymore, the
+   * caller must lock the segment mutex. Cheap while there are none, which is
+   * all but a few writes after a grow.
+   */
+  static void free_retired(Segment& seg) {
+    while (!seg.retired.empty() && EpochManager::instance().reclaimable(seg.retired.front().epoch)) {
+      seg.retired.erase(seg.retired.begin());
+    }
+    seg.has_retired.store(!seg.retired.empty(), std::memory_order_relaxed);
+  }
+
+  /**
+   * free_retired from a lookup outside its EpochGuard, so a segment which
+   * only gets reads after a grow releases the old table too. Skipped while a
+   * writer holds the segment, the writer frees it.
+   */
+  static void help_free_retired(Segment& seg) {
+    if (!seg.has_retired.load(std::memory_order_relaxed)) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(seg.mutex, std::try_to_lock);
+    if (lock.owns_lock()) {
+      free_retired(seg);
+    }
+  }
+
+  void free_node(Node* node) {
+    node->value()->~value_type();
+    m_pool.free(node);
+  }
+
+  THash m_hash_compare;
+  NodePool m_pool;
+  Segment m_segments[kSegmentNum];
+  std::atomic<size_t> m_size{0};
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
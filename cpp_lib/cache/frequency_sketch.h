@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+namespace cpp_lib {
+
+namespace cache {
+
+/**
+ * A count-min sketch of 4-bit counters used as the TinyLFU popularity
+ * estimator. Each key maps to one counter in each of 4 rows, the estimate is
+ * the minimum of them. Counters are packed 16 per 64-bit word and updated
+ * with CAS, so increments from concurrent readers need no lock.
+ *
+ * After sample_size increments every counter is halved (aging), so the sketch
+ * tracks recent popularity instead of all-time popularity.
+ */
+class FrequencySketch {
+ public:
+  static constexpr int kRows = 4;
+  static constexpr uint64_t kMaxCount = 15;
+
+  explicit FrequencySketch(size_t capacity) {
+    size_t words = 8;
+    while (words < capacity && words < (static_cast<size_t>(1) << 30)) {
+      words <<= 1;
+    }
+    m_mask = words - 1;
+    m_table.reset(new std::atomic<uint64_t>[words]);
+    for (size_t i = 0; i < words; i++) {
+      m_table[i].store(0, std::memory_order_relaxed);
+    }
+    m_sample_size = (capacity == 0 ? 1 : capacity) * 10;
+  }
+
+  FrequencySketch(const FrequencySketch&) = delete;
+  FrequencySketch& operator=(const FrequencySketch&) = delete;
+
+  /**
+   * Record one access of the key with the given hash
+   */
+  void increment(size_t hash) {
+    bool added = false;
+    for (int i = 0; i < kRows; i++) {
+      size_t h = row_hash(hash, i);
+      std::atomic<uint64_t>& word = m_table[h & m_mask];
+      int shift = static_cast<int>((h >> 60) << 2);
+      uint64_t old_word = word.load(std::memory_order_relaxed);
+      while (((old_word >> shift) & kMaxCount) != kMaxCount) {
+        if (word.compare_exchange_weak(old_word, old_word + (static_cast<uint64_t>(1) << shift),
+                                       std::memory_order_relaxed)) {
+          added = true;
+          break;
+        }
+      }
+    }
+    if (added && m_additions.fetch_add(1, std::memory_order_relaxed) + 1 >= m_sample_size) {
+      reset();
+    }
+  }
+
+  /**
+   * Estimated access count of the key with the given hash, at most kMaxCount
+   */
+  uint32_t frequency(size_t hash) const {
+    uint64_t freq = kMaxCount;
+    for (int i = 0; i < kRows; i++) {
+      size_t h = row_hash(hash, i);
+      int shift = static_cast<int>((h >> 60) << 2);
+      uint64_t count = (m_table[h & m_mask].load(std::memory_order_relaxed) >> shift) & kMaxCount;
+      if (count < freq) {
+        freq = count;
+      }
+    }
+    return static_cast<uint32_t>(freq);
+  }
+
+ private:
+  static size_t row_hash(size_t hash, int row) {
+    static constexpr uint64_t kSeeds[kRows] = {0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL,
+                                               0xcbf29ce484222325ULL};
+    uint64_t h = (static_cast<uint64_t>(hash) + kSeeds[row]) * 0x9e3779b97f4a7c15ULL;
+    return static_cast<size_t>(h ^ (h >> 32));
+  }
+
+  /**
+   * Halve every counter. Only one thread ages the table, the others keep
+   * counting meanwhile.
+   */
+  void reset() {
+    std::unique_lock<std::mutex> lock(m_reset_mutex, std::try_to_lock);
+    if (!lock.owns_lock() || m_additions.load(std::memory_order_relaxed) < m_sample_size) {
+      return;
+    }
+    for (size_t i = 0; i <= m_mask; i++) {
+      uint64_t old_word = m_table[i].load(std::memory_order_relaxed);
+      while (!m_table[i].compare_exchange_weak(old_word, (old_word >> 1) & 0x7777777777777777ULL,
+                                               std::memory_order_relaxed)) {
+      }
+    }
+    m_additions.store(m_additions.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+  }
+
+  std::unique_ptr<std::atomic<uint64_t>[]> m_table;
+  size_t m_mask;
+  size_t m_sample_size;
+  std::atomic<size_t> m_additions{0};
+  std::mutex m_reset_mutex;
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace cpp_lib {
+
+namespace cache {
+
+// The tag of items which only clear() invalidates
+static constexpr uint64_t kNoTag = 0;
+
+/**
+ * Generation counters for O(1) invalidation, shared by the shards of a
+ * cache. An item records the generation at its insert and is invalid once
+ * clear() or an invalidation of its tag happened after it; lookups treat
+ * invalid items as misses and ConcurrentLRUCache::purge_invalidated removes
+ * them later.
+ *
+ * Tags are hashed to kTagSlots counters, invalidating a tag may also
+ * invalidate the items of another tag in the same slot. They are only missed
+ * once more, which is harmless for a cache.
+ */
+class GenerationTable {
+ public:
+  static constexpr int kTagSlotBits = 12;
+  static constexpr size_t kTagSlots = 1UL << kTagSlotBits;
+
+  /**
+   * The generation to record for an item inserted now. It is the generation
+   * of the last invalidation, which only invalidates older items.
+   */
+  uint64_t current() const { return m_counter.load(std::memory_order_acquire); }
+
+  /**
+   * Whether an item inserted at generation with tag was invalidated since
+   */
+  bool is_valid(uint64_t generation, uint64_t tag) const {
+    return generation >= m_cleared.load(std::memory_order_acquire) &&
+           (tag == kNoTag || generation >= m_slots[slot(tag)].load(std::memory_order_acquire));
+  }
+
+  /**
+   * Invalidate the items of tag, returns the new generation
+   */
+  uint64_t invalidate_tag(uint64_t tag) { return bump(m_slots[slot(tag)]); }
+
+  /**
+   * Invalidate every item, returns the new generation
+   */
+  uint64_t invalidate_all() { return bump(m_cleared); }
+
+ private:
+  static size_t slot(uint64_t tag) { return (tag * 0x9E3779B97F4A7C15ULL) >> (64 - kTagSlotBits); }
+
+  uint64_t bump(std::atomic<uint64_t>& limit) {
+    // The items inserted before the increment are older than the new limit
+    uint64_t generation = m_counter.fetch_add(1, std::memory_order_acq_rel) + 1;
+    uint64_t old_limit = limit.load(std::memory_order_relaxed);
+    while (old_limit < generation && !limit.compare_exchange_weak(old_limit, generation)) {
+    }
+    return generation;
+  }
+
+  std::atomic<uint64_t> m_counter{1};
+  std::atomic<uint64_t> m_cleared{0};
+  std::atomic<uint64_t> m_slots[kTagSlots] = {};
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
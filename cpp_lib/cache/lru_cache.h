@@ -1,20 +1,78 @@
 #pragma once
 
 #include <shared_mutex>
+#include <type_traits>
 
+#include "cpp_lib/cache/access_trace.h"
+#include "cpp_lib/cache/cache_snapshot.h"
 #include "cpp_lib/cache/concurrent_scalable_cache.h"
+#include "cpp_lib/cache/mmap_tier.h"
+#include "cpp_lib/cache/single_flight.h"
 
 namespace cpp_lib {
 
+namespace cache {
 /**
- * To avoid unnecessary value copy, TValue can be instantiated with std::shared_ptr<type>
+ * Options of LRUCache::get_or_load and mget_or_load
  */
-template <class TKey, class TValue, class TMutex = std::shared_mutex, class THash = tbb::tbb_hash_compare<TKey>>
+struct LoadOptions {
+  // TTL of the loaded values, see LRUCache::set
+  int64_t ttl_ms = kTtlDefault;
+  // get_or_load reloads a hit value in a coro when it expires within this
+  // many milliseconds and returns the current one, 0 disables it. Stale
+  // values are always reloaded this way, see CacheOptions::stale_ms.
+  int64_t refresh_ahead_ms = 0;
+  // Tag of the loaded values and of the negative items of the keys not
+  // found, see LRUCache::invalidate_tag
+  uint64_t tag = kNoTag;
+};
+}  // namespace cache
+
+/**
+ * get and mget copy the values out. To avoid the copy of large values use
+ * get_ref and mget_ref, which return refcounted handles of the stored values.
+ *
+ * get_or_load and mget_or_load read through to a loader on misses. Concurrent
+ * misses of the same key wait for one load instead of all hitting the
+ * backend. With CacheOptions::stale_ms they return stale values while
+ * reloading them in the background, and with negative_ttl_ms keys the loader
+ * didn't find are remembered, so a slow backend isn't hit harder.
+ *
+ * save_snapshot and load_snapshot persist the items across restarts.
+ *
+ * With CacheOptions::epoch_reads, get_raw reads without taking any lock, the
+ * values it returns are freed only after the readers' epochs end, see
+ * cache::EpochManager.
+ *
+ * With a second tier, see set_tier and enable_mmap_tier, the values evicted
+ * for capacity are spilled to it, and the gets promote them back into memory
+ * on misses. The sets remove the key from the tier.
+ *
+ * Items set with a tag, e.g. a tenant or a data version, are invalidated
+ * together by invalidate_tag in O(1) and removed in the background; clear()
+ * is thread safe the same way. Tagged values are not spilled to the tier,
+ * which can't invalidate them.
+ *
+ * start_trace samples the gets and sets into a file which cache_sim replays
+ * against other sizes and policies, see cpp_lib/cache/tools.
+ * estimate_hit_ratio answers the same question for other sizes online, from
+ * the keys sampled with CacheOptions::mrc_sample_rate.
+ */
+template <class TKey, class TValue, class TMutex = std::shared_mutex, class THash = tbb::tbb_hash_compare<TKey>,
+          class TBackend = cache::TbbMapBackend>
 class LRUCache {
  public:
+  using Cache = ConcurrentScalableCache<TKey, TValue, TMutex, THash, TBackend>;
+  // Refcounted read-only handle of a cached value, it keeps the value alive after eviction
+  typedef typename Cache::ValueRef ValueRef;
+  // Weight of an item counted against CacheOptions::max_weight, e.g. its size in bytes
+  typedef typename Cache::Weigher Weigher;
+
   explicit LRUCache(size_t max_size, uint32_t timeout = 0, size_t num_shards = 0,
                     cache::CacheEvictType evict_type = cache::kEvictOne);
 
+  explicit LRUCache(const cache::CacheOptions& options, const Weigher& weigher = Weigher());
+
   LRUCache(const LRUCache&) = delete;
   LRUCache& operator=(const LRUCache&) = delete;
 
@@ -30,72 +88,616 @@ class LRUCache {
   // Batch get. Missing keys and hit values will be set.
   void mget(const std::vector<TKey>& keys, std::unordered_map<TKey, TValue>& values, std::vector<TKey>& not_find_keys);
 
+  // If hit, the handle of the value will be returned without copying it. Otherwise, nullptr will be returned.
+  ValueRef get_ref(const TKey& key);
+
+  // Batch get_ref. Missing keys and handles of hit values will be set.
+  void mget_ref(const std::vector<TKey>& keys, std::unordered_map<TKey, ValueRef>& values,
+                std::vector<TKey>& not_find_keys);
+
+  // Lock-free get of a pointer to the value, nullptr on a miss. Needs CacheOptions::epoch_reads, and the
+  // calling thread must hold a cache::EpochGuard while it uses the value. The tier is not read.
+  const TValue* get_raw(const TKey& key) {
+    const TValue* value = m_cache_->find_raw(key);
+    trace(key, cache::kTraceGet, value != nullptr);
+    return value;
+  }
+
+  // Get a fresh, stale or negative value, see cache::LookupResult. value is set for kLookupHit and kLookupStale.
+  cache::LookupResult lookup(const TKey& key, TValue& value);
+
+  // Read-through get. On a miss loader(key, value) is called, it returns false if the key doesn't exist.
+  // Only one caller per key loads at a time, the others wait for its result. Loaded values are set, keys
+  // not found are set negative if negative caching is enabled. Stale values are returned and reloaded
+  // asynchronously, a failed or throwing reload keeps the stale value until its stale window ends. The
+  // reload runs in a coro which outlives the call with a copy of loader, so loader must not capture
+  // references to the caller's locals.
+  template <class Loader>
+  bool get_or_load(const TKey& key, TValue& value, const Loader& loader,
+                   const cache::LoadOptions& options = cache::LoadOptions());
+
+  // Batch get_or_load. loader(missing_keys, loaded_values) is called once with the missing keys which
+  // are not in flight and fills the found ones, it returns false if the whole load failed. Keys which
+  // are neither hit nor loaded will be set to not_find_keys. Stale values are reloaded like in
+  // get_or_load, with a copy of loader.
+  template <class BatchLoader>
+  void mget_or_load(const std::vector<TKey>& keys, std::unordered_map<TKey, TValue>& values,
+                    std::vector<TKey>& not_find_keys, const BatchLoader& loader,
+                    const cache::LoadOptions& options = cache::LoadOptions());
+
   // If seting pair successfully, true will be returned. Otherwise, false will be returned.
-  bool set(const TKey& key, const TValue& value);
+  // ttl_ms is the time to live of the key in milliseconds, 0 means never expired and
+  // cache::kTtlDefault the timeout of the cache.
+  // invalidate_tag(tag) invalidates the key.
+  bool set(const TKey& key, const TValue& value, int64_t ttl_ms = cache::kTtlDefault, uint64_t tag = cache::kNoTag);
 
-  void mset(const std::unordered_map<TKey, TValue>& data);
+  void mset(const std::unordered_map<TKey, TValue>& data, int64_t ttl_ms = cache::kTtlDefault,
+            uint64_t tag = cache::kNoTag);
+
+  // Remember that key doesn't exist, see CacheOptions::negative_ttl_ms. False if negative caching is disabled.
+  bool set_negative(const TKey& key, int64_t ttl_ms = cache::kTtlDefault, uint64_t tag = cache::kNoTag);
+
+  // Drop every key set with tag in O(1). They are missed at once and removed in the background.
+  void invalidate_tag(uint64_t tag) { m_cache_->invalidate_tag(tag); }
+
+  // Drop every key, and empty the tier. Thread safe, keys set meanwhile may be kept.
+  void clear();
 
   size_t size() { return m_cache_->size(); }
 
+  // Total weight of the items, equal to size() without a weigher
+  size_t weighted_size() { return m_cache_->weighted_size(); }
+
+  // Allocation counters of the cache's slab arenas
+  cache::AllocStats alloc_stats() { return m_cache_->alloc_stats(); }
+
+  // Hit, miss and eviction counters and the limits of every shard
+  std::vector<cache::ShardStats> shard_stats() { return m_cache_->shard_stats(); }
+
+  // The counters and latency histograms of the whole cache, see cache::ShardStats. The histograms need
+  // CacheOptions::record_latency.
+  cache::ShardStats stats() { return m_cache_->stats(); }
+
+  // Pass stats() to sink every interval_ms from a thread, or print ShardStats::to_string to stderr
+  // without a sink. Replaces a running dump. NOT THREAD SAFE with itself and stop_stats_dump.
+  void start_stats_dump(uint32_t interval_ms, const cache::StatsDumper::SinkFunc& sink = nullptr);
+
+  void stop_stats_dump() { m_stats_dumper_.reset(); }
+
+  // Sample the gets and sets of a share of the keys into a trace file at path, see cache::AccessTrace.
+  // Replaces a running trace, returns false if the file can't be written.
+  bool start_trace(const std::string& path, const cache::TraceOptions& options = cache::TraceOptions()) {
+    return m_trace_.start(path, options);
+  }
+
+  // Flush and close the trace, returns false if a write failed
+  bool stop_trace() { return m_trace_.stop(); }
+
+  // Estimated hit ratio at size items from the online miss ratio curve, false unless the options set
+  // mrc_sample_rate. See ConcurrentScalableCache::estimate_hit_ratio.
+  bool estimate_hit_ratio(size_t size, double& hit_ratio) const {
+    return m_cache_->estimate_hit_ratio(size, hit_ratio);
+  }
+
+  // Restart the miss ratio curve
+  void reset_mrc() { m_cache_->reset_mrc(); }
+
+  // Write the items with their expire times and recency order to path while the cache is in use, see
+  // cache::CacheSnapshot. Other key and value types than trivially copyable ones and std::string need codecs.
+  template <class KeyCodec = cache::SnapshotCodec<TKey>, class ValueCodec = cache::SnapshotCodec<TValue>>
+  bool save_snapshot(const std::string& path) {
+    return cache::CacheSnapshot<Cache, KeyCodec, ValueCodec>::save(*m_cache_, path);
+  }
+
+  // Restore a snapshot written by save_snapshot with the same codecs, typically before serving.
+  // item_num is set to the number of restored items if not null.
+  template <class KeyCodec = cache::SnapshotCodec<TKey>, class ValueCodec = cache::SnapshotCodec<TValue>>
+  bool load_snapshot(const std::string& path, size_t* item_num = nullptr) {
+    return cache::CacheSnapshot<Cache, KeyCodec, ValueCodec>::load(*m_cache_, path, item_num);
+  }
+
+  // Spill the values evicted for capacity to tier and promote them back on misses, see cache::CacheTier.
+  // NOT THREAD SAFE -- set it before the cache is used. Tiers decode into a default-constructed value.
+  void set_tier(const std::shared_ptr<cache::CacheTier<TKey, TValue>>& tier);
+
+  // set_tier with a cache::MMapTier, for values larger than the memory budget. Returns false if its
+  // segment file can't be created. Other types than the ones of cache::SnapshotCodec need codecs.
+  template <class KeyCodec = cache::SnapshotCodec<TKey>, class ValueCodec = cache::SnapshotCodec<TValue>>
+  bool enable_mmap_tier(const cache::MMapTierOptions& options) {
+    auto tier = std::make_shared<cache::MMapTier<TKey, TValue, THash, KeyCodec, ValueCodec>>();
+    if (!tier->open(options)) {
+      return false;
+    }
+    set_tier(tier);
+    return true;
+  }
+
  private:
-  using Cache = ConcurrentScalableCache<TKey, TValue, TMutex, THash>;
   typedef typename Cache::ConstAccessor ConstAccessor;
+  typedef cache::SingleFlight<TKey, TValue, THash> Flights;
+
+  // Start a coro reloading key unless it is in flight
+  template <class Loader>
+  void refresh_async(const TKey& key, const Loader& loader, const cache::LoadOptions& options);
+
+  // Start a coro reloading the keys which are not in flight with one batch load
+  template <class BatchLoader>
+  void refresh_batch_async(const std::vector<TKey>& keys, const BatchLoader& loader,
+                           const cache::LoadOptions& options);
+
+  // Move key from the second tier into memory, nullptr if it isn't there
+  ValueRef promote(const TKey& key);
+
+  void erase_from_tier(const TKey& key) {
+    if (m_tier_ != nullptr) {
+      m_tier_->erase(key);
+    }
+  }
+
+  void trace(const TKey& key, cache::TraceOp op, bool hit = false) {
+    if (m_trace_.active()) {
+      m_trace_.record(THash().hash(key), op, hit);
+    }
+  }
+
   std::shared_ptr<Cache> m_cache_ = nullptr;
+  std::shared_ptr<cache::CacheTier<TKey, TValue>> m_tier_ = nullptr;
+  // Declared after the cache so it stops first
+  std::unique_ptr<cache::StatsDumper> m_stats_dumper_ = nullptr;
+  // Loads in flight, shared with the refresh coros
+  std::shared_ptr<Flights> m_flights_ = std::make_shared<Flights>();
+  cache::AccessTrace m_trace_;
 };
 
-template <class TKey, class TValue, class TMutex, class THash>
-LRUCache<TKey, TValue, TMutex, THash>::LRUCache(size_t max_size, uint32_t timeout, size_t num_shards,
-                                                cache::CacheEvictType evict_type) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+LRUCache<TKey, TValue, TMutex, THash, TBackend>::LRUCache(size_t max_size, uint32_t timeout, size_t num_shards,
+                                                          cache::CacheEvictType evict_type) {
   m_cache_ = std::make_shared<Cache>(max_size, timeout, num_shards, evict_type);
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-bool LRUCache<TKey, TValue, TMutex, THash>::get(const TKey& key) {
-  ConstAccessor ac;
-  return m_cache_->find(ac, key);
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+LRUCache<TKey, TValue, TMutex, THash, TBackend>::LRUCache(const cache::CacheOptions& options,
+                                                          const Weigher& weigher) {
+  m_cache_ = std::make_shared<Cache>(options, weigher);
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-bool LRUCache<TKey, TValue, TMutex, THash>::get(const TKey& key, TValue& value) {
-  ConstAccessor ac;
-  bool flag = m_cache_->find(ac, key);
-  if (flag) {
-    value = ac.get_value();
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool LRUCache<TKey, TValue, TMutex, THash, TBackend>::get(const TKey& key) {
+  bool hit = false;
+  {
+    ConstAccessor ac;
+    hit = m_cache_->find(ac, key);
   }
-  return flag;
+  // promote inserts, the accessor must be released before
+  hit = hit || promote(key) != nullptr;
+  trace(key, cache::kTraceGet, hit);
+  return hit;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool LRUCache<TKey, TValue, TMutex, THash, TBackend>::get(const TKey& key, TValue& value) {
+  {
+    ConstAccessor ac;
+    if (m_cache_->find(ac, key)) {
+      value = ac.get_value();
+      trace(key, cache::kTraceGet, true);
+      return true;
+    }
+  }
+  ValueRef ref = promote(key);
+  trace(key, cache::kTraceGet, ref != nullptr);
+  if (ref == nullptr) {
+    return false;
+  }
+  value = *ref;
+  return true;
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-void LRUCache<TKey, TValue, TMutex, THash>::mget(const std::vector<TKey>& keys, std::vector<TKey>& not_find_keys) {
-  for (const auto& key : keys) {
-    if (!get(key)) {
-      not_find_keys.push_back(key);
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void LRUCache<TKey, TValue, TMutex, THash, TBackend>::mget(const std::vector<TKey>& keys,
+                                                           std::vector<TKey>& not_find_keys) {
+  // Shards of a parallel batch write distinct elements
+  std::vector<char> found(keys.size(), 0);
+  m_cache_->find_batch(keys, [&found](size_t i, const ConstAccessor&) { found[i] = 1; });
+  for (size_t i = 0; i < keys.size(); i++) {
+    bool hit = found[i] || promote(keys[i]) != nullptr;
+    trace(keys[i], cache::kTraceGet, hit);
+    if (!hit) {
+      not_find_keys.push_back(keys[i]);
+    }
+  }
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void LRUCache<TKey, TValue, TMutex, THash, TBackend>::mget(const std::vector<TKey>& keys,
+                                                           std::unordered_map<TKey, TValue>& values,
+                                                           std::vector<TKey>& not_find_keys) {
+  // Handles are taken under the bucket lock into their key's slot, the
+  // values are copied once after it
+  std::vector<ValueRef> refs(keys.size());
+  m_cache_->find_batch(keys, [&refs](size_t i, const ConstAccessor& ac) { refs[i] = ac.get_value_ref(); });
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (refs[i] != nullptr) {
+      values.emplace(keys[i], *refs[i]);
+    } else if (ValueRef ref = promote(keys[i])) {
+      values.emplace(keys[i], *ref);
+    } else {
+      not_find_keys.push_back(keys[i]);
+      trace(keys[i], cache::kTraceGet, false);
+      continue;
     }
+    trace(keys[i], cache::kTraceGet, true);
   }
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-void LRUCache<TKey, TValue, TMutex, THash>::mget(const std::vector<TKey>& keys,
-                                                 std::unordered_map<TKey, TValue>& values,
-                                                 std::vector<TKey>& not_find_keys) {
-  for (const auto& key : keys) {
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+typename LRUCache<TKey, TValue, TMutex, THash, TBackend>::ValueRef
+LRUCache<TKey, TValue, TMutex, THash, TBackend>::get_ref(const TKey& key) {
+  {
     ConstAccessor ac;
     if (m_cache_->find(ac, key)) {
+      trace(key, cache::kTraceGet, true);
+      return ac.get_value_ref();
+    }
+  }
+  ValueRef ref = promote(key);
+  trace(key, cache::kTraceGet, ref != nullptr);
+  return ref;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void LRUCache<TKey, TValue, TMutex, THash, TBackend>::mget_ref(const std::vector<TKey>& keys,
+                                                               std::unordered_map<TKey, ValueRef>& values,
+                                                               std::vector<TKey>& not_find_keys) {
+  std::vector<ValueRef> refs(keys.size());
+  m_cache_->find_batch(keys, [&refs](size_t i, const ConstAccessor& ac) { refs[i] = ac.get_value_ref(); });
+  for (size_t i = 0; i < keys.size(); i++) {
+    bool hit = refs[i] || (refs[i] = promote(keys[i]));
+    trace(keys[i], cache::kTraceGet, hit);
+    if (hit) {
+      values.insert(std::make_pair(keys[i], std::move(refs[i])));
+    } else {
+      not_find_keys.push_back(keys[i]);
+    }
+  }
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+template <class Loader>
+bool LRUCache<TKey, TValue, TMutex, THash, TBackend>::get_or_load(const TKey& key, TValue& value,
+                                                                  const Loader& loader,
+                                                                  const cache::LoadOptions& options) {
+  bool hit = false;
+  bool refresh = false;
+  {
+    ConstAccessor ac;
+    cache::LookupResult result = m_cache_->lookup(ac, key);
+    // A value promoted from the tier below is traced as a miss
+    trace(key, cache::kTraceGet, result != cache::kLookupMiss);
+    if (result == cache::kLookupNegative) {
+      return false;
+    }
+    if (result == cache::kLookupHit) {
+      hit = true;
+      value = ac.get_value();
+      int64_t expire_time = ac.get_expire_time_ms();
+      refresh = options.refresh_ahead_ms > 0 && expire_time != 0 &&
+                expire_time - GetCoarseTimeMillis() <= options.refresh_ahead_ms;
+    } else if (result == cache::kLookupStale) {
+      hit = true;
+      refresh = true;
+      value = ac.get_value();
+    }
+  }
+  if (hit) {
+    // Reload after releasing the accessor
+    if (refresh) {
+      refresh_async(key, loader, options);
+    }
+    return true;
+  }
+  return m_flights_->run(key, value, [this, &key, &loader, &options](TValue& loaded) {
+    // The previous leader may have set it after our miss, which is already counted
+    {
+      ConstAccessor ac;
+      if (m_cache_->peek(ac, key) == cache::kLookupHit) {
+        loaded = ac.get_value();
+        return true;
+      }
+    }
+    if (ValueRef ref = promote(key)) {
+      loaded = *ref;
+      return true;
+    }
+    if (!loader(key, loaded)) {
+      m_cache_->insert_negative(key, cache::kTtlDefault, options.tag);
+      return false;
+    }
+    m_cache_->insert(key, loaded, options.ttl_ms, options.tag);
+    return true;
+  });
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+template <class BatchLoader>
+void LRUCache<TKey, TValue, TMutex, THash, TBackend>::mget_or_load(const std::vector<TKey>& keys,
+                                                                   std::unordered_map<TKey, TValue>& values,
+                                                                   std::vector<TKey>& not_find_keys,
+                                                                   const BatchLoader& loader,
+                                                                   const cache::LoadOptions& options) {
+  std::vector<TKey> missing_keys;
+  mget(keys, values, missing_keys);
+  if (missing_keys.empty()) {
+    return;
+  }
+  // Lead the flights of the keys nobody loads, wait for the others
+  std::vector<TKey> led_keys;
+  std::vector<typename Flights::FlightPtr> led_flights;
+  std::vector<std::pair<const TKey*, typename Flights::FlightPtr>> waiting;
+  std::vector<TKey> stale_keys;
+  for (const TKey& key : missing_keys) {
+    {
+      // Serve stale and negative items without loading, mget counted the read
+      ConstAccessor ac;
+      cache::LookupResult result = m_cache_->peek(ac, key);
+      if (result == cache::kLookupStale) {
+        values.insert(std::make_pair(key, ac.get_value()));
+        stale_keys.push_back(key);
+        continue;
+      }
+      if (result == cache::kLookupNegative) {
+        not_find_keys.push_back(key);
+        continue;
+      }
+    }
+    typename Flights::FlightPtr flight;
+    if (!m_flights_->join(key, flight)) {
+      waiting.emplace_back(&key, flight);
+      continue;
+    }
+    // The previous leader may have set it after our miss
+    ConstAccessor ac;
+    if (m_cache_->peek(ac, key) == cache::kLookupHit) {
+      m_flights_->finish(key, flight, true, &ac.get_value());
       values.insert(std::make_pair(key, ac.get_value()));
+      continue;
+    }
+    led_keys.push_back(key);
+    led_flights.push_back(flight);
+  }
+
+  if (!led_keys.empty()) {
+    std::unordered_map<TKey, TValue> loaded;
+    bool ok = false;
+    try {
+      ok = loader(static_cast<const std::vector<TKey>&>(led_keys), loaded);
+    } catch (...) {
+      for (size_t i = 0; i < led_keys.size(); i++) {
+        m_flights_->finish(led_keys[i], led_flights[i], false, nullptr);
+      }
+      throw;
+    }
+    if (ok && !loaded.empty()) {
+      m_cache_->insert(loaded, options.ttl_ms, options.tag);
+    }
+    for (size_t i = 0; i < led_keys.size(); i++) {
+      auto iter = ok ? loaded.find(led_keys[i]) : loaded.end();
+      if (iter == loaded.end()) {
+        if (ok) {
+          m_cache_->insert_negative(led_keys[i], cache::kTtlDefault, options.tag);
+        }
+        m_flights_->finish(led_keys[i], led_flights[i], false, nullptr);
+        not_find_keys.push_back(led_keys[i]);
+        continue;
+      }
+      m_flights_->finish(led_keys[i], led_flights[i], true, &iter->second);
+      values.insert(std::make_pair(led_keys[i], std::move(iter->second)));
+    }
+  }
+
+  for (auto& wait_pair : waiting) {
+    TValue value;
+    if (Flights::wait(wait_pair.second, value)) {
+      values.insert(std::make_pair(*wait_pair.first, std::move(value)));
     } else {
-      not_find_keys.push_back(key);
+      not_find_keys.push_back(*wait_pair.first);
+    }
+  }
+
+  if (!stale_keys.empty()) {
+    refresh_batch_async(stale_keys, loader, options);
+  }
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+template <class Loader>
+void LRUCache<TKey, TValue, TMutex, THash, TBackend>::refresh_async(const TKey& key, const Loader& loader,
+                                                                    const cache::LoadOptions& options) {
+  typename Flights::FlightPtr flight;
+  if (!m_flights_->join(key, flight)) {
+    // Already loading
+    return;
+  }
+  std::shared_ptr<Cache> cache = m_cache_;
+  std::shared_ptr<Flights> flights = m_flights_;
+  int64_t ttl_ms = options.ttl_ms;
+  uint64_t tag = options.tag;
+  // The coro owns copies of everything, the LRUCache may be gone when it runs
+  StartCoroFunc([cache, flights, flight, key, loader, ttl_ms, tag]() {
+    TValue value;
+    bool ok = false;
+    try {
+      ok = loader(key, value);
+    } catch (...) {
+      // Nobody to rethrow to, fail the flight and keep the stale value
+      flights->finish(key, flight, false, nullptr);
+      return;
+    }
+    if (ok) {
+      cache->insert(key, value, ttl_ms, tag);
+    }
+    flights->finish(key, flight, ok, &value);
+  });
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+template <class BatchLoader>
+void LRUCache<TKey, TValue, TMutex, THash, TBackend>::refresh_batch_async(const std::vector<TKey>& keys,
+                                                                          const BatchLoader& loader,
+                                                                          const cache::LoadOptions& options) {
+  std::vector<TKey> led_keys;
+  std::vector<typename Flights::FlightPtr> led_flights;
+  for (const TKey& key : keys) {
+    typename Flights::FlightPtr flight;
+    if (m_flights_->join(key, flight)) {
+      led_keys.push_back(key);
+      led_flights.push_back(flight);
+    }
+  }
+  if (led_keys.empty()) {
+    return;
+  }
+  std::shared_ptr<Cache> cache = m_cache_;
+  std::shared_ptr<Flights> flights = m_flights_;
+  int64_t ttl_ms = options.ttl_ms;
+  uint64_t tag = options.tag;
+  StartCoroFunc([cache, flights, led_keys, led_flights, loader, ttl_ms, tag]() {
+    std::unordered_map<TKey, TValue> loaded;
+    bool ok = false;
+    try {
+      ok = loader(led_keys, loaded);
+    } catch (...) {
+      loaded.clear();
+    }
+    if (ok && !loaded.empty()) {
+      cache->insert(loaded, ttl_ms, tag);
     }
+    for (size_t i = 0; i < led_keys.size(); i++) {
+      auto iter = ok ? loaded.find(led_keys[i]) : loaded.end();
+      if (iter == loaded.end()) {
+        flights->finish(led_keys[i], led_flights[i], false, nullptr);
+      } else {
+        flights->finish(led_keys[i], led_flights[i], true, &iter->second);
+      }
+    }
+  });
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+cache::LookupResult LRUCache<TKey, TValue, TMutex, THash, TBackend>::lookup(const TKey& key, TValue& value) {
+  {
+    ConstAccessor ac;
+    cache::LookupResult result = m_cache_->lookup(ac, key);
+    if (result == cache::kLookupHit || result == cache::kLookupStale) {
+      value = ac.get_value();
+    }
+    if (result != cache::kLookupMiss) {
+      trace(key, cache::kTraceGet, true);
+      return result;
+    }
+  }
+  ValueRef ref = promote(key);
+  trace(key, cache::kTraceGet, ref != nullptr);
+  if (ref == nullptr) {
+    return cache::kLookupMiss;
+  }
+  value = *ref;
+  return cache::kLookupHit;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool LRUCache<TKey, TValue, TMutex, THash, TBackend>::set(const TKey& key, const TValue& value, int64_t ttl_ms,
+                                                          uint64_t tag) {
+  bool flag = m_cache_->insert(key, value, ttl_ms, tag);
+  erase_from_tier(key);
+  trace(key, cache::kTraceSet);
+  return flag;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void LRUCache<TKey, TValue, TMutex, THash, TBackend>::mset(const std::unordered_map<TKey, TValue>& data,
+                                                           int64_t ttl_ms, uint64_t tag) {
+  m_cache_->insert(data, ttl_ms, tag);
+  for (const auto& pair : data) {
+    erase_from_tier(pair.first);
+    trace(pair.first, cache::kTraceSet);
   }
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-bool LRUCache<TKey, TValue, TMutex, THash>::set(const TKey& key, const TValue& value) {
-  return m_cache_->insert(key, value);
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+bool LRUCache<TKey, TValue, TMutex, THash, TBackend>::set_negative(const TKey& key, int64_t ttl_ms, uint64_t tag) {
+  bool flag = m_cache_->insert_negative(key, ttl_ms, tag);
+  erase_from_tier(key);
+  trace(key, cache::kTraceSet);
+  return flag;
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void LRUCache<TKey, TValue, TMutex, THash, TBackend>::clear() {
+  m_cache_->clear();
+  if (m_tier_ != nullptr) {
+    m_tier_->clear();
+  }
 }
 
-template <class TKey, class TValue, class TMutex, class THash>
-void LRUCache<TKey, TValue, TMutex, THash>::mset(const std::unordered_map<TKey, TValue>& data) {
-  m_cache_->insert(data);
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void LRUCache<TKey, TValue, TMutex, THash, TBackend>::start_stats_dump(uint32_t interval_ms,
+                                                                       const cache::StatsDumper::SinkFunc& sink) {
+  m_stats_dumper_.reset();
+  cache::StatsDumper::SinkFunc dump_sink = sink;
+  if (!dump_sink) {
+    dump_sink = [](const cache::ShardStats& stats) { fprintf(stderr, "cache stats %s\n", stats.to_string().c_str()); };
+  }
+  std::shared_ptr<Cache> shared_cache = m_cache_;
+  m_stats_dumper_.reset(
+      new cache::StatsDumper(interval_ms, [shared_cache]() { return shared_cache->stats(); }, dump_sink));
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+void LRUCache<TKey, TValue, TMutex, THash, TBackend>::set_tier(
+    const std::shared_ptr<cache::CacheTier<TKey, TValue>>& tier) {
+  static_assert(std::is_default_constructible<TValue>::value, "a cache tier needs a default constructible value");
+  m_tier_ = tier;
+  if (tier == nullptr) {
+    m_cache_->set_eviction_listener(nullptr);
+    return;
+  }
+  std::weak_ptr<cache::CacheTier<TKey, TValue>> weak_tier = tier;
+  m_cache_->set_eviction_listener([weak_tier](const typename Cache::SnapshotItem& item) {
+    if (item.tag != cache::kNoTag) {
+      // invalidate_tag couldn't reach it in the tier
+      return;
+    }
+    // Evicting coros may outlive the cache
+    if (auto tier = weak_tier.lock()) {
+      tier->put(item.key, *item.value, item.expire_time);
+    }
+  });
+}
+
+template <class TKey, class TValue, class TMutex, class THash, class TBackend>
+typename LRUCache<TKey, TValue, TMutex, THash, TBackend>::ValueRef
+LRUCache<TKey, TValue, TMutex, THash, TBackend>::promote(const TKey& key) {
+  // Without a default constructor set_tier can't be called, and the reads
+  // don't need one
+  if constexpr (std::is_default_constructible<TValue>::value) {
+    if (m_tier_ == nullptr || m_tier_->size() == 0) {
+      return nullptr;
+    }
+    TValue value;
+    int64_t expire_time = 0;
+    if (!m_tier_->get(key, value, expire_time)) {
+      return nullptr;
+    }
+    ValueRef ref = std::make_shared<const TValue>(std::move(value));
+    // Only the caller which took the record moves it, and a value set meanwhile is newer
+    if (m_tier_->erase(key)) {
+      m_cache_->restore(key, ref, expire_time);
+    }
+    return ref;
+  } else {
+    return nullptr;
+  }
 }
 
 }  // namespace cpp_lib
\ No newline at end of file
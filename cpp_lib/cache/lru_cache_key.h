@@ -0,0 +1,56 @@
+#pragma once
+
+#include <functional>
+#include <utility>
+
+namespace cpp_lib {
+
+/**
+ * A cache key with a memoized hash. The key is hashed once on construction,
+ * after that the shard selection of ConcurrentScalableCache, the buckets of
+ * the shard's hash map and the TinyLFU sketch all reuse the stored hash, which
+ * matters for long string keys.
+ *
+ * Construct the key once and reuse it for the lookup and the insert:
+ *   LRUCacheKey<std::string> key(name);
+ *   if (!cache.get(key, value)) { cache.set(key, value); }
+ */
+template <class T, class THash = std::hash<T>>
+class LRUCacheKey {
+ public:
+  LRUCacheKey() : m_hash(0) {}
+
+  explicit LRUCacheKey(const T& key) : m_key(key), m_hash(THash()(m_key)) {}
+
+  explicit LRUCacheKey(T&& key) : m_key(std::move(key)), m_hash(THash()(m_key)) {}
+
+  const T& key() const { return m_key; }
+
+  size_t hash() const { return m_hash; }
+
+  bool operator==(const LRUCacheKey& other) const { return m_hash == other.m_hash && m_key == other.m_key; }
+
+  bool operator!=(const LRUCacheKey& other) const { return !(*this == other); }
+
+ private:
+  T m_key;
+  size_t m_hash;
+};
+
+// Found by argument dependent lookup from tbb_hash_compare of the legacy TBB,
+// oneTBB uses the std::hash specialization below
+template <class T, class THash>
+size_t tbb_hasher(const LRUCacheKey<T, THash>& key) {
+  return key.hash();
+}
+
+}  // namespace cpp_lib
+
+namespace std {
+
+template <class T, class THash>
+struct hash<cpp_lib::LRUCacheKey<T, THash>> {
+  size_t operator()(const cpp_lib::LRUCacheKey<T, THash>& key) const { return key.hash(); }
+};
+
+}  // namespace std
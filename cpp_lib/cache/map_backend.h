@@ -0,0 +1,43 @@
+#pragma once
+
+#include <tbb/concurrent_hash_map.h>
+
+#include "cpp_lib/cache/flat_hash_map.h"
+
+namespace cpp_lib {
+
+namespace cache {
+
+/**
+ * Hash map backends of ConcurrentLRUCache. A backend provides the map type,
+ * which must have the tbb::concurrent_hash_map interface the cache uses and
+ * keep its elements in place until they are erased, and a prefetch hook
+ * called by batch lookups a few keys ahead.
+ */
+
+// tbb::concurrent_hash_map, the default
+struct TbbMapBackend {
+  template <class TKey, class TValue, class THash, class TAllocator>
+  using Map = tbb::concurrent_hash_map<TKey, TValue, THash, TAllocator>;
+
+  // TBB keeps its buckets private, prefetch the key instead
+  template <class TMap, class TKey>
+  static void prefetch(const TMap&, const TKey& key) {
+    __builtin_prefetch(&key);
+  }
+};
+
+// FlatHashMap, open addressing with optimistic reads
+struct FlatMapBackend {
+  template <class TKey, class TValue, class THash, class TAllocator>
+  using Map = FlatHashMap<TKey, TValue, THash, TAllocator>;
+
+  template <class TMap, class TKey>
+  static void prefetch(const TMap& map, const TKey& key) {
+    map.prefetch(key);
+  }
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
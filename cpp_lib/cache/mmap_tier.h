@@ -0,0 +1,392 @@
+#pragma once
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+#include "cpp_lib/cache/cache_snapshot.h"
+#include "cpp_lib/reloader/reloadable_file.h"
+#include "cpp_lib/util/time/time.h"
+
+namespace cpp_lib {
+
+namespace cache {
+
+/**
+ * A tier below the memory of LRUCache. It takes the values the memory tier
+ * evicts and gives them back on misses, see LRUCache::set_tier.
+ */
+template <class TKey, class TValue>
+class CacheTier {
+ public:
+  virtual ~CacheTier() = default;
+
+  // Store a value with its absolute expire time in milliseconds, 0 means never expired
+  virtual bool put(const TKey& key, const TValue& value, int64_t expire_time) = 0;
+
+  // Get an unexpired value and its expire time
+  virtual bool get(const TKey& key, TValue& value, int64_t& expire_time) = 0;
+
+  // Remove key, returns false if it isn't stored
+  virtual bool erase(const TKey& key) = 0;
+
+  // Remove every value
+  virtual void clear() = 0;
+
+  virtual size_t size() const = 0;
+};
+
+struct MMapTierOptions {
+  // Directory of the segment files, created if missing but not its parents
+  std::string dir;
+  // Size of a segment file, at most 4GB, larger records are rejected
+  size_t segment_bytes = 64UL << 20;
+  // Disk budget, the oldest segments are dropped beyond it
+  size_t max_bytes = 1UL << 30;
+  // A sealed segment is compacted once less than this ratio of it is live
+  double compact_ratio = 0.5;
+};
+
+/**
+ * Tier statistics, see MMapTier::stats
+ */
+struct MMapTierStats {
+  size_t size = 0;
+  size_t segments = 0;
+  size_t live_bytes = 0;
+  size_t hits = 0;
+  size_t misses = 0;
+  // Records moved by compaction and records lost with dropped segments
+  size_t compacted = 0;
+  size_t dropped = 0;
+};
+
+/**
+ * A disk-backed key value store for the values evicted from a memory cache,
+ * see LRUCache::enable_mmap_tier.
+ *
+ * Values are appended to fixed-size segment files which are read through
+ * read-only shared mappings, so hot records are served from the page cache
+ * without a syscall. Only the index lives on the heap. When the active
+ * segment is full a new one is started, and put compacts at most one sealed
+ * segment whose live ratio fell below compact_ratio by moving its live
+ * records to the active segment. Beyond max_bytes the oldest segment is
+ * dropped with its records, so the tier is a FIFO of the evicted values.
+ *
+ * The segment files are unlinked once mapped, their space is freed when the
+ * tier is destroyed or the process exits; the tier does not survive
+ * restarts, see CacheSnapshot for that.
+ *
+ * Thread safe. get holds a shared lock, put and erase an exclusive one.
+ */
+template <class TKey, class TValue, class THash, class KeyCodec = SnapshotCodec<TKey>,
+          class ValueCodec = SnapshotCodec<TValue>>
+class MMapTier : public CacheTier<TKey, TValue> {
+ public:
+  MMapTier() = default;
+
+  MMapTier(const MMapTier&) = delete;
+  MMapTier& operator=(const MMapTier&) = delete;
+
+  ~MMapTier() override {
+    for (auto& pair : m_segments) {
+      close_segment(pair.second.get());
+    }
+  }
+
+  /**
+   * Create the first segment, returns false on I/O errors
+   */
+  bool open(const MMapTierOptions& options) {
+    std::lock_guard<std::shared_mutex> lock(m_mutex);
+    m_options = options;
+    // Record offsets are 32 bits
+    m_options.segment_bytes = std::min<size_t>(m_options.segment_bytes, UINT32_MAX);
+    if (m_options.max_bytes < m_options.segment_bytes * 2) {
+      // The active segment and one sealed segment at least
+      m_options.max_bytes = m_options.segment_bytes * 2;
+    }
+    if (mkdir(m_options.dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+    return roll();
+  }
+
+  /**
+   * Append a value, replacing an older record of key
+   */
+  bool put(const TKey& key, const TValue& value, int64_t expire_time) override {
+    std::string record(sizeof(RecordHeader), '\0');
+    KeyCodec::encode(key, record);
+    size_t key_size = record.size() - sizeof(RecordHeader);
+    ValueCodec::encode(value, record);
+    RecordHeader header{static_cast<uint32_t>(key_size), static_cast<uint32_t>(record.size()), expire_time};
+    memcpy(&record[0], &header, sizeof(header));
+    if (record.size() > m_options.segment_bytes) {
+      return false;
+    }
+
+    std::lock_guard<std::shared_mutex> lock(m_mutex);
+    if (m_active == nullptr) {
+      return false;
+    }
+    if (m_active->write_offset + record.size() > m_options.segment_bytes) {
+      if (!roll()) {
+        return false;
+      }
+      maintain();
+    }
+    return append(key, record.data(), record.size());
+  }
+
+  bool get(const TKey& key, TValue& value, int64_t& expire_time) override {
+    bool found = false;
+    {
+      std::shared_lock<std::shared_mutex> lock(m_mutex);
+      auto iter = m_index.find(key);
+      if (iter != m_index.end()) {
+        const Segment* segment = m_segments.at(iter->second.segment_id).get();
+        const char* pos = static_cast<const char*>(segment->map.Data()) + iter->second.offset;
+        const char* end = pos + iter->second.size;
+        RecordHeader header;
+        memcpy(&header, pos, sizeof(header));
+        pos += sizeof(header) + header.key_size;
+        expire_time = header.expire_time;
+        found = (expire_time == 0 || expire_time > GetCoarseTimeMillis()) && ValueCodec::decode(pos, end, value);
+      }
+    }
+    (found ? m_hits : m_misses).fetch_add(1, std::memory_order_relaxed);
+    return found;
+  }
+
+  bool erase(const TKey& key) override {
+    if (m_size.load(std::memory_order_relaxed) == 0) {
+      return false;
+    }
+    std::lock_guard<std::shared_mutex> lock(m_mutex);
+    auto iter = m_index.find(key);
+    if (iter == m_index.end()) {
+      return false;
+    }
+    m_segments.at(iter->second.segment_id)->live_bytes -= iter->second.size;
+    m_index.erase(iter);
+    m_size--;
+    return true;
+  }
+
+  /**
+   * Drop every segment and start an empty one
+   */
+  void clear() override {
+    std::lock_guard<std::shared_mutex> lock(m_mutex);
+    if (m_active == nullptr) {
+      // Not opened
+      return;
+    }
+    for (auto& pair : m_segments) {
+      close_segment(pair.second.get());
+    }
+    m_segments.clear();
+    m_active = nullptr;
+    m_index.clear();
+    m_size = 0;
+    roll();
+  }
+
+  size_t size() const override { return m_size.load(std::memory_order_relaxed); }
+
+  MMapTierStats stats() const {
+    MMapTierStats stats;
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    stats.size = m_index.size();
+    stats.segments = m_segments.size();
+    for (const auto& pair : m_segments) {
+      stats.live_bytes += pair.second->live_bytes;
+    }
+    stats.hits = m_hits.load(std::memory_order_relaxed);
+    stats.misses = m_misses.load(std::memory_order_relaxed);
+    stats.compacted = m_compacted;
+    stats.dropped = m_dropped;
+    return stats;
+  }
+
+ private:
+  struct RecordHeader {
+    uint32_t key_size;
+    // The whole record with the header
+    uint32_t size;
+    int64_t expire_time;
+  };
+
+  struct Location {
+    uint32_t segment_id;
+    uint32_t offset;
+    uint32_t size;
+  };
+
+  struct Segment {
+    uint32_t id = 0;
+    FILE* file = nullptr;
+    MMapData map;
+    size_t write_offset = 0;
+    size_t live_bytes = 0;
+  };
+
+  struct KeyHash {
+    size_t operator()(const TKey& key) const { return THash().hash(key); }
+  };
+
+  struct KeyEqual {
+    bool operator()(const TKey& lhs, const TKey& rhs) const { return THash().equal(lhs, rhs); }
+  };
+
+  static void close_segment(Segment* segment) {
+    segment->map.Munmap();
+    if (segment->file != nullptr) {
+      fclose(segment->file);
+      segment->file = nullptr;
+    }
+  }
+
+  /**
+   * Start a new active segment, the current one is sealed
+   */
+  bool roll() {
+    std::string path = m_options.dir + "/segment_XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+      return false;
+    }
+    unlink(path.c_str());
+    std::unique_ptr<Segment> segment(new Segment());
+    segment->file = fdopen(fd, "w+b");
+    if (segment->file == nullptr) {
+      ::close(fd);
+      return false;
+    }
+    if (ftruncate(fd, static_cast<off_t>(m_options.segment_bytes)) != 0 ||
+        segment->map.MMap(segment->file, static_cast<int64_t>(m_options.segment_bytes)) != 0) {
+      close_segment(segment.get());
+      return false;
+    }
+    segment->id = m_next_segment_id++;
+    m_active = segment.get();
+    m_segments.emplace(segment->id, std::move(segment));
+    return true;
+  }
+
+  /**
+   * Write a record to the active segment and point the index at it
+   */
+  bool append(const TKey& key, const char* record, size_t size) {
+    off_t offset = static_cast<off_t>(m_active->write_offset);
+    if (pwrite(fileno(m_active->file), record, size, offset) != static_cast<ssize_t>(size)) {
+      return false;
+    }
+    m_active->write_offset += size;
+    m_active->live_bytes += size;
+    Location location{m_active->id, static_cast<uint32_t>(offset), static_cast<uint32_t>(size)};
+    auto result = m_index.emplace(key, location);
+    if (!result.second) {
+      m_segments.at(result.first->second.segment_id)->live_bytes -= result.first->second.size;
+      result.first->second = location;
+    } else {
+      m_size++;
+    }
+    return true;
+  }
+
+  /**
+   * Visit the records of a sealed segment which the index still points to
+   */
+  template <class Func>
+  void for_each_live(const Segment* segment, const Func& func) {
+    const char* data = static_cast<const char*>(segment->map.Data());
+    size_t offset = 0;
+    while (offset < segment->write_offset) {
+      RecordHeader header;
+      memcpy(&header, data + offset, sizeof(header));
+      const char* pos = data + offset + sizeof(header);
+      TKey key;
+      if (KeyCodec::decode(pos, pos + header.key_size, key)) {
+        auto iter = m_index.find(key);
+        if (iter != m_index.end() && iter->second.segment_id == segment->id && iter->second.offset == offset) {
+          func(key, data + offset, header.size);
+        }
+      }
+      offset += header.size;
+    }
+  }
+
+  /**
+   * Drop the oldest segments beyond max_bytes, then compact the sealed
+   * segment with the lowest live ratio if it is below compact_ratio
+   */
+  void maintain() {
+    while (m_segments.size() * m_options.segment_bytes > m_options.max_bytes) {
+      Segment* oldest = m_segments.begin()->second.get();
+      for_each_live(oldest, [this](const TKey& key, const char*, size_t) {
+        m_index.erase(key);
+        m_size--;
+        m_dropped++;
+      });
+      close_segment(oldest);
+      m_segments.erase(m_segments.begin());
+    }
+
+    Segment* victim = nullptr;
+    for (auto& pair : m_segments) {
+      Segment* segment = pair.second.get();
+      if (segment != m_active && (victim == nullptr || segment->live_bytes < victim->live_bytes)) {
+        victim = segment;
+      }
+    }
+    if (victim == nullptr ||
+        victim->live_bytes >= static_cast<size_t>(m_options.compact_ratio * m_options.segment_bytes) ||
+        m_active->write_offset + victim->live_bytes > m_options.segment_bytes) {
+      return;
+    }
+    for_each_live(victim, [this](const TKey& key, const char* record, size_t size) {
+      if (append(key, record, size)) {
+        m_compacted++;
+      }
+    });
+    // Records which failed to move are lost with the segment
+    for_each_live(victim, [this](const TKey& key, const char*, size_t) {
+      m_index.erase(key);
+      m_size--;
+      m_dropped++;
+    });
+    close_segment(victim);
+    m_segments.erase(victim->id);
+  }
+
+  MMapTierOptions m_options;
+  mutable std::shared_mutex m_mutex;
+  // By id, which grows with the age of the segments
+  std::map<uint32_t, std::unique_ptr<Segment>> m_segments;
+  Segment* m_active = nullptr;
+  uint32_t m_next_segment_id = 0;
+  std::unordered_map<TKey, Location, KeyHash, KeyEqual> m_index;
+  std::atomic<size_t> m_size{0};
+  std::atomic<size_t> m_hits{0};
+  std::atomic<size_t> m_misses{0};
+  size_t m_compacted = 0;
+  size_t m_dropped = 0;
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "cpp_lib/cache/access_trace.h"
+
+namespace cpp_lib {
+
+namespace cache {
+
+/**
+ * Online miss ratio curve of a cache with SHARDS sampling: the LRU hit ratio
+ * the gets would see at any cache size, see
+ * ConcurrentScalableCache::estimate_hit_ratio.
+ *
+ * Keys are sampled spatially like AccessTrace, so a sampled key keeps all its
+ * accesses and the reuse distance of a get among the sampled keys is
+ * sample_rate times its distance in the full stream. A get hits an LRU cache
+ * of size items if fewer than size other keys were accessed since the last
+ * access of its key.
+ *
+ * A few hot keys make the sampled share of the gets stray far from
+ * sample_rate. Given the number of all gets, hit_ratio divides the sampled
+ * misses by the expected number of sampled gets instead of the actual one,
+ * which corrects most of that error (SHARDS_adj).
+ *
+ * Reuse distances are counted with a Fenwick tree over the access stamps,
+ * which marks the last access of every tracked key, O(log max_keys) per
+ * sampled access under a mutex. Accesses of other keys cost a hash and a
+ * compare. At most max_keys keys are tracked, the least recent one is
+ * dropped beyond that, so the curve covers sizes up to
+ * max_keys / sample_rate items and larger sizes get its last point.
+ */
+class MrcEstimator {
+ public:
+  MrcEstimator(double sample_rate, size_t max_keys)
+      : m_sample_rate(AccessTrace::clamp_sample_rate(sample_rate)),
+        m_threshold(AccessTrace::sample_threshold(sample_rate)),
+        m_max_keys(std::max<size_t>(max_keys, 1)),
+        m_capacity(2 * m_max_keys + 1),
+        m_tree(m_capacity + 1, 0),
+        m_stamp_keys(m_capacity + 1, 0),
+        m_marked(m_capacity + 1, 0),
+        m_histogram(m_max_keys, 0) {
+    m_last.reserve(m_max_keys);
+  }
+
+  MrcEstimator(const MrcEstimator&) = delete;
+  MrcEstimator& operator=(const MrcEstimator&) = delete;
+
+  /**
+   * Record an access of the key with hash if the key is sampled. Gets are
+   * counted in the curve, sets only make the key the most recent.
+   */
+  void access(size_t hash, bool is_get) {
+    uint64_t key = AccessTrace::mix(hash);
+    if (key > m_threshold) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    update(key, is_get);
+  }
+
+  /**
+   * Estimated hit ratio of the gets at size items, 0 before any sampled get.
+   * total_gets counts all the gets since the start or reset(), sampled or
+   * not; 0 skips the correction.
+   */
+  double hit_ratio(size_t size, uint64_t total_gets = 0) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t limit = std::min(m_max_keys, static_cast<size_t>(size * m_sample_rate + 0.5));
+    if (m_gets == 0 || limit == 0) {
+      return 0;
+    }
+    uint64_t hits = 0;
+    for (size_t i = 0; i < limit; i++) {
+      hits += m_histogram[i];
+    }
+    double expected = total_gets * m_sample_rate;
+    if (expected < 1) {
+      return static_cast<double>(hits) / m_gets;
+    }
+    return std::max(0.0, 1 - (m_gets - hits) / expected);
+  }
+
+  /**
+   * Number of sampled gets in the curve
+   */
+  uint64_t sampled_gets() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_gets;
+  }
+
+  /**
+   * Forget every access, e.g. after the workload changed
+   */
+  void reset() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_last.clear();
+    std::fill(m_tree.begin(), m_tree.end(), 0);
+    std::fill(m_marked.begin(), m_marked.end(), 0);
+    std::fill(m_histogram.begin(), m_histogram.end(), 0);
+    m_clock = 1;
+    m_gets = 0;
+  }
+
+ private:
+  void update(uint64_t key, bool is_get) {
+    if (m_clock > m_capacity) {
+      compact();
+    }
+    auto it = m_last.find(key);
+    if (it != m_last.end()) {
+      if (is_get) {
+        // The tracked keys accessed after the last access of key
+        m_histogram[m_last.size() - prefix(it->second)]++;
+        m_gets++;
+      }
+      unmark(it->second);
+      it->second = m_clock;
+    } else {
+      // A miss at every size, its first access or dropped
+      m_gets += is_get ? 1 : 0;
+      if (m_last.size() >= m_max_keys) {
+        drop_oldest();
+      }
+      m_last.emplace(key, m_clock);
+    }
+    m_stamp_keys[m_clock] = key;
+    m_marked[m_clock] = 1;
+    add(m_clock, 1);
+    m_clock++;
+  }
+
+  /**
+   * Renumber the marked stamps from 1 in order once the clock reaches the
+   * end of the tree, at most max_keys of the 2 * max_keys stamps are marked
+   */
+  void compact() {
+    size_t next = 1;
+    for (size_t stamp = 1; stamp < m_clock; stamp++) {
+      if (m_marked[stamp] != 0) {
+        m_marked[stamp] = 0;
+        uint64_t key = m_stamp_keys[stamp];
+        m_stamp_keys[next] = key;
+        m_marked[next] = 1;
+        m_last[key] = next++;
+      }
+    }
+    // Build the tree of the marks [1, next) in linear time
+    std::fill(m_tree.begin(), m_tree.end(), 0);
+    for (size_t stamp = 1; stamp <= m_capacity; stamp++) {
+      m_tree[stamp] += stamp < next ? 1 : 0;
+      size_t parent = stamp + (stamp & (~stamp + 1));
+      if (parent <= m_capacity) {
+        m_tree[parent] += m_tree[stamp];
+      }
+    }
+    m_clock = next;
+  }
+
+  void drop_oldest() {
+    // The lowest marked stamp, by descending the tree
+    size_t stamp = 0;
+    for (size_t step = m_top_bit; step != 0; step >>= 1) {
+      if (stamp + step <= m_capacity && m_tree[stamp + step] == 0) {
+        stamp += step;
+      }
+    }
+    stamp++;
+    m_last.erase(m_stamp_keys[stamp]);
+    unmark(stamp);
+  }
+
+  void unmark(size_t stamp) {
+    m_marked[stamp] = 0;
+    add(stamp, -1);
+  }
+
+  void add(size_t stamp, int delta) {
+    for (; stamp <= m_capacity; stamp += stamp & (~stamp + 1)) {
+      m_tree[stamp] += delta;
+    }
+  }
+
+  // Number of marked stamps in [1, stamp]
+  size_t prefix(size_t stamp) const {
+    size_t sum = 0;
+    for (; stamp != 0; stamp -= stamp & (~stamp + 1)) {
+      sum += m_tree[stamp];
+    }
+    return sum;
+  }
+
+  static size_t top_bit(size_t value) {
+    size_t bit = 1;
+    while ((bit << 1) <= value) {
+      bit <<= 1;
+    }
+    return bit;
+  }
+
+  const double m_sample_rate;
+  const uint64_t m_threshold;
+  const size_t m_max_keys;
+  // Stamps are 1 to m_capacity
+  const size_t m_capacity;
+  const size_t m_top_bit = top_bit(m_capacity);
+
+  mutable std::mutex m_mutex;
+  // The stamp of the last access of every tracked key
+  std::unordered_map<uint64_t, size_t> m_last;
+  std::vector<uint32_t> m_tree;
+  // The key of every stamp, and whether it is still its last access
+  std::vector<uint64_t> m_stamp_keys;
+  std::vector<uint8_t> m_marked;
+  size_t m_clock = 1;
+  // Sampled gets by reuse distance, and all of them
+  std::vector<uint64_t> m_histogram;
+  uint64_t m_gets = 0;
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
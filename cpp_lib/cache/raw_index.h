@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "cpp_lib/cache/epoch.h"
+
+namespace cpp_lib {
+
+namespace cache {
+
+/**
+ * A hash index of immutable entries which is read without any lock, see
+ * ConcurrentLRUCache::find_raw.
+ *
+ * Readers walk the bucket chains under an EpochGuard. A writer replaces an
+ * entry instead of changing it: the new entry is linked in place of the old
+ * one, which is unlinked and retired to the EpochManager, so a reader holding
+ * an entry may keep using it and its value until the guard is destroyed.
+ *
+ * Writers must be serialized by the owner, ConcurrentLRUCache holds its list
+ * mutex. The bucket count is fixed at construction.
+ */
+template <class TKey, class TValue, class THash>
+class RawIndex {
+ public:
+  struct Entry {
+    Entry(const TKey& k, size_t h, std::shared_ptr<const TValue> v, int64_t e)
+        : key(k), hash(h), value(std::move(v)), expire_time(e) {}
+
+    const TKey key;
+    const size_t hash;
+    // nullptr for a negative item
+    const std::shared_ptr<const TValue> value;
+    // Absolute time in milliseconds the item leaves the cache, 0 means never
+    int64_t expire_time;
+    // See GenerationTable
+    uint64_t generation = 0;
+    uint64_t tag = 0;
+    // Set by readers, see ConcurrentLRUCache::is_referenced
+    std::atomic<bool> referenced{false};
+    std::atomic<Entry*> next{nullptr};
+  };
+
+  static constexpr size_t kMinBuckets = 64;
+  static constexpr size_t kMaxBuckets = 1UL << 22;
+
+  /**
+   * Sized for capacity entries, at most kMaxBuckets
+   */
+  explicit RawIndex(size_t capacity) {
+    m_bits = 6;
+    while ((1UL << m_bits) < std::min(std::max(capacity, kMinBuckets), kMaxBuckets)) {
+      m_bits++;
+    }
+    m_buckets.reset(new std::atomic<Entry*>[1UL << m_bits]());
+  }
+
+  RawIndex(const RawIndex&) = delete;
+  RawIndex& operator=(const RawIndex&) = delete;
+
+  ~RawIndex() { clear(); }
+
+  /**
+   * The entry of key, nullptr if none. The caller must hold an EpochGuard as
+   * long as it uses the entry.
+   */
+  const Entry* find(const TKey& key, size_t hash) const {
+    THash hash_obj;
+    for (Entry* entry = bucket(hash).load(std::memory_order_acquire); entry != nullptr;
+         entry = entry->next.load(std::memory_order_acquire)) {
+      if (entry->hash == hash && hash_obj.equal(entry->key, key)) {
+        return entry;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * Link entry, replacing the entry of the same key. Returns the replaced
+   * entry for the caller to retire, nullptr if there was none.
+   */
+  Entry* publish(Entry* entry) {
+    THash hash_obj;
+    std::atomic<Entry*>* link = &bucket(entry->hash);
+    for (Entry* cur = link->load(std::memory_order_relaxed); cur != nullptr;
+         cur = cur->next.load(std::memory_order_relaxed)) {
+      if (cur->hash == entry->hash && hash_obj.equal(cur->key, entry->key)) {
+        // Readers on cur still reach the rest of the chain
+        entry->next.store(cur->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        link->store(entry, std::memory_order_release);
+        return cur;
+      }
+      link = &cur->next;
+    }
+    entry->next.store(bucket(entry->hash).load(std::memory_order_relaxed), std::memory_order_relaxed);
+    bucket(entry->hash).store(entry, std::memory_order_release);
+    return nullptr;
+  }
+
+  /**
+   * Unlink entry, the caller retires it afterwards
+   */
+  void remove(Entry* entry) {
+    std::atomic<Entry*>* link = &bucket(entry->hash);
+    for (Entry* cur = link->load(std::memory_order_relaxed); cur != nullptr;
+         cur = cur->next.load(std::memory_order_relaxed)) {
+      if (cur == entry) {
+        link->store(entry->next.load(std::memory_order_relaxed), std::memory_order_release);
+        return;
+      }
+      link = &cur->next;
+    }
+  }
+
+  /**
+   * Free entry once no reader can reach it
+   */
+  static void retire(Entry* entry) {
+    if (entry != nullptr) {
+      EpochManager::instance().retire(entry, &delete_entry);
+    }
+  }
+
+  /**
+   * Free every entry at once. NOT THREAD SAFE -- no reader may hold an entry.
+   */
+  void clear() {
+    for (size_t i = 0; i < (1UL << m_bits); i++) {
+      Entry* entry = m_buckets[i].exchange(nullptr, std::memory_order_relaxed);
+      while (entry != nullptr) {
+        Entry* next = entry->next.load(std::memory_order_relaxed);
+        delete entry;
+        entry = next;
+      }
+    }
+  }
+
+ private:
+  static void delete_entry(void* entry) { delete static_cast<Entry*>(entry); }
+
+  std::atomic<Entry*>& bucket(size_t hash) const {
+    // Fibonacci hashing, the keys of a shard share their low hash bits
+    return m_buckets[(static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ULL) >> (64 - m_bits)];
+  }
+
+  size_t m_bits;
+  std::unique_ptr<std::atomic<Entry*>[]> m_buckets;
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
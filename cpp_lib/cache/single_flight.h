@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "cpp_lib/coro/coro.h"
+
+namespace cpp_lib {
+
+namespace cache {
+
+/**
+ * Coalesces concurrent loads of the same key. The first caller of join()
+ * for a key leads its flight and must finish() it; the callers joining while
+ * it is in flight get the same Flight and wait() for its result instead of
+ * loading the key again.
+ *
+ * THash is a tbb_hash_compare style hasher with hash() and equal().
+ */
+template <class TKey, class TValue, class THash>
+class SingleFlight {
+ public:
+  struct Flight {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::atomic<bool> done{false};
+    bool ok = false;
+    TValue value;
+  };
+  typedef std::shared_ptr<Flight> FlightPtr;
+
+  SingleFlight() = default;
+
+  SingleFlight(const SingleFlight&) = delete;
+  SingleFlight& operator=(const SingleFlight&) = delete;
+
+  /**
+   * Get the flight of key, returns true if the caller leads it
+   */
+  bool join(const TKey& key, FlightPtr& flight) {
+    Stripe& stripe = get_stripe(key);
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    auto iter = stripe.flights.find(key);
+    if (iter != stripe.flights.end()) {
+      flight = iter->second;
+      return false;
+    }
+    flight = std::make_shared<Flight>();
+    stripe.flights.emplace(key, flight);
+    return true;
+  }
+
+  /**
+   * Publish the result of a led flight and wake up its waiters. The key can
+   * be joined again once this is called.
+   */
+  void finish(const TKey& key, const FlightPtr& flight, bool ok, const TValue* value) {
+    {
+      Stripe& stripe = get_stripe(key);
+      std::lock_guard<std::mutex> lock(stripe.mutex);
+      stripe.flights.erase(key);
+    }
+    {
+      std::lock_guard<std::mutex> lock(flight->mutex);
+      flight->ok = ok;
+      if (ok) {
+        flight->value = *value;
+      }
+      flight->done.store(true, std::memory_order_release);
+    }
+    flight->cond.notify_all();
+  }
+
+  /**
+   * Wait for a flight led by another caller. Returns whether the load
+   * succeeded and copies the loaded value. Coroutines sleep between polls
+   * instead of blocking their worker thread.
+   */
+  static bool wait(const FlightPtr& flight, TValue& value) {
+    if (CoroSelfId() != 0) {
+      uint64_t sleep_us = kMinSleepMicros;
+      while (!flight->done.load(std::memory_order_acquire)) {
+        CoroSleep(sleep_us);
+        sleep_us = std::min(sleep_us * 2, kMaxSleepMicros);
+      }
+    }
+    std::unique_lock<std::mutex> lock(flight->mutex);
+    flight->cond.wait(lock, [&flight] { return flight->done.load(std::memory_order_relaxed); });
+    if (flight->ok) {
+      value = flight->value;
+    }
+    return flight->ok;
+  }
+
+  /**
+   * Load key with func(value) -> bool unless it is in flight, then wait for
+   * the leader's result. A func throwing fails the flight and is rethrown.
+   */
+  template <class Func>
+  bool run(const TKey& key, TValue& value, const Func& func) {
+    FlightPtr flight;
+    if (!join(key, flight)) {
+      return wait(flight, value);
+    }
+    bool ok = false;
+    try {
+      ok = func(value);
+    } catch (...) {
+      finish(key, flight, false, nullptr);
+      throw;
+    }
+    finish(key, flight, ok, &value);
+    return ok;
+  }
+
+ private:
+  static constexpr size_t kStripeNum = 64;
+  static constexpr uint64_t kMinSleepMicros = 10;
+  static constexpr uint64_t kMaxSleepMicros = 1000;
+
+  struct KeyHash {
+    size_t operator()(const TKey& key) const { return THash().hash(key); }
+  };
+
+  struct KeyEqual {
+    bool operator()(const TKey& lhs, const TKey& rhs) const { return THash().equal(lhs, rhs); }
+  };
+
+  struct Stripe {
+    std::mutex mutex;
+    std::unordered_map<TKey, FlightPtr, KeyHash, KeyEqual> flights;
+  };
+
+  Stripe& get_stripe(const TKey& key) {
+    // The high bits, the low ones pick the buckets of the stripe's map
+    size_t hash = THash().hash(key) * static_cast<size_t>(0x9e3779b97f4a7c15ULL);
+    return m_stripes[(hash >> 32) % kStripeNum];
+  }
+
+  Stripe m_stripes[kStripeNum];
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace cpp_lib {
+
+namespace cache {
+
+/**
+ * Allocation counters of a SlabArena, see ConcurrentLRUCache::alloc_stats
+ */
+struct AllocStats {
+  // Number of allocate and deallocate calls
+  size_t allocations = 0;
+  size_t deallocations = 0;
+  // Bytes handed out and not yet returned, including the heap fallback
+  size_t bytes_in_use = 0;
+  // Bytes reserved by slabs, slabs are only released with the arena
+  size_t slab_bytes = 0;
+
+  AllocStats& operator+=(const AllocStats& other) {
+    allocations += other.allocations;
+    deallocations += other.deallocations;
+    bytes_in_use += other.bytes_in_use;
+    slab_bytes += other.slab_bytes;
+    return *this;
+  }
+};
+
+/**
+ * A slab allocator for small fixed-size objects. Each size class (a multiple
+ * of kSlotAlign up to kMaxSlotSize) carves slots from its own kSlabSize slabs
+ * and recycles freed slots through a free list, so millions of same-sized
+ * hash map nodes neither fragment the heap nor pay malloc's per-chunk
+ * overhead. Larger requests go to operator new.
+ */
+class SlabArena {
+ public:
+  static constexpr size_t kSlabSize = 64 * 1024;
+  static constexpr size_t kSlotAlign = alignof(std::max_align_t);
+  static constexpr size_t kMaxSlotSize = 512;
+  static constexpr size_t kClassNum = kMaxSlotSize / kSlotAlign;
+
+  SlabArena() = default;
+
+  SlabArena(const SlabArena&) = delete;
+  SlabArena& operator=(const SlabArena&) = delete;
+
+  void* allocate(size_t bytes) {
+    m_allocations.fetch_add(1, std::memory_order_relaxed);
+    m_bytes_in_use.fetch_add(bytes, std::memory_order_relaxed);
+    if (bytes == 0 || bytes > kMaxSlotSize) {
+      return ::operator new(bytes);
+    }
+    size_t index = (bytes - 1) / kSlotAlign;
+    size_t slot_size = (index + 1) * kSlotAlign;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    SizeClass& size_class = m_classes[index];
+    if (size_class.free_list != nullptr) {
+      FreeSlot* slot = size_class.free_list;
+      size_class.free_list = slot->next;
+      return slot;
+    }
+    if (size_class.cur + slot_size > size_class.end) {
+      m_slabs.emplace_back(new char[kSlabSize]);
+      size_class.cur = m_slabs.back().get();
+      size_class.end = size_class.cur + kSlabSize;
+      m_slab_bytes.fetch_add(kSlabSize, std::memory_order_relaxed);
+    }
+    void* ptr = size_class.cur;
+    size_class.cur += slot_size;
+    return ptr;
+  }
+
+  void deallocate(void* ptr, size_t bytes) {
+    m_deallocations.fetch_add(1, std::memory_order_relaxed);
+    m_bytes_in_use.fetch_sub(bytes, std::memory_order_relaxed);
+    if (bytes == 0 || bytes > kMaxSlotSize) {
+      ::operator delete(ptr);
+      return;
+    }
+    size_t index = (bytes - 1) / kSlotAlign;
+    FreeSlot* slot = static_cast<FreeSlot*>(ptr);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    slot->next = m_classes[index].free_list;
+    m_classes[index].free_list = slot;
+  }
+
+  AllocStats stats() const {
+    AllocStats stats;
+    stats.allocations = m_allocations.load(std::memory_order_relaxed);
+    stats.deallocations = m_deallocations.load(std::memory_order_relaxed);
+    stats.bytes_in_use = m_bytes_in_use.load(std::memory_order_relaxed);
+    stats.slab_bytes = m_slab_bytes.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+ private:
+  struct FreeSlot {
+    FreeSlot* next;
+  };
+
+  struct SizeClass {
+    FreeSlot* free_list = nullptr;
+    char* cur = nullptr;
+    char* end = nullptr;
+  };
+
+  std::mutex m_mutex;
+  SizeClass m_classes[kClassNum];
+  std::vector<std::unique_ptr<char[]>> m_slabs;
+
+  std::atomic<size_t> m_allocations{0};
+  std::atomic<size_t> m_deallocations{0};
+  std::atomic<size_t> m_bytes_in_use{0};
+  std::atomic<size_t> m_slab_bytes{0};
+};
+
+/**
+ * Standard allocator on top of a SlabArena, rebinding keeps the arena. Without
+ * an arena it falls back to operator new.
+ */
+template <class T>
+class SlabAllocator {
+ public:
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  explicit SlabAllocator(SlabArena* arena = nullptr) noexcept : m_arena(arena) {}
+
+  template <class U>
+  SlabAllocator(const SlabAllocator<U>& other) noexcept : m_arena(other.arena()) {}
+
+  T* allocate(size_t n) {
+    static_assert(alignof(T) <= SlabArena::kSlotAlign, "over-aligned type");
+    if (m_arena == nullptr) {
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    return static_cast<T*>(m_arena->allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* ptr, size_t n) {
+    if (m_arena == nullptr) {
+      ::operator delete(ptr);
+      return;
+    }
+    m_arena->deallocate(ptr, n * sizeof(T));
+  }
+
+  SlabArena* arena() const { return m_arena; }
+
+  template <class U>
+  bool operator==(const SlabAllocator<U>& other) const {
+    return m_arena == other.arena();
+  }
+
+  template <class U>
+  bool operator!=(const SlabAllocator<U>& other) const {
+    return m_arena != other.arena();
+  }
+
+ private:
+  SlabArena* m_arena;
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
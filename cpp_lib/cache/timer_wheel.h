@@ -0,0 +1,222 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace cpp_lib {
+
+namespace cache {
+
+/**
+ * The wheel links of an item with an expire time, embedded in the item
+ */
+struct TimerNode {
+  TimerNode* m_timer_prev = nullptr;
+  TimerNode* m_timer_next = nullptr;
+  // Absolute expire time in milliseconds, 0 means never expired
+  int64_t m_expire_time = 0;
+
+  bool is_scheduled() const { return m_timer_prev != nullptr; }
+};
+
+/**
+ * A hierarchical timing wheel of TimerNodes. Level i has kSlotNum slots of
+ * 2^kShifts[i] milliseconds each, the levels span about 1s, 65s, 70min, 3
+ * days and 199 days. An item is placed in the lowest level whose span covers
+ * its remaining time, so schedule and deschedule are O(1). advance() walks the
+ * slots whose time has come, moves the expired items to an expired list and
+ * cascades the others to lower levels; the owner pops the expired list in
+ * batches of its own size.
+ *
+ * Not thread safe, the owner locks around it.
+ */
+class TimerWheel {
+ public:
+  static constexpr int kLevelNum = 5;
+  static constexpr int kSlotBits = 6;
+  static constexpr int64_t kSlotNum = 1 << kSlotBits;
+
+  explicit TimerWheel(int64_t now = 0) : m_time(now), m_count(0) {
+    for (int level = 0; level < kLevelNum; level++) {
+      for (int64_t slot = 0; slot < kSlotNum; slot++) {
+        init_list(&m_slots[level][slot]);
+      }
+    }
+    init_list(&m_expired);
+  }
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  /**
+   * Add a node by its m_expire_time, the node must not be scheduled
+   */
+  void schedule(TimerNode* node) {
+    link(find_slot(node->m_expire_time), node);
+    m_count++;
+  }
+
+  /**
+   * Remove a node from the wheel or the expired list, no-op if unscheduled
+   */
+  void deschedule(TimerNode* node) {
+    if (!node->is_scheduled()) {
+      return;
+    }
+    unlink(node);
+    m_count--;
+  }
+
+  /**
+   * Move the nodes with m_expire_time < now to the expired list
+   */
+  void advance(int64_t now) {
+    int64_t prev = m_time;
+    if (now <= prev) {
+      return;
+    }
+    m_time = now;
+    for (int level = 0; level < kLevelNum; level++) {
+      int64_t prev_tick = prev >> kShifts[level];
+      int64_t cur_tick = now >> kShifts[level];
+      if (prev_tick == cur_tick) {
+        // The higher levels did not move either
+        break;
+      }
+      int64_t ticks = cur_tick - prev_tick < kSlotNum ? cur_tick - prev_tick : kSlotNum;
+      for (int64_t tick = prev_tick + 1; tick <= prev_tick + ticks; tick++) {
+        expire_slot(&m_slots[level][tick & (kSlotNum - 1)], now);
+      }
+    }
+  }
+
+  /**
+   * Pop a node of the expired list, nullptr if it is empty
+   */
+  TimerNode* pop_expired() {
+    if (m_expired.m_timer_next == &m_expired) {
+      return nullptr;
+    }
+    TimerNode* node = m_expired.m_timer_next;
+    unlink(node);
+    m_count--;
+    return node;
+  }
+
+  /**
+   * Whether advance(now) or pop_expired() may have work, without touching
+   * the slots. Only true once per level-0 tick while nothing expires.
+   */
+  bool need_advance(int64_t now) const {
+    if (m_count == 0) {
+      return false;
+    }
+    return m_expired.m_timer_next != &m_expired || (now >> kShifts[0]) != (m_time >> kShifts[0]);
+  }
+
+  /**
+   * The earliest time need_advance can be true, INT64_MAX while the wheel is
+   * empty. Owners publish it to check for expired nodes without their lock.
+   */
+  int64_t next_check_time() const {
+    if (m_count == 0) {
+      return std::numeric_limits<int64_t>::max();
+    }
+    if (m_expired.m_timer_next != &m_expired) {
+      return 0;
+    }
+    return ((m_time >> kShifts[0]) + 1) << kShifts[0];
+  }
+
+  /**
+   * Drop all nodes without touching them, used when their memory is freed
+   */
+  void clear() {
+    for (int level = 0; level < kLevelNum; level++) {
+      for (int64_t slot = 0; slot < kSlotNum; slot++) {
+        init_list(&m_slots[level][slot]);
+      }
+    }
+    init_list(&m_expired);
+    m_count = 0;
+  }
+
+  size_t size() const { return m_count; }
+
+ private:
+  static constexpr int kShifts[kLevelNum] = {4, 10, 16, 22, 28};
+
+  static void init_list(TimerNode* head) {
+    head->m_timer_prev = head;
+    head->m_timer_next = head;
+  }
+
+  static void link(TimerNode* head, TimerNode* node) {
+    node->m_timer_prev = head->m_timer_prev;
+    node->m_timer_next = head;
+    head->m_timer_prev->m_timer_next = node;
+    head->m_timer_prev = node;
+  }
+
+  static void unlink(TimerNode* node) {
+    node->m_timer_prev->m_timer_next = node->m_timer_next;
+    node->m_timer_next->m_timer_prev = node->m_timer_prev;
+    node->m_timer_prev = nullptr;
+    node->m_timer_next = nullptr;
+  }
+
+  /**
+   * The slot of the lowest level which is visited before the expire time
+   * wraps around it. A time in the current level-0 tick goes to the next
+   * tick, a time beyond the top level to its last slot, from where it is
+   * cascaded again.
+   */
+  TimerNode* find_slot(int64_t expire_time) {
+    for (int level = 0; level < kLevelNum; level++) {
+      int64_t cur_tick = m_time >> kShifts[level];
+      int64_t tick = expire_time >> kShifts[level];
+      if (tick - cur_tick < kSlotNum) {
+        if (tick <= cur_tick) {
+          tick = cur_tick + 1;
+        }
+        return &m_slots[level][tick & (kSlotNum - 1)];
+      }
+    }
+    int64_t cur_tick = m_time >> kShifts[kLevelNum - 1];
+    return &m_slots[kLevelNum - 1][(cur_tick + kSlotNum - 1) & (kSlotNum - 1)];
+  }
+
+  void expire_slot(TimerNode* head, int64_t now) {
+    // Detach the slot first, a node may be cascaded back into it
+    TimerNode pending;
+    if (head->m_timer_next == head) {
+      return;
+    }
+    pending.m_timer_next = head->m_timer_next;
+    pending.m_timer_prev = head->m_timer_prev;
+    pending.m_timer_next->m_timer_prev = &pending;
+    pending.m_timer_prev->m_timer_next = &pending;
+    init_list(head);
+    while (pending.m_timer_next != &pending) {
+      TimerNode* node = pending.m_timer_next;
+      unlink(node);
+      if (node->m_expire_time < now) {
+        link(&m_expired, node);
+      } else {
+        link(find_slot(node->m_expire_time), node);
+      }
+    }
+  }
+
+  // The time of the last advance
+  int64_t m_time;
+  // Scheduled nodes, including the expired list
+  size_t m_count;
+  TimerNode m_slots[kLevelNum][kSlotNum];
+  TimerNode m_expired;
+};
+
+}  // namespace cache
+
+}  // namespace cpp_lib
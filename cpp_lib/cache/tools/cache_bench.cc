@@ -0,0 +1,219 @@
+/**
+ * Hit ratio and throughput of the cache policies on a Zipfian key trace or a
+ * trace of LRUCache::start_trace, printed as CSV:
+ *
+ *   cache_bench [--keys=N] [--zipf=S] [--scan=R] [--ops=N] [--trace=FILE] [--size=N] [--threads=N]
+ *               [--shards=N] [--policies=fifo,lru,clock,tinylfu]
+ *
+ * The Zipfian trace draws ops keys out of keys with the probability of the
+ * key of rank r proportional to 1 / r^S. A share R of the accesses are
+ * replaced by keys seen only once, like the pages of a crawler, which only
+ * an admission policy keeps out. A trace file is replayed as recorded and
+ * size counts its sampled keys, see cache_sim for the scaling.
+ *
+ * Every thread replays its share of the trace as a read-through cache: a get
+ * is a find, and an insert if it misses, a set is an insert. Shards evict
+ * inline, so eviction is part of the measured time.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpp_lib/cache/access_trace.h"
+#include "cpp_lib/cache/concurrent_scalable_cache.h"
+
+namespace {
+
+using cpp_lib::ConcurrentScalableCache;
+using cpp_lib::cache::AccessTrace;
+using cpp_lib::cache::CacheOptions;
+using cpp_lib::cache::TraceRecord;
+
+typedef ConcurrentScalableCache<uint64_t, uint64_t> BenchCache;
+
+struct Policy {
+  const char* name;
+  cpp_lib::cache::CacheEvictPolicy evict_policy;
+  cpp_lib::cache::CacheAdmitPolicy admit_policy;
+};
+
+const Policy kPolicies[] = {
+    {"fifo", cpp_lib::cache::kEvictPolicyFifo, cpp_lib::cache::kAdmitAll},
+    {"lru", cpp_lib::cache::kEvictPolicyLru, cpp_lib::cache::kAdmitAll},
+    {"clock", cpp_lib::cache::kEvictPolicyClock, cpp_lib::cache::kAdmitAll},
+    {"tinylfu", cpp_lib::cache::kEvictPolicyFifo, cpp_lib::cache::kAdmitTinyLfu},
+};
+
+struct Result {
+  double hit_ratio;
+  double ops_per_sec;
+};
+
+std::vector<std::string> split(const std::string& str) {
+  std::vector<std::string> parts;
+  size_t begin = 0;
+  while (begin <= str.size()) {
+    size_t end = str.find(',', begin);
+    if (end == std::string::npos) {
+      end = str.size();
+    }
+    if (end > begin) {
+      parts.push_back(str.substr(begin, end - begin));
+    }
+    begin = end + 1;
+  }
+  return parts;
+}
+
+bool parse_flag(const char* arg, const char* name, std::string& value) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+    return false;
+  }
+  value = arg + len + 1;
+  return true;
+}
+
+// ops gets of a Zipfian distribution over key_num keys, a scan share of them
+// of new keys. Ranks are mixed so the hot keys spread over the shards.
+std::vector<TraceRecord> zipf_trace(size_t key_num, double skew, double scan, size_t ops) {
+  std::vector<double> cdf(key_num);
+  double sum = 0;
+  for (size_t rank = 0; rank < key_num; rank++) {
+    sum += 1 / std::pow(static_cast<double>(rank + 1), skew);
+    cdf[rank] = sum;
+  }
+  std::mt19937_64 rng(42);
+  std::uniform_real_distribution<double> uniform(0, sum);
+  std::uniform_real_distribution<double> coin(0, 1);
+  std::vector<TraceRecord> records(ops);
+  uint64_t next_scan = key_num;
+  for (TraceRecord& record : records) {
+    size_t rank = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin();
+    uint64_t id = coin(rng) < scan ? next_scan++ : std::min(rank, key_num - 1);
+    record = TraceRecord{AccessTrace::mix(id), 0, cpp_lib::cache::kTraceGet, 0, 0};
+  }
+  return records;
+}
+
+Result run(const std::vector<TraceRecord>& records, const Policy& policy, size_t max_size, size_t num_shards,
+           size_t thread_num) {
+  CacheOptions options;
+  options.max_size = max_size;
+  options.num_shards = num_shards;
+  options.evict_policy = policy.evict_policy;
+  options.admit_policy = policy.admit_policy;
+  options.evict_mode = cpp_lib::cache::kEvictModeInline;
+  BenchCache cache(options);
+  std::atomic<size_t> gets{0};
+  std::atomic<size_t> hits{0};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < thread_num; t++) {
+    threads.emplace_back([&, t] {
+      size_t thread_gets = 0;
+      size_t thread_hits = 0;
+      for (size_t i = t; i < records.size(); i += thread_num) {
+        const TraceRecord& record = records[i];
+        if (record.op == cpp_lib::cache::kTraceGet) {
+          thread_gets++;
+          BenchCache::ConstAccessor ac;
+          if (cache.find(ac, record.key)) {
+            thread_hits++;
+            continue;
+          }
+        }
+        cache.insert(record.key, i);
+      }
+      gets.fetch_add(thread_gets, std::memory_order_relaxed);
+      hits.fetch_add(thread_hits, std::memory_order_relaxed);
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return Result{gets.load() == 0 ? 0 : static_cast<double>(hits.load()) / gets.load(), records.size() / seconds};
+}
+
+void usage() {
+  fprintf(stderr,
+          "usage: cache_bench [--keys=N] [--zipf=S] [--scan=R] [--ops=N] [--trace=FILE] [--size=N] [--threads=N] "
+          "[--shards=N] [--policies=fifo,lru,clock,tinylfu]\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string keys_flag = "1000000";
+  std::string zipf_flag = "0.99";
+  std::string scan_flag = "0";
+  std::string ops_flag = "10000000";
+  std::string trace_path;
+  std::string size_flag = "100000";
+  std::string threads_flag = "4";
+  std::string shards_flag = "0";
+  std::string policies_flag = "fifo,lru,clock,tinylfu";
+  for (int i = 1; i < argc; i++) {
+    if (!parse_flag(argv[i], "--keys", keys_flag) && !parse_flag(argv[i], "--zipf", zipf_flag) &&
+        !parse_flag(argv[i], "--scan", scan_flag) && !parse_flag(argv[i], "--ops", ops_flag) &&
+        !parse_flag(argv[i], "--trace", trace_path) && !parse_flag(argv[i], "--size", size_flag) &&
+        !parse_flag(argv[i], "--threads", threads_flag) && !parse_flag(argv[i], "--shards", shards_flag) &&
+        !parse_flag(argv[i], "--policies", policies_flag)) {
+      usage();
+      return 1;
+    }
+  }
+
+  std::vector<const Policy*> policies;
+  for (const std::string& name : split(policies_flag)) {
+    const Policy* found = nullptr;
+    for (const Policy& policy : kPolicies) {
+      if (name == policy.name) {
+        found = &policy;
+      }
+    }
+    if (found == nullptr) {
+      fprintf(stderr, "unknown policy %s\n", name.c_str());
+      return 1;
+    }
+    policies.push_back(found);
+  }
+
+  size_t key_num = std::max<size_t>(1, strtoull(keys_flag.c_str(), nullptr, 10));
+  double skew = strtod(zipf_flag.c_str(), nullptr);
+  double scan = strtod(scan_flag.c_str(), nullptr);
+  size_t ops = strtoull(ops_flag.c_str(), nullptr, 10);
+  size_t max_size = std::max<size_t>(1, strtoull(size_flag.c_str(), nullptr, 10));
+  size_t thread_num = std::max<size_t>(1, strtoull(threads_flag.c_str(), nullptr, 10));
+  size_t num_shards = strtoull(shards_flag.c_str(), nullptr, 10);
+
+  std::vector<TraceRecord> records;
+  if (trace_path.empty()) {
+    records = zipf_trace(key_num, skew, scan, ops);
+    fprintf(stderr, "%zu ops over %zu keys, zipf %.2f, scan %.2f, size %zu, %zu threads\n", ops, key_num, skew, scan,
+            max_size, thread_num);
+  } else {
+    AccessTrace::TraceHeader header;
+    if (!AccessTrace::load(trace_path, header, records)) {
+      fprintf(stderr, "can't read trace %s\n", trace_path.c_str());
+      return 1;
+    }
+    fprintf(stderr, "%zu records, sample rate %f, size %zu, %zu threads\n", records.size(), header.sample_rate,
+            max_size, thread_num);
+  }
+  printf("policy,hit_ratio,ops_per_sec\n");
+  for (const Policy* policy : policies) {
+    Result result = run(records, *policy, max_size, num_shards, thread_num);
+    printf("%s,%.4f,%.0f\n", policy->name, result.hit_ratio, result.ops_per_sec);
+  }
+  return 0;
+}
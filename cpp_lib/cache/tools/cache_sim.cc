@@ -0,0 +1,184 @@
+/**
+ * Replays a trace of LRUCache::start_trace against the cache policies at
+ * several sizes and prints the hit ratio curves as CSV:
+ *
+ *   cache_sim --trace=FILE [--sizes=N,N,...] [--shards=N] [--policies=lru,fifo,clock,tinylfu]
+ *
+ * Sizes are the item counts of the full cache, each defaults to a geometric
+ * range up to the estimated number of keys. The trace holds sample_rate of
+ * the keys, so the simulated caches are ConcurrentScalableCache shards of
+ * sample_rate times the size, evicting inline.
+ *
+ * A get which misses inserts the key as a read-through cache would, a set
+ * inserts it. TTLs aren't simulated, the shards expire by the wall clock.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "cpp_lib/cache/access_trace.h"
+#include "cpp_lib/cache/concurrent_scalable_cache.h"
+
+namespace {
+
+using cpp_lib::ConcurrentScalableCache;
+using cpp_lib::cache::AccessTrace;
+using cpp_lib::cache::CacheOptions;
+using cpp_lib::cache::TraceRecord;
+
+typedef ConcurrentScalableCache<uint64_t, uint8_t> SimCache;
+
+// Points of the default size range
+static constexpr int kDefaultSizeNum = 12;
+
+struct Policy {
+  const char* name;
+  cpp_lib::cache::CacheEvictPolicy evict_policy;
+  cpp_lib::cache::CacheAdmitPolicy admit_policy;
+};
+
+const Policy kPolicies[] = {
+    {"lru", cpp_lib::cache::kEvictPolicyLru, cpp_lib::cache::kAdmitAll},
+    {"fifo", cpp_lib::cache::kEvictPolicyFifo, cpp_lib::cache::kAdmitAll},
+    {"clock", cpp_lib::cache::kEvictPolicyClock, cpp_lib::cache::kAdmitAll},
+    {"tinylfu", cpp_lib::cache::kEvictPolicyFifo, cpp_lib::cache::kAdmitTinyLfu},
+};
+
+std::vector<std::string> split(const std::string& str) {
+  std::vector<std::string> parts;
+  size_t begin = 0;
+  while (begin <= str.size()) {
+    size_t end = str.find(',', begin);
+    if (end == std::string::npos) {
+      end = str.size();
+    }
+    if (end > begin) {
+      parts.push_back(str.substr(begin, end - begin));
+    }
+    begin = end + 1;
+  }
+  return parts;
+}
+
+bool parse_flag(const char* arg, const char* name, std::string& value) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+    return false;
+  }
+  value = arg + len + 1;
+  return true;
+}
+
+// Hit ratio of the gets of records on a cache of max_size sampled items
+double simulate(const std::vector<TraceRecord>& records, const Policy& policy, size_t max_size, size_t num_shards) {
+  CacheOptions options;
+  options.max_size = max_size;
+  options.num_shards = num_shards;
+  options.evict_policy = policy.evict_policy;
+  options.admit_policy = policy.admit_policy;
+  options.evict_mode = cpp_lib::cache::kEvictModeInline;
+  options.parallel_find_size = 0;
+  SimCache cache(options);
+  size_t gets = 0;
+  size_t hits = 0;
+  for (const TraceRecord& record : records) {
+    if (record.op == cpp_lib::cache::kTraceGet) {
+      gets++;
+      SimCache::ConstAccessor ac;
+      if (cache.find(ac, record.key)) {
+        hits++;
+        continue;
+      }
+    }
+    cache.insert(record.key, 0);
+  }
+  return gets == 0 ? 0 : static_cast<double>(hits) / gets;
+}
+
+void usage() {
+  fprintf(stderr, "usage: cache_sim --trace=FILE [--sizes=N,N,...] [--shards=N] [--policies=lru,fifo,clock,tinylfu]\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string trace_path;
+  std::string sizes_flag;
+  std::string shards_flag = "1";
+  std::string policies_flag = "lru,fifo,clock,tinylfu";
+  for (int i = 1; i < argc; i++) {
+    if (!parse_flag(argv[i], "--trace", trace_path) && !parse_flag(argv[i], "--sizes", sizes_flag) &&
+        !parse_flag(argv[i], "--shards", shards_flag) && !parse_flag(argv[i], "--policies", policies_flag)) {
+      usage();
+      return 1;
+    }
+  }
+  if (trace_path.empty()) {
+    usage();
+    return 1;
+  }
+
+  AccessTrace::TraceHeader header;
+  std::vector<TraceRecord> records;
+  if (!AccessTrace::load(trace_path, header, records)) {
+    fprintf(stderr, "can't read trace %s\n", trace_path.c_str());
+    return 1;
+  }
+  if (header.sample_rate <= 0 || header.sample_rate > 1) {
+    fprintf(stderr, "bad sample rate %f\n", header.sample_rate);
+    return 1;
+  }
+
+  std::vector<const Policy*> policies;
+  for (const std::string& name : split(policies_flag)) {
+    const Policy* found = nullptr;
+    for (const Policy& policy : kPolicies) {
+      if (name == policy.name) {
+        found = &policy;
+      }
+    }
+    if (found == nullptr) {
+      fprintf(stderr, "unknown policy %s\n", name.c_str());
+      return 1;
+    }
+    policies.push_back(found);
+  }
+
+  std::vector<size_t> sizes;
+  for (const std::string& size : split(sizes_flag)) {
+    sizes.push_back(strtoull(size.c_str(), nullptr, 10));
+  }
+  if (sizes.empty()) {
+    std::unordered_set<uint64_t> keys;
+    for (const TraceRecord& record : records) {
+      keys.insert(record.key);
+    }
+    // Halving down from the estimated number of keys of the full cache
+    size_t size = static_cast<size_t>(keys.size() / header.sample_rate);
+    for (int i = 0; i < kDefaultSizeNum && size > 0; i++, size /= 2) {
+      sizes.insert(sizes.begin(), size);
+    }
+  }
+  size_t num_shards = std::max<size_t>(1, strtoull(shards_flag.c_str(), nullptr, 10));
+
+  fprintf(stderr, "%zu records, sample rate %f\n", records.size(), header.sample_rate);
+  printf("size");
+  for (const Policy* policy : policies) {
+    printf(",%s", policy->name);
+  }
+  printf("\n");
+  for (size_t size : sizes) {
+    // At least one item per shard, the smallest sizes are the least accurate
+    size_t max_size = std::max(num_shards, static_cast<size_t>(size * header.sample_rate + 0.5));
+    printf("%zu", size);
+    for (const Policy* policy : policies) {
+      printf(",%.4f", simulate(records, *policy, max_size, num_shards));
+    }
+    printf("\n");
+  }
+  return 0;
+}
@@ -0,0 +1,145 @@
+/**
+ * Lookup and insert throughput of the hash map backends of the cache shards
+ * at several thread counts, printed as CSV:
+ *
+ *   map_bench [--keys=N] [--ops=N] [--threads=N,N,...] [--backends=tbb,flat]
+ *
+ * lookup finds uniformly random keys of a map holding keys keys, ops of them
+ * split over the threads. insert fills an empty map with keys keys, each
+ * thread its own range. Both take the element lock like the shards do, a
+ * shared one to look up and an exclusive one to insert.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpp_lib/cache/map_backend.h"
+
+namespace {
+
+typedef tbb::tbb_hash_compare<uint64_t> BenchHash;
+typedef std::allocator<std::pair<const uint64_t, uint64_t>> BenchAllocator;
+
+std::vector<std::string> split(const std::string& str) {
+  std::vector<std::string> parts;
+  size_t begin = 0;
+  while (begin <= str.size()) {
+    size_t end = str.find(',', begin);
+    if (end == std::string::npos) {
+      end = str.size();
+    }
+    if (end > begin) {
+      parts.push_back(str.substr(begin, end - begin));
+    }
+    begin = end + 1;
+  }
+  return parts;
+}
+
+bool parse_flag(const char* arg, const char* name, std::string& value) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+    return false;
+  }
+  value = arg + len + 1;
+  return true;
+}
+
+// Run func(t) on thread_num threads, returns the seconds until all finished
+template <class Func>
+double run_threads(size_t thread_num, const Func& func) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < thread_num; t++) {
+    threads.emplace_back([&func, t] { func(t); });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <class TBackend>
+void bench(const char* name, size_t key_num, size_t ops, const std::vector<size_t>& thread_nums) {
+  typedef typename TBackend::template Map<uint64_t, uint64_t, BenchHash, BenchAllocator> Map;
+  for (size_t thread_num : thread_nums) {
+    // Fresh maps per run, so every thread count starts from the same state
+    std::unique_ptr<Map> map(new Map());
+    double seconds = run_threads(thread_num, [&](size_t t) {
+      for (uint64_t key = t; key < key_num; key += thread_num) {
+        typename Map::accessor ac;
+        map->insert(ac, key);
+        ac->second = key;
+      }
+    });
+    printf("%s,insert,%zu,%.0f\n", name, thread_num, key_num / seconds);
+
+    size_t thread_ops = ops / thread_num;
+    std::vector<size_t> found(thread_num, 0);
+    seconds = run_threads(thread_num, [&](size_t t) {
+      uint64_t state = t + 1;
+      size_t hits = 0;
+      for (size_t i = 0; i < thread_ops; i++) {
+        // xorshift64, cheap enough not to hide the lookup
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        typename Map::const_accessor ac;
+        hits += map->find(ac, state % key_num) ? 1 : 0;
+      }
+      found[t] = hits;
+    });
+    size_t hits = 0;
+    for (size_t thread_hits : found) {
+      hits += thread_hits;
+    }
+    if (hits != thread_ops * thread_num) {
+      fprintf(stderr, "%s found %zu of %zu keys\n", name, hits, thread_ops * thread_num);
+    }
+    printf("%s,lookup,%zu,%.0f\n", name, thread_num, thread_ops * thread_num / seconds);
+  }
+}
+
+void usage() { fprintf(stderr, "usage: map_bench [--keys=N] [--ops=N] [--threads=N,N,...] [--backends=tbb,flat]\n"); }
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string keys_flag = "1000000";
+  std::string ops_flag = "10000000";
+  std::string threads_flag = "1,2,4,8,16,32,64";
+  std::string backends_flag = "tbb,flat";
+  for (int i = 1; i < argc; i++) {
+    if (!parse_flag(argv[i], "--keys", keys_flag) && !parse_flag(argv[i], "--ops", ops_flag) &&
+        !parse_flag(argv[i], "--threads", threads_flag) && !parse_flag(argv[i], "--backends", backends_flag)) {
+      usage();
+      return 1;
+    }
+  }
+  size_t key_num = std::max<size_t>(1, strtoull(keys_flag.c_str(), nullptr, 10));
+  size_t ops = strtoull(ops_flag.c_str(), nullptr, 10);
+  std::vector<size_t> thread_nums;
+  for (const std::string& thread_num : split(threads_flag)) {
+    thread_nums.push_back(std::max<size_t>(1, strtoull(thread_num.c_str(), nullptr, 10)));
+  }
+
+  fprintf(stderr, "%zu keys, %zu lookups\n", key_num, ops);
+  printf("backend,op,threads,ops_per_sec\n");
+  for (const std::string& backend : split(backends_flag)) {
+    if (backend == "tbb") {
+      bench<cpp_lib::cache::TbbMapBackend>("tbb", key_num, ops, thread_nums);
+    } else if (backend == "flat") {
+      bench<cpp_lib::cache::FlatMapBackend>("flat", key_num, ops, thread_nums);
+    } else {
+      fprintf(stderr, "unknown backend %s\n", backend.c_str());
+      return 1;
+    }
+  }
+  return 0;
+}
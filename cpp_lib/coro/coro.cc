@@ -1,48 +1,663 @@
 #include "cpp_lib/coro/coro.h"
 
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <queue>
 #include <vector>
 
+#include "cpp_lib/util/singleton.h"
+
 namespace cpp_lib {
-std::shared_ptr<Coro> StartCoroFunc(const AnyFunc& func) {
+
+struct Coro::Context {
+  ucontext_t uc;
+  char* stack = nullptr;
+  bool guarded = false;
+  int64_t wake_us = 0;
+};
+
+Coro::~Coro() { delete context; }
+
+namespace {
+CoroOptions g_coro_options;
+std::atomic<bool> g_coro_started{false};
+std::atomic<uint64_t> g_coro_id{0};
+
+thread_local Coro* tls_current_coro = nullptr;
+
+int64_t SteadyMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+size_t ConfiguredWorkerNum() {
+  size_t num = g_coro_options.worker_num;
+  if (num == 0) {
+    num = std::thread::hardware_concurrency();
+  }
+  return num == 0 ? 1 : num;
+}
+
+// 协程栈池
+// 开启保护页时每个栈单独映射，栈底部有一个PROT_NONE的页用于捕获栈溢出，
+// 每个栈占用两个VMA，受vm.max_map_count限制(默认65530)；带保护页的栈超过
+// kMaxGuardedStacks、映射失败或关闭保护页时，从一次映射多个栈的大块中切分，
+// 切分出的栈只回收到池中不再释放
+class StackPool {
+ public:
+  static constexpr size_t kMaxCachedStacks = 1024;
+  static constexpr size_t kStacksPerChunk = 64;
+  static constexpr size_t kMaxGuardedStacks = 16 * 1024;
+
+  StackPool(size_t stack_size, bool guard_page) : page_size_(sysconf(_SC_PAGESIZE)), guard_page_(guard_page) {
+    stack_size_ = (stack_size + page_size_ - 1) / page_size_ * page_size_;
+  }
+
+  // 返回栈的最低地址，guarded表示是否为带保护页的独立映射
+  char* Allocate(bool& guarded) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!chunk_stacks_.empty()) {
+        guarded = false;
+        char* stack = chunk_stacks_.back();
+        chunk_stacks_.pop_back();
+        return stack;
+      }
+      if (guard_page_ && !guarded_stacks_.empty()) {
+        guarded = true;
+        char* stack = guarded_stacks_.back();
+        guarded_stacks_.pop_back();
+        return stack;
+      }
+    }
+    if (guard_page_ && guarded_num_.load(std::memory_order_relaxed) < kMaxGuardedStacks) {
+      void* region =
+          mmap(nullptr, page_size_ + stack_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (region != MAP_FAILED) {
+        if (mprotect(region, page_size_, PROT_NONE) == 0) {
+          guarded = true;
+          guarded_num_.fetch_add(1, std::memory_order_relaxed);
+          return static_cast<char*>(region) + page_size_;
+        }
+        munmap(region, page_size_ + stack_size_);
+      }
+    }
+    guarded = false;
+    return AllocateFromChunk();
+  }
+
+  void Release(char* stack, bool guarded) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!guarded) {
+      chunk_stacks_.push_back(stack);
+      return;
+    }
+    if (guarded_stacks_.size() < kMaxCachedStacks) {
+      guarded_stacks_.push_back(stack);
+      return;
+    }
+    munmap(stack - page_size_, page_size_ + stack_size_);
+    guarded_num_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  size_t StackSize() const { return stack_size_; }
+
+ private:
+  char* AllocateFromChunk() {
+    void* region =
+        mmap(nullptr, stack_size_ * kStacksPerChunk, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+      return nullptr;
+    }
+    char* base = static_cast<char*>(region);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 1; i < kStacksPerChunk; i++) {
+      chunk_stacks_.push_back(base + i * stack_size_);
+    }
+    return base;
+  }
+
+  size_t page_size_;
+  size_t stack_size_;
+  bool guard_page_;
+  std::atomic<size_t> guarded_num_{0};
+  std::mutex mutex_;
+  std::vector<char*> guarded_stacks_;
+  std::vector<char*> chunk_stacks_;
+};
+}  // namespace
+
+// CoroScheduler
+// M:N有栈协程调度器，每个worker线程一个本地运行队列和定时器堆
+// worker从自己队列尾部取协程(LIFO)，从其他worker队列头部窃取协程(FIFO)
+// 协程挂起后由调度栈执行切换后的动作(重新入队、进入定时器、挂到join目标上)，
+// 保证协程在完全切出之前不会被其他worker恢复
+class CoroScheduler : public Singleton<CoroScheduler, CreateUsingNew, NoDestroyLifetime> {
+ public:
+  enum SwitchAction {
+    kNoneAction = 0,
+    kYieldAction,
+    kSleepAction,
+    kJoinAction,
+    kFinishAction,
+  };
+
+  CoroScheduler() : stack_pool_(g_coro_options.stack_size, g_coro_options.guard_page) {
+    size_t num = ConfiguredWorkerNum();
+    for (size_t i = 0; i < num; i++) {
+      workers_.emplace_back(new Worker);
+      workers_.back()->index = i;
+    }
+    for (size_t i = 0; i < num; i++) {
+      Worker* worker = workers_[i].get();
+      std::thread([this, worker] { this->WorkerLoop(worker); }).detach();
+    }
+  }
+
+  // 提交协程，worker线程提交到自己的队列，外部线程轮询分发
+  void Submit(const CoroPtr& coro) {
+    Worker* worker = CurrentWorker();
+    if (worker == nullptr) {
+      worker = workers_[next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size()].get();
+    }
+    Push(worker, coro, false);
+  }
+
+  // 延迟提交，worker线程直接放入自己的定时器堆，外部线程放入某个worker的待接收列表
+  void SubmitDelayed(const CoroPtr& coro, int64_t wake_us) {
+    Worker* worker = CurrentWorker();
+    if (worker != nullptr) {
+      worker->timers.push(TimerEntry{wake_us, coro});
+      return;
+    }
+    worker = workers_[next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size()].get();
+    {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      worker->incoming_timers.push_back(TimerEntry{wake_us, coro});
+      worker->has_incoming_timers.store(true);
+    }
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    idle_cond_.notify_all();
+  }
+
+  // 当前线程是否运行在协程中
+  bool InCoroutine() {
+    Worker* worker = CurrentWorker();
+    return worker != nullptr && worker->current != nullptr;
+  }
+
+  // 挂起当前协程，只能在协程中调用
+  void Suspend(SwitchAction action, const CoroPtr& target = nullptr) {
+    Worker* worker = CurrentWorker();
+    Coro* self = worker->current.get();
+    worker->action = action;
+    worker->action_target = target;
+    swapcontext(&self->context->uc, &worker->sched_ctx);
+  }
+
+  // 在当前线程(可以是任意线程)执行一个排队中的无栈任务，没有则返回false
+  // 有栈协程只能由worker恢复，查找时跳过
+  bool RunStackless() {
+    if (pending_.load(std::memory_order_acquire) == 0) {
+      return false;
+    }
+    Worker* self = CurrentWorker();
+    size_t num = workers_.size();
+    size_t start = self != nullptr ? self->index : next_worker_.load(std::memory_order_relaxed) % num;
+    CoroPtr coro;
+    for (size_t i = 0; !coro && i < num; i++) {
+      Worker* victim = workers_[(start + i) % num].get();
+      std::lock_guard<std::mutex> lock(victim->mutex);
+      if (victim == self) {
+        for (auto it = victim->tasks.rbegin(); it != victim->tasks.rend(); ++it) {
+          if ((*it)->stackless) {
+            coro = std::move(*it);
+            victim->tasks.erase(std::next(it).base());
+            break;
+          }
+        }
+      } else {
+        for (auto it = victim->tasks.begin(); it != victim->tasks.end(); ++it) {
+          if ((*it)->stackless) {
+            coro = std::move(*it);
+            victim->tasks.erase(it);
+            break;
+          }
+        }
+      }
+    }
+    if (!coro) {
+      return false;
+    }
+    pending_.fetch_sub(1, std::memory_order_acq_rel);
+    RunStacklessCoro(self, coro);
+    return true;
+  }
+
+  size_t WorkerNum() const { return workers_.size(); }
+
+ private:
+  struct TimerEntry {
+    int64_t wake_us;
+    CoroPtr coro;
+
+    bool operator>(const TimerEntry& other) const { return wake_us > other.wake_us; }
+  };
+
+  struct Worker {
+    size_t index = 0;
+    std::mutex mutex;
+    std::deque<CoroPtr> tasks;
+
+    // 以下字段只由worker线程自身访问
+    ucontext_t sched_ctx;
+    CoroPtr current;
+    SwitchAction action = kNoneAction;
+    CoroPtr action_target;
+    std::priority_queue<TimerEntry, std::vector<TimerEntry>, std::greater<TimerEntry>> timers;
+
+    // 外部线程提交的定时任务，由mutex保护
+    std::vector<TimerEntry> incoming_timers;
+    std::atomic<bool> has_incoming_timers{false};
+  };
+
+  static thread_local Worker* tls_worker;
+
+  // 协程可能在不同worker间迁移，禁止内联避免编译器缓存线程局部变量地址
+  __attribute__((noinline)) static Worker* CurrentWorker() { return tls_worker; }
+
+  static void Entry() {
+    Coro* self = CurrentWorker()->current.get();
+    self->func();
+    self->func = nullptr;
+    GetInstance()->Suspend(kFinishAction);
+  }
+
+  void Push(Worker* worker, const CoroPtr& coro, bool front) {
+    {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      if (front) {
+        worker->tasks.push_front(coro);
+      } else {
+        worker->tasks.push_back(coro);
+      }
+    }
+    // seq_cst pairs with the sleepers_/pending_ check in WorkerLoop
+    pending_.fetch_add(1);
+    if (sleepers_.load() > 0) {
+      std::lock_guard<std::mutex> lock(idle_mutex_);
+      idle_cond_.notify_all();
+    }
+  }
+
+  bool Pop(Worker* self, CoroPtr& coro) {
+    if (pending_.load(std::memory_order_acquire) == 0) {
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock(self->mutex);
+      if (!self->tasks.empty()) {
+        coro = std::move(self->tasks.back());
+        self->tasks.pop_back();
+      }
+    }
+    size_t num = workers_.size();
+    for (size_t i = 1; !coro && i < num; i++) {
+      Worker* victim = workers_[(self->index + i) % num].get();
+      std::lock_guard<std::mutex> lock(victim->mutex);
+      if (!victim->tasks.empty()) {
+        coro = std::move(victim->tasks.front());
+        victim->tasks.pop_front();
+      }
+    }
+    if (!coro) {
+      return false;
+    }
+    pending_.fetch_sub(1, std::memory_order_acq_rel);
+    return true;
+  }
+
+  void PollTimers(Worker* worker) {
+    if (worker->has_incoming_timers.load()) {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      for (auto& entry : worker->incoming_timers) {
+        worker->timers.push(std::move(entry));
+      }
+      worker->incoming_timers.clear();
+      worker->has_incoming_timers.store(false);
+    }
+    if (worker->timers.empty()) {
+      return;
+    }
+    int64_t now = SteadyMicros();
+    while (!worker->timers.empty() && worker->timers.top().wake_us <= now) {
+      Push(worker, worker->timers.top().coro, false);
+      worker->timers.pop();
+    }
+  }
+
+  void WorkerLoop(Worker* worker) {
+    tls_worker = worker;
+    while (true) {
+      PollTimers(worker);
+      CoroPtr coro;
+      if (Pop(worker, coro)) {
+        Resume(worker, std::move(coro));
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(idle_mutex_);
+      sleepers_.fetch_add(1);
+      auto ready = [this, worker] { return pending_.load() > 0 || worker->has_incoming_timers.load(); };
+      if (worker->timers.empty()) {
+        idle_cond_.wait(lock, ready);
+      } else {
+        std::chrono::steady_clock::time_point wake_tp(std::chrono::microseconds(worker->timers.top().wake_us));
+        idle_cond_.wait_until(lock, wake_tp, ready);
+      }
+      sleepers_.fetch_sub(1);
+    }
+  }
+
+  void RunStacklessCoro(Worker* worker, const CoroPtr& coro) {
+    Coro* prev = tls_current_coro;
+    tls_current_coro = coro.get();
+    coro->func();
+    coro->func = nullptr;
+    tls_current_coro = prev;
+    Finish(worker, coro);
+  }
+
+  void Resume(Worker* worker, CoroPtr coro) {
+    if (coro->stackless) {
+      RunStacklessCoro(worker, coro);
+      return;
+    }
+    if (coro->context == nullptr) {
+      Coro::Context* context = new Coro::Context;
+      context->stack = stack_pool_.Allocate(context->guarded);
+      if (context->stack == nullptr) {
+        fprintf(stderr, "coro stack allocation failed\n");
+        abort();
+      }
+      getcontext(&context->uc);
+      context->uc.uc_stack.ss_sp = context->stack;
+      context->uc.uc_stack.ss_size = stack_pool_.StackSize();
+      context->uc.uc_link = nullptr;
+      makecontext(&context->uc, &CoroScheduler::Entry, 0);
+      coro->context = context;
+    }
+    worker->current = std::move(coro);
+    tls_current_coro = worker->current.get();
+    swapcontext(&worker->sched_ctx, &worker->current->context->uc);
+    tls_current_coro = nullptr;
+
+    // 协程已经切出，执行切换后的动作
+    CoroPtr self = std::move(worker->current);
+    CoroPtr target = std::move(worker->action_target);
+    SwitchAction action = worker->action;
+    worker->action = kNoneAction;
+    switch (action) {
+      case kYieldAction:
+        Push(worker, self, true);
+        break;
+      case kSleepAction:
+        worker->timers.push(TimerEntry{self->context->wake_us, self});
+        break;
+      case kJoinAction: {
+        std::unique_lock<std::mutex> lock(target->mutex);
+        if (target->done) {
+          lock.unlock();
+          Push(worker, self, false);
+        } else {
+          target->waiters.push_back(self);
+        }
+        break;
+      }
+      case kFinishAction:
+        Finish(worker, self);
+        break;
+      default:
+        break;
+    }
+  }
+
+  void Finish(Worker* worker, const CoroPtr& coro) {
+    if (coro->context != nullptr) {
+      stack_pool_.Release(coro->context->stack, coro->context->guarded);
+      delete coro->context;
+      coro->context = nullptr;
+    }
+
+    std::vector<CoroPtr> waiters;
+    {
+      std::lock_guard<std::mutex> lock(coro->mutex);
+      coro->done = true;
+      waiters.swap(coro->waiters);
+    }
+    coro->cond.notify_all();
+    for (const auto& waiter : waiters) {
+      if (worker != nullptr) {
+        Push(worker, waiter, false);
+      } else {
+        Submit(waiter);
+      }
+    }
+  }
+
+  StackPool stack_pool_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<size_t> next_worker_{0};
+  std::atomic<size_t> pending_{0};
+  std::atomic<size_t> sleepers_{0};
+  std::mutex idle_mutex_;
+  std::condition_variable idle_cond_;
+};
+
+thread_local CoroScheduler::Worker* CoroScheduler::tls_worker = nullptr;
+
+bool InitCoro(const CoroOptions& options) {
+  if (g_coro_started.load()) {
+    return false;
+  }
+  g_coro_options = options;
+  return true;
+}
+
+static void StartCoroThread(const CoroPtr& coro, uint64_t delay_micro_secs = 0) {
+  std::thread([coro, delay_micro_secs] {
+    if (delay_micro_secs > 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(delay_micro_secs));
+    }
+    tls_current_coro = coro.get();
+    coro->func();
+    coro->func = nullptr;
+    tls_current_coro = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(coro->mutex);
+      coro->done = true;
+    }
+    coro->cond.notify_all();
+  }).detach();
+}
+
+static CoroPtr NewCoro(const AnyFunc& func, bool stackless) {
+  g_coro_started.store(true);
   std::shared_ptr<Coro> coro(new Coro);
-  coro->thread = new std::thread(func);
+  coro->id = g_coro_id.fetch_add(1, std::memory_order_relaxed) + 1;
+  coro->func = func;
+  coro->stackless = stackless;
+  return coro;
+}
+
+std::shared_ptr<Coro> StartCoroFunc(const AnyFunc& func) {
+  CoroPtr coro = NewCoro(func, false);
+  if (g_coro_options.mode == kCoroThreadMode) {
+    StartCoroThread(coro);
+  } else {
+    CoroScheduler::GetInstance()->Submit(coro);
+  }
   return coro;
 }
 
+CoroPtr PostFunc(const AnyFunc& func) {
+  CoroPtr coro = NewCoro(func, true);
+  if (g_coro_options.mode == kCoroThreadMode) {
+    StartCoroThread(coro);
+  } else {
+    CoroScheduler::GetInstance()->Submit(coro);
+  }
+  return coro;
+}
+
+CoroPtr PostDelayedFunc(const AnyFunc& func, uint64_t micro_secs) {
+  CoroPtr coro = NewCoro(func, true);
+  if (g_coro_options.mode == kCoroThreadMode) {
+    StartCoroThread(coro, micro_secs);
+  } else {
+    CoroScheduler::GetInstance()->SubmitDelayed(coro, SteadyMicros() + static_cast<int64_t>(micro_secs));
+  }
+  return coro;
+}
+
+size_t ParallelGrainSize(size_t num, size_t grain_size) {
+  if (grain_size > 0) {
+    return grain_size;
+  }
+  // About 8 pieces per worker leaves enough slack for stealing to balance
+  // uneven pieces without paying task overhead for tiny ones
+  size_t pieces = CoroWorkerNum() * 8;
+  size_t grain = (num + pieces - 1) / pieces;
+  return grain == 0 ? 1 : grain;
+}
+
+namespace {
+struct ParallelForState {
+  explicit ParallelForState(const ParallelFunc& f, size_t g) : func(f), grain(g) {}
+
+  // The last decrement happens under the mutex, so the caller cannot see
+  // zero and destroy the state while it is still being notified
+  void Done() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      cond.notify_all();
+    }
+  }
+
+  const ParallelFunc& func;
+  size_t grain;
+  std::atomic<size_t> pending{0};
+  std::mutex mutex;
+  std::condition_variable cond;
+};
+
+// 递归二分区间，右半部分作为无栈任务提交给调度器供其他worker窃取，
+// 当前线程继续处理左半部分
+void ParallelRun(ParallelForState* state, size_t first, size_t last) {
+  while (last - first > state->grain) {
+    size_t mid = first + (last - first) / 2;
+    state->pending.fetch_add(1, std::memory_order_relaxed);
+    size_t right_last = last;
+    PostFunc([state, mid, right_last] {
+      ParallelRun(state, mid, right_last);
+      state->Done();
+    });
+    last = mid;
+  }
+  state->func(first, last);
+}
+}  // namespace
+
 void ParallelFor(size_t first, size_t last, size_t partition_size, const ParallelFunc& func) {
-  if ((last - first) < partition_size) {
+  if (last <= first) {
+    return;
+  }
+  size_t grain = ParallelGrainSize(last - first, partition_size);
+  if ((last - first) <= grain || g_coro_options.mode == kCoroThreadMode) {
+    if (g_coro_options.mode == kCoroThreadMode) {
+      // Keep the debugging mode free of the worker pool
+      std::vector<CoroPtr> tasks;
+      for (size_t i = first; i < last; i += grain) {
+        size_t partition_end = std::min(i + grain, last);
+        tasks.push_back(StartCoroFunc([&func, i, partition_end]() { func(i, partition_end); }));
+      }
+      for (auto& task : tasks) {
+        CoroJoin(task);
+      }
+      return;
+    }
     func(first, last);
     return;
   }
 
-  std::vector<CoroPtr> tasks;
-  size_t i = first;
-  while (i < last) {
-    size_t partition_start = i;
-    size_t partition_end = partition_start + partition_size;
-    if (partition_end > last) {
-      partition_end = last;
+  // The caller runs the leftmost pieces itself, then helps with whatever is
+  // still queued and finally waits for the pieces running elsewhere
+  ParallelForState state(func, grain);
+  ParallelRun(&state, first, last);
+  CoroScheduler* scheduler = CoroScheduler::GetInstance();
+  while (state.pending.load(std::memory_order_acquire) > 0) {
+    if (scheduler->RunStackless()) {
+      continue;
     }
-    auto partition_func = [&func, partition_start, partition_end]() { func(partition_start, partition_end); };
-    tasks.push_back(StartCoroFunc(partition_func));
-    i = partition_end;
-  }
-  for (auto cid : tasks) {
-    CoroJoin(cid);
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.cond.wait_for(lock, std::chrono::milliseconds(1),
+                        [&state] { return state.pending.load(std::memory_order_acquire) == 0; });
   }
+  std::lock_guard<std::mutex> lock(state.mutex);
 }
 
-void CoroYield() { std::this_thread::yield(); }
+// A stackless task run inline by a coroutine, e.g. a piece of its
+// ParallelFor, is not one: it has no context to suspend and blocks instead
+static bool InStackfulCoroutine() {
+  return g_coro_options.mode == kCoroStackfulMode && g_coro_started.load() &&
+         CoroScheduler::GetInstance()->InCoroutine() && tls_current_coro != nullptr &&
+         !tls_current_coro->stackless;
+}
+
+void CoroYield() {
+  if (InStackfulCoroutine()) {
+    CoroScheduler::GetInstance()->Suspend(CoroScheduler::kYieldAction);
+    return;
+  }
+  std::this_thread::yield();
+}
 
 void CoroJoin(CoroPtr coro) {
   if (!coro) {
     return;
   }
-  if (coro->thread != nullptr) {
-    coro->thread->join();
+  if (InStackfulCoroutine()) {
+    {
+      std::lock_guard<std::mutex> lock(coro->mutex);
+      if (coro->done) {
+        return;
+      }
+    }
+    CoroScheduler::GetInstance()->Suspend(CoroScheduler::kJoinAction, coro);
+    return;
+  }
+  std::unique_lock<std::mutex> lock(coro->mutex);
+  coro->cond.wait(lock, [&coro] { return coro->done; });
+}
+
+void CoroSleep(uint64_t micro_secs) {
+  if (InStackfulCoroutine()) {
+    Coro* self = tls_current_coro;
+    self->context->wake_us = SteadyMicros() + static_cast<int64_t>(micro_secs);
+    CoroScheduler::GetInstance()->Suspend(CoroScheduler::kSleepAction);
+    return;
   }
+  std::this_thread::sleep_for(std::chrono::microseconds(micro_secs));
 }
 
-void CoroSleep(uint64_t micro_secs) { std::this_thread::sleep_for(std::chrono::microseconds(micro_secs)); }
-}
\ No newline at end of file
+uint64_t CoroSelfId() { return tls_current_coro != nullptr ? tls_current_coro->id : 0; }
+
+size_t CoroWorkerNum() { return ConfiguredWorkerNum(); }
+}  // namespace cpp_lib
@@ -1,30 +1,151 @@
 #pragma once
 
+#include <condition_variable>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <thread>
+#include <type_traits>
+#include <vector>
 
 namespace cpp_lib {
 
+enum CoroMode {
+  kCoroStackfulMode = 0,  // M:N stackful coroutines on a per-core worker pool
+  kCoroThreadMode = 1,    // one OS thread per coro, for debugging
+};
+
+struct CoroOptions {
+  CoroMode mode = kCoroStackfulMode;
+  // Usable stack size of each coroutine, a guard page is added below it
+  size_t stack_size = 128 * 1024;
+  // Guarded stacks cost two mappings each and are bounded by vm.max_map_count,
+  // disable it to carve unguarded stacks from larger chunks
+  bool guard_page = true;
+  // Number of worker threads, 0 means hardware concurrency
+  size_t worker_num = 0;
+};
+
+// Configure the coro runtime. Must be called before the first StartCoroFunc,
+// returns false if the runtime is already running.
+bool InitCoro(const CoroOptions& options);
+
+/**
+ * A task started by StartCoroFunc. In stackful mode every coro owns a pooled,
+ * guarded stack and runs on one of the worker threads; CoroYield, CoroSleep
+ * and CoroJoin suspend the coroutine instead of blocking the worker. Idle
+ * workers steal runnable coroutines from the others.
+ */
 struct Coro {
-  std::thread* thread = nullptr;
-  ~Coro() {
-    if (thread && thread->joinable()) {
-      thread->detach();
-    }
-    delete thread;
-  }
+  struct Context;
+
+  ~Coro();
+
+  uint64_t id = 0;
+  std::function<void(void)> func;
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool done = false;
+  // Run on the worker stack without switching, see PostFunc
+  bool stackless = false;
+  // Coroutines parked in CoroJoin on this coro
+  std::vector<std::shared_ptr<Coro>> waiters;
+
+  Context* context = nullptr;
 };
 
 using CoroPtr = std::shared_ptr<Coro>;
 using AnyFunc = std::function<void(void)>;
 CoroPtr StartCoroFunc(const AnyFunc& func);
 
+// Run func on the worker pool directly on the worker stack. It is cheaper
+// than StartCoroFunc but func must not suspend: CoroYield, CoroSleep and
+// CoroJoin block the worker thread there. Used to resume stackless tasks.
+CoroPtr PostFunc(const AnyFunc& func);
+
+// Same as PostFunc, but func is run after micro_secs.
+CoroPtr PostDelayedFunc(const AnyFunc& func, uint64_t micro_secs);
+
 using ParallelFunc = std::function<void(size_t, size_t)>;
+
+/**
+ * Call func on disjoint sub ranges covering [first, last) on the worker pool.
+ * The range is split recursively in halves until pieces are no larger than
+ * partition_size; the right halves are queued for idle workers to steal while
+ * the calling thread keeps working on the left ones, so no thread is created
+ * per partition. partition_size 0 picks a grain size from the range length
+ * and the worker number.
+ *
+ * Called from a coroutine, pieces may run as stackless tasks on its worker
+ * while it waits, so func should not suspend: CoroYield, CoroSleep and
+ * CoroJoin block the thread in those pieces like in PostFunc.
+ */
 void ParallelFor(size_t first, size_t last, size_t partition_size, const ParallelFunc& func);
+
+// Grain size ParallelFor uses for num elements
+size_t ParallelGrainSize(size_t num, size_t grain_size);
+
+/**
+ * Reduce [first, last) in parallel. range_func(begin, end, identity) returns
+ * the partial result of a piece, the partial results are combined with
+ * reduce_func in range order, so reduce_func only needs to be associative.
+ */
+template <class T, class RangeFunc, class ReduceFunc>
+T ParallelReduce(size_t first, size_t last, size_t grain_size, const T& identity, const RangeFunc& range_func,
+                 const ReduceFunc& reduce_func) {
+  if (last <= first) {
+    return identity;
+  }
+  size_t grain = ParallelGrainSize(last - first, grain_size);
+  size_t pieces = (last - first + grain - 1) / grain;
+  // Wrapped so that pieces write distinct objects, std::vector<bool> packs
+  // its elements into shared words
+  struct Partial {
+    T value;
+  };
+  std::vector<Partial> partials(pieces, Partial{identity});
+  ParallelFor(0, pieces, 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      size_t piece_first = first + i * grain;
+      size_t piece_last = piece_first + grain < last ? piece_first + grain : last;
+      partials[i].value = range_func(piece_first, piece_last, identity);
+    }
+  });
+  T result = identity;
+  for (auto& partial : partials) {
+    result = reduce_func(result, partial.value);
+  }
+  return result;
+}
+
+/**
+ * output[i] = func(input[i]) computed in parallel, output is resized to the
+ * input size. TOut can't be bool: the pieces would race on the shared words
+ * of std::vector<bool>, use char instead.
+ */
+template <class TIn, class TOut, class Func>
+void ParallelTransform(const std::vector<TIn>& input, std::vector<TOut>& output, const Func& func,
+                       size_t grain_size = 0) {
+  static_assert(!std::is_same<TOut, bool>::value, "std::vector<bool> can't be written in parallel");
+  output.resize(input.size());
+  ParallelFor(0, input.size(), grain_size, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      output[i] = func(input[i]);
+    }
+  });
+}
+
+// Wait until the coro finished. Inside a coroutine the caller is parked
+// until the coro is done, other threads block.
 void CoroJoin(CoroPtr coro);
 void CoroSleep(uint64_t micro_secs);
 void CoroYield();
+
+// Id of the running coro, 0 if the caller is not running inside one.
 uint64_t CoroSelfId();
 
-}  // namespace cpp_lib
\ No newline at end of file
+// Number of worker threads of the scheduler
+size_t CoroWorkerNum();
+
+}  // namespace cpp_lib
@@ -0,0 +1,480 @@
+#pragma once
+
+#if !defined(__cpp_impl_coroutine)
+#error "cpp_lib/coro/task.h requires C++20 coroutines, build with --config=cxx20"
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "cpp_lib/coro/coro.h"
+
+namespace cpp_lib {
+
+/**
+ * Task<T> is a lazily started, stackless C++20 coroutine. Its body starts
+ * when it is co_awaited (or handed to SyncWait, WhenAll, WhenAny or Spawn)
+ * and completion resumes the awaiting coroutine by symmetric transfer.
+ * Resumptions after Schedule, CoroSleepAsync and the combinators are posted
+ * to the same worker pool that StartCoroFunc uses, so one worker thread
+ * multiplexes any number of in-flight tasks without a per-task stack.
+ *
+ * T must be move constructible. An exception escaping the body is rethrown
+ * to the awaiter.
+ */
+template <class T = void>
+class Task;
+
+namespace internal {
+
+struct TaskPromiseBase {
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <class TPromise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<TPromise> handle) noexcept {
+      std::coroutine_handle<> continuation = handle.promise().continuation;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() { exception = std::current_exception(); }
+
+  std::coroutine_handle<> continuation;
+  std::exception_ptr exception;
+};
+
+template <class T>
+struct TaskPromise : public TaskPromiseBase {
+  Task<T> get_return_object();
+
+  template <class U>
+  void return_value(U&& value) {
+    result.emplace(std::forward<U>(value));
+  }
+
+  T take_result() {
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+    return std::move(*result);
+  }
+
+  std::optional<T> result;
+};
+
+template <>
+struct TaskPromise<void> : public TaskPromiseBase {
+  Task<void> get_return_object();
+
+  void return_void() {}
+
+  void take_result() {
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+  }
+};
+
+// A self-destroying coroutine started on the worker pool, used to drive
+// tasks that nobody co_awaits.
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() {
+      return DetachedTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    std::suspend_never final_suspend() noexcept { return {}; }
+
+    void return_void() {}
+
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  void Start() {
+    std::coroutine_handle<promise_type> coro_handle = handle;
+    PostFunc([coro_handle] { coro_handle.resume(); });
+  }
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+}  // namespace internal
+
+template <class T>
+class [[nodiscard]] Task {
+ public:
+  using promise_type = internal::TaskPromise<T>;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  struct Awaiter {
+    bool await_ready() const noexcept { return !handle || handle.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept {
+      handle.promise().continuation = continuation;
+      return handle;
+    }
+
+    T await_resume() { return handle.promise().take_result(); }
+
+    Handle handle;
+  };
+
+  Task() = default;
+
+  explicit Task(Handle handle) : m_handle(handle) {}
+
+  Task(Task&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      reset();
+      m_handle = std::exchange(other.m_handle, nullptr);
+    }
+    return *this;
+  }
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+  ~Task() { reset(); }
+
+  bool valid() const { return static_cast<bool>(m_handle); }
+
+  bool done() const { return m_handle && m_handle.done(); }
+
+  Awaiter operator co_await() const noexcept { return Awaiter{m_handle}; }
+
+ private:
+  void reset() {
+    if (m_handle) {
+      m_handle.destroy();
+      m_handle = nullptr;
+    }
+  }
+
+  Handle m_handle;
+};
+
+namespace internal {
+
+template <class T>
+Task<T> TaskPromise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+struct ScheduleAwaiter {
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> handle) const {
+    PostFunc([handle] { handle.resume(); });
+  }
+
+  void await_resume() const noexcept {}
+};
+
+struct SleepAwaiter {
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> handle) const {
+    PostDelayedFunc([handle] { handle.resume(); }, micro_secs);
+  }
+
+  void await_resume() const noexcept {}
+
+  uint64_t micro_secs;
+};
+
+template <class T>
+struct SyncWaitState {
+  void notify() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      done = true;
+    }
+    cond.notify_all();
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return done; });
+  }
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool done = false;
+  std::exception_ptr exception;
+  std::optional<T> result;
+};
+
+template <class T>
+DetachedTask SyncWaitRunner(Task<T> task, SyncWaitState<T>* state) {
+  try {
+    state->result.emplace(co_await task);
+  } catch (...) {
+    state->exception = std::current_exception();
+  }
+  state->notify();
+}
+
+inline DetachedTask SyncWaitRunner(Task<void> task, SyncWaitState<bool>* state) {
+  try {
+    co_await task;
+  } catch (...) {
+    state->exception = std::current_exception();
+  }
+  state->notify();
+}
+
+// Shared by WhenAll children and the parent. The counter starts at n + 1:
+// every child and the parent itself decrement it once, whoever reaches zero
+// resumes (or keeps running) the parent.
+struct WhenAllState {
+  explicit WhenAllState(size_t n) : pending(n + 1) {}
+
+  bool arrive() { return pending.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+
+  std::atomic<size_t> pending;
+  std::coroutine_handle<> parent;
+  std::mutex mutex;
+  std::exception_ptr exception;
+};
+
+struct WhenAllAwaiter {
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    state->parent = handle;
+    for (auto& child : children) {
+      child.Start();
+    }
+    return !state->arrive();
+  }
+
+  void await_resume() const noexcept {}
+
+  WhenAllState* state;
+  std::vector<DetachedTask>& children;
+};
+
+template <class T>
+DetachedTask WhenAllChild(Task<T> task, WhenAllState* state, std::optional<T>* result) {
+  try {
+    result->emplace(co_await task);
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (!state->exception) {
+      state->exception = std::current_exception();
+    }
+  }
+  if (state->arrive()) {
+    state->parent.resume();
+  }
+}
+
+inline DetachedTask WhenAllChild(Task<void> task, WhenAllState* state) {
+  try {
+    co_await task;
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (!state->exception) {
+      state->exception = std::current_exception();
+    }
+  }
+  if (state->arrive()) {
+    state->parent.resume();
+  }
+}
+
+// Outlives the WhenAny parent, losers keep running after the winner resumed
+// it. The counter starts at 2: the parent and the winner decrement it once.
+template <class T>
+struct WhenAnyState {
+  bool arrive() { return pending.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+
+  std::atomic<bool> finished{false};
+  std::atomic<size_t> pending{2};
+  std::coroutine_handle<> parent;
+  size_t index = 0;
+  std::exception_ptr exception;
+  std::optional<T> result;
+};
+
+template <class T>
+struct WhenAnyAwaiter {
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    state->parent = handle;
+    for (auto& child : children) {
+      child.Start();
+    }
+    return !state->arrive();
+  }
+
+  void await_resume() const noexcept {}
+
+  // Not a shared_ptr: g++ 12 destroys a braced co_await operand twice, the
+  // frame of WhenAny holds the state meanwhile
+  WhenAnyState<T>* state;
+  std::vector<DetachedTask>& children;
+};
+
+template <class T>
+DetachedTask WhenAnyChild(Task<T> task, std::shared_ptr<WhenAnyState<T>> state, size_t index) {
+  std::optional<T> result;
+  std::exception_ptr exception;
+  try {
+    result.emplace(co_await task);
+  } catch (...) {
+    exception = std::current_exception();
+  }
+  if (!state->finished.exchange(true, std::memory_order_acq_rel)) {
+    state->index = index;
+    state->result = std::move(result);
+    state->exception = exception;
+    if (state->arrive()) {
+      state->parent.resume();
+    }
+  }
+}
+
+inline DetachedTask WhenAnyChild(Task<void> task, std::shared_ptr<WhenAnyState<bool>> state, size_t index) {
+  std::exception_ptr exception;
+  try {
+    co_await task;
+  } catch (...) {
+    exception = std::current_exception();
+  }
+  if (!state->finished.exchange(true, std::memory_order_acq_rel)) {
+    state->index = index;
+    state->exception = exception;
+    if (state->arrive()) {
+      state->parent.resume();
+    }
+  }
+}
+
+}  // namespace internal
+
+// Continue the current task on a worker of the pool.
+inline internal::ScheduleAwaiter Schedule() { return internal::ScheduleAwaiter{}; }
+
+// Suspend the current task for micro_secs without occupying a thread.
+inline internal::SleepAwaiter CoroSleepAsync(uint64_t micro_secs) { return internal::SleepAwaiter{micro_secs}; }
+
+// Start a task on the worker pool and block the calling thread until it
+// finished. Must not be called from a worker thread.
+template <class T>
+T SyncWait(Task<T> task) {
+  internal::SyncWaitState<T> state;
+  internal::SyncWaitRunner(std::move(task), &state).Start();
+  state.wait();
+  if (state.exception) {
+    std::rethrow_exception(state.exception);
+  }
+  return std::move(*state.result);
+}
+
+inline void SyncWait(Task<void> task) {
+  internal::SyncWaitState<bool> state;
+  internal::SyncWaitRunner(std::move(task), &state).Start();
+  state.wait();
+  if (state.exception) {
+    std::rethrow_exception(state.exception);
+  }
+}
+
+// Start a task on the worker pool without waiting for it.
+inline void Spawn(Task<void> task) {
+  [](Task<void> t) -> internal::DetachedTask { co_await t; }(std::move(task)).Start();
+}
+
+// Run all tasks concurrently on the worker pool, results keep the input
+// order. The first exception is rethrown after every task finished.
+template <class T>
+Task<std::vector<T>> WhenAll(std::vector<Task<T>> tasks) {
+  internal::WhenAllState state(tasks.size());
+  std::vector<std::optional<T>> results(tasks.size());
+  std::vector<internal::DetachedTask> children;
+  children.reserve(tasks.size());
+  for (size_t i = 0; i < tasks.size(); i++) {
+    children.push_back(internal::WhenAllChild(std::move(tasks[i]), &state, &results[i]));
+  }
+  co_await internal::WhenAllAwaiter{&state, children};
+  if (state.exception) {
+    std::rethrow_exception(state.exception);
+  }
+  std::vector<T> values;
+  values.reserve(results.size());
+  for (auto& result : results) {
+    values.push_back(std::move(*result));
+  }
+  co_return values;
+}
+
+inline Task<void> WhenAll(std::vector<Task<void>> tasks) {
+  internal::WhenAllState state(tasks.size());
+  std::vector<internal::DetachedTask> children;
+  children.reserve(tasks.size());
+  for (auto& task : tasks) {
+    children.push_back(internal::WhenAllChild(std::move(task), &state));
+  }
+  co_await internal::WhenAllAwaiter{&state, children};
+  if (state.exception) {
+    std::rethrow_exception(state.exception);
+  }
+}
+
+// Run all tasks concurrently on the worker pool and complete with the index
+// and result of the first one to finish. The others keep running detached.
+// tasks must not be empty.
+template <class T>
+Task<std::pair<size_t, T>> WhenAny(std::vector<Task<T>> tasks) {
+  auto state = std::make_shared<internal::WhenAnyState<T>>();
+  std::vector<internal::DetachedTask> children;
+  children.reserve(tasks.size());
+  for (size_t i = 0; i < tasks.size(); i++) {
+    children.push_back(internal::WhenAnyChild(std::move(tasks[i]), state, i));
+  }
+  co_await internal::WhenAnyAwaiter<T>{state.get(), children};
+  if (state->exception) {
+    std::rethrow_exception(state->exception);
+  }
+  co_return std::make_pair(state->index, std::move(*state->result));
+}
+
+inline Task<size_t> WhenAny(std::vector<Task<void>> tasks) {
+  auto state = std::make_shared<internal::WhenAnyState<bool>>();
+  std::vector<internal::DetachedTask> children;
+  children.reserve(tasks.size());
+  for (size_t i = 0; i < tasks.size(); i++) {
+    children.push_back(internal::WhenAnyChild(std::move(tasks[i]), state, i));
+  }
+  co_await internal::WhenAnyAwaiter<bool>{state.get(), children};
+  if (state->exception) {
+    std::rethrow_exception(state->exception);
+  }
+  co_return state->index;
+}
+
+}  // namespace cpp_lib
@@ -0,0 +1,56 @@
+/**
+ * Checks of the stackless tasks, run with
+ *
+ *   bazel test --config=cxx20 //cpp_lib/coro:task_test
+ *
+ * Best run under ASan: the WhenAny losers finish after their parent resumed
+ * and must still find the shared state alive.
+ */
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "cpp_lib/coro/task.h"
+
+namespace {
+
+cpp_lib::Task<int> SleepValue(uint64_t micro_secs, int value) {
+  co_await cpp_lib::CoroSleepAsync(micro_secs);
+  co_return value;
+}
+
+cpp_lib::Task<void> Sleep(uint64_t micro_secs) { co_await cpp_lib::CoroSleepAsync(micro_secs); }
+
+// Two children, the first finishing long before the second
+bool CheckWhenAny() {
+  std::vector<cpp_lib::Task<int>> tasks;
+  tasks.push_back(SleepValue(1000, 1));
+  tasks.push_back(SleepValue(20000, 2));
+  std::pair<size_t, int> first = cpp_lib::SyncWait(cpp_lib::WhenAny(std::move(tasks)));
+  if (first.first != 0 || first.second != 1) {
+    fprintf(stderr, "WhenAny returned %zu %d, expected 0 1\n", first.first, first.second);
+    return false;
+  }
+  std::vector<cpp_lib::Task<void>> void_tasks;
+  void_tasks.push_back(Sleep(20000));
+  void_tasks.push_back(Sleep(1000));
+  size_t index = cpp_lib::SyncWait(cpp_lib::WhenAny(std::move(void_tasks)));
+  if (index != 1) {
+    fprintf(stderr, "WhenAny of void tasks returned %zu, expected 1\n", index);
+    return false;
+  }
+  // Let the losers finish while the test is still running
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  return true;
+}
+
+}  // namespace
+
+int main() {
+  if (!CheckWhenAny()) {
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
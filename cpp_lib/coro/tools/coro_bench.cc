@@ -0,0 +1,173 @@
+/**
+ * Microbenchmarks of the coro runtime, printed as CSV:
+ *
+ *   coro_bench [--bench=spawn,switch] [--mode=stackful|thread] [--workers=N]
+ *              [--tasks=N] [--batch=N] [--coros=N] [--yields=N]
+ *
+ * spawn measures the throughput of short tasks, StartCoroFunc followed by
+ * CoroJoin, against one std::thread per task as StartCoroFunc used to run
+ * them. Tasks are started batch at a time from the main thread and joined
+ * before the next batch is started, so at most batch tasks are alive at once.
+ *
+ * switch starts coros coroutines which each call CoroYield yields times and
+ * reports the context switches per second and the time of one. In thread
+ * mode CoroYield is std::this_thread::yield, for comparison.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpp_lib/coro/coro.h"
+
+namespace {
+
+std::vector<std::string> split(const std::string& str) {
+  std::vector<std::string> parts;
+  size_t begin = 0;
+  while (begin <= str.size()) {
+    size_t end = str.find(',', begin);
+    if (end == std::string::npos) {
+      end = str.size();
+    }
+    if (end > begin) {
+      parts.push_back(str.substr(begin, end - begin));
+    }
+    begin = end + 1;
+  }
+  return parts;
+}
+
+bool parse_flag(const char* arg, const char* name, std::string& value) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+    return false;
+  }
+  value = arg + len + 1;
+  return true;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::atomic<size_t> g_counter{0};
+
+void task() { g_counter.fetch_add(1, std::memory_order_relaxed); }
+
+// Context switches per second of coros coroutines yielding yields times each
+double run_switches(size_t coros, size_t yields) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<cpp_lib::CoroPtr> started;
+  for (size_t i = 0; i < coros; i++) {
+    started.push_back(cpp_lib::StartCoroFunc([yields] {
+      for (size_t j = 0; j < yields; j++) {
+        cpp_lib::CoroYield();
+      }
+    }));
+  }
+  for (const cpp_lib::CoroPtr& coro : started) {
+    cpp_lib::CoroJoin(coro);
+  }
+  return coros * yields / seconds_since(start);
+}
+
+// Tasks per second of a std::thread per task
+double run_threads(size_t tasks, size_t batch) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t done = 0; done < tasks; done += batch) {
+    for (size_t i = done; i < tasks && i < done + batch; i++) {
+      threads.emplace_back(task);
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    threads.clear();
+  }
+  return tasks / seconds_since(start);
+}
+
+// Tasks per second of StartCoroFunc
+double run_coros(size_t tasks, size_t batch) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<cpp_lib::CoroPtr> coros;
+  for (size_t done = 0; done < tasks; done += batch) {
+    for (size_t i = done; i < tasks && i < done + batch; i++) {
+      coros.push_back(cpp_lib::StartCoroFunc(task));
+    }
+    for (const cpp_lib::CoroPtr& coro : coros) {
+      cpp_lib::CoroJoin(coro);
+    }
+    coros.clear();
+  }
+  return tasks / seconds_since(start);
+}
+
+void usage() {
+  fprintf(stderr,
+          "usage: coro_bench [--bench=spawn,switch] [--mode=stackful|thread] [--workers=N] [--tasks=N] [--batch=N] "
+          "[--coros=N] [--yields=N]\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string bench_flag = "spawn,switch";
+  std::string mode_flag = "stackful";
+  std::string workers_flag = "0";
+  std::string tasks_flag = "100000";
+  std::string batch_flag = "1000";
+  std::string coros_flag = "1000";
+  std::string yields_flag = "1000";
+  for (int i = 1; i < argc; i++) {
+    if (!parse_flag(argv[i], "--bench", bench_flag) && !parse_flag(argv[i], "--mode", mode_flag) &&
+        !parse_flag(argv[i], "--workers", workers_flag) && !parse_flag(argv[i], "--tasks", tasks_flag) &&
+        !parse_flag(argv[i], "--batch", batch_flag) && !parse_flag(argv[i], "--coros", coros_flag) &&
+        !parse_flag(argv[i], "--yields", yields_flag)) {
+      usage();
+      return 1;
+    }
+  }
+  if (mode_flag != "stackful" && mode_flag != "thread") {
+    usage();
+    return 1;
+  }
+  size_t tasks = strtoull(tasks_flag.c_str(), nullptr, 10);
+  size_t batch = std::max<size_t>(1, strtoull(batch_flag.c_str(), nullptr, 10));
+  size_t coros = strtoull(coros_flag.c_str(), nullptr, 10);
+  size_t yields = strtoull(yields_flag.c_str(), nullptr, 10);
+
+  cpp_lib::CoroOptions options;
+  options.mode = mode_flag == "thread" ? cpp_lib::kCoroThreadMode : cpp_lib::kCoroStackfulMode;
+  options.worker_num = strtoull(workers_flag.c_str(), nullptr, 10);
+  cpp_lib::InitCoro(options);
+  fprintf(stderr, "%s mode, %zu workers\n", mode_flag.c_str(), cpp_lib::CoroWorkerNum());
+
+  printf("bench,ops_per_sec,ns_per_op\n");
+  for (const std::string& bench : split(bench_flag)) {
+    if (bench == "spawn") {
+      g_counter.store(0);
+      double thread_rate = run_threads(tasks, batch);
+      double coro_rate = run_coros(tasks, batch);
+      if (g_counter.load() != 2 * tasks) {
+        fprintf(stderr, "ran %zu tasks instead of %zu\n", g_counter.load(), 2 * tasks);
+        return 1;
+      }
+      printf("spawn_std_thread,%.0f,%.1f\n", thread_rate, 1e9 / thread_rate);
+      printf("spawn_start_coro_func,%.0f,%.1f\n", coro_rate, 1e9 / coro_rate);
+    } else if (bench == "switch") {
+      double rate = run_switches(coros, yields);
+      printf("switch_coro_yield,%.0f,%.1f\n", rate, 1e9 / rate);
+    } else {
+      fprintf(stderr, "unknown bench %s\n", bench.c_str());
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -16,6 +16,16 @@ int64_t GetCurrentTimeMinutes() { return GetCurrentTimeSeconds() / 60L; }
 
 int64_t GetCurrentTimeHours() { return GetCurrentTimeMinutes() / 60L; }
 
+int64_t GetCoarseTimeMillis() {
+#ifdef CLOCK_REALTIME_COARSE
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000L + ts.tv_nsec / 1000000L;
+#else
+  return GetCurrentTimeMillis();
+#endif
+}
+
 int32_t GetIntervalMin(const int32_t& timestamp) {
   int64_t cur_time = GetCurrentTimeSeconds();
   int64_t time_interval = cur_time - timestamp;
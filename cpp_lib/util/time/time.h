@@ -18,6 +18,11 @@ int64_t GetCurrentTimeMinutes();
 
 int64_t GetCurrentTimeHours();
 
+// Milliseconds since the epoch from the coarse realtime clock. The resolution
+// is one kernel tick (1-4ms) but it is read from the vDSO without a syscall
+// and costs a few nanoseconds, for hot paths such as cache expiry checks.
+int64_t GetCoarseTimeMillis();
+
 int32_t GetIntervalDay(const int32_t& timestamp);
 
 int32_t GetIntervalHour(const int32_t& timestamp);